@@ -0,0 +1,289 @@
+//
+//  accesslog.c
+//  ex_3
+//
+
+#include "accesslog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#define TRUE 1
+#define FALSE 0
+#define AL_LINE_LEN 256
+#define AL_TIMEBUF 64
+#define AL_IDLE_NS 20000000L    //writer nap when all rings are empty
+#define LOG_TIMEFMT "[%d/%b/%Y:%H:%M:%S +0000]"
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static void* al_writer(void* p);
+static al_ring* al_thread_ring(accesslog* log);
+static int al_drain(accesslog* log);
+static int al_format(const al_record* rec, char* line, time_t* last_sec,
+                     char* timebuf);
+static void al_writev_all(int fd, struct iovec* iov, int iovcnt);
+static int al_open(const char* path);
+static void al_signal_handler(int signum);
+
+static __thread al_ring* thread_ring = NULL;
+static __thread accesslog* thread_ring_owner = NULL;
+static accesslog* rotate_target = NULL;
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+accesslog* create_accesslog(const char* path){
+    accesslog* log = (accesslog*)calloc(1, sizeof(accesslog));
+    if (!log)
+        return NULL;
+
+    log->path = strdup(path);
+    if (!log->path){
+        free(log);
+        return NULL;
+    }
+    log->fd = al_open(path);
+    if (log->fd == -1){
+        perror("Error on access log open");
+        free(log->path);
+        free(log);
+        return NULL;
+    }
+    if (pthread_create(&log->writer, NULL, al_writer, log) != 0){
+        close(log->fd);
+        free(log->path);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+//----------------------------------------------------------------------------//
+void al_write(accesslog* log, const al_record* record){
+    al_ring* ring = al_thread_ring(log);
+    if (!ring){
+        atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    unsigned long head = atomic_load_explicit(&ring->head,
+                                              memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&ring->tail,
+                                              memory_order_acquire);
+    if (head - tail >= AL_RING_SIZE){
+        atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring->records[head & (AL_RING_SIZE-1)] = *record;
+    atomic_store_explicit(&ring->head, head+1, memory_order_release);
+}
+
+//----------------------------------------------------------------------------//
+void al_rotate_on_signal(accesslog* log, int signum){
+    rotate_target = log;
+    signal(signum, al_signal_handler);
+}
+
+//----------------------------------------------------------------------------//
+int64_t al_now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+//----------------------------------------------------------------------------//
+void destroy_accesslog(accesslog* log){
+    int i;
+    if (!log)
+        return;
+    if (rotate_target == log)
+        rotate_target = NULL;
+
+    atomic_store(&log->shutdown, TRUE);
+    pthread_join(log->writer, NULL);
+
+    for (i=0; i<atomic_load(&log->num_rings) && i<AL_MAX_RINGS; i++)
+        free(log->rings[i]);
+    close(log->fd);
+    free(log->path);
+    free(log);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the ring of the calling thread, allocated and registered on first use
+ */
+static al_ring* al_thread_ring(accesslog* log){
+    if (thread_ring_owner == log)
+        return thread_ring;
+
+    int index = atomic_fetch_add(&log->num_rings, 1);
+    if (index >= AL_MAX_RINGS)
+        return NULL;
+    al_ring* ring = (al_ring*)calloc(1, sizeof(al_ring));
+    log->rings[index] = ring; //may stay NULL, the writer skips it
+    thread_ring = ring;
+    thread_ring_owner = log;
+    return ring;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * The work function of the writer thread
+ */
+static void* al_writer(void* p){
+    accesslog* log = (accesslog*)p;
+    struct timespec nap = {0, AL_IDLE_NS};
+    int done, drained;
+
+    while (TRUE) {
+        done = atomic_load(&log->shutdown);
+        if (log->reopen){
+            log->reopen = FALSE;
+            int fd = al_open(log->path);
+            if (fd != -1){
+                close(log->fd);
+                log->fd = fd;
+            }
+        }
+
+        drained = al_drain(log);
+
+        unsigned long dropped = atomic_load_explicit(&log->dropped,
+                                                     memory_order_relaxed);
+        if (dropped != log->dropped_reported){
+            char line[AL_LINE_LEN];
+            int len = snprintf(line, AL_LINE_LEN,
+                               "# %lu access log records dropped\n",
+                               dropped - log->dropped_reported);
+            struct iovec iov = {line, (size_t)len};
+            al_writev_all(log->fd, &iov, 1);
+            log->dropped_reported = dropped;
+        }
+
+        if (done && !drained)
+            break;
+        if (!drained)
+            nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * formats everything currently in the rings, AL_BATCH lines per writev().
+ * returns the number of records written.
+ */
+static int al_drain(accesslog* log){
+    static char lines[AL_BATCH][AL_LINE_LEN]; //only touched by the writer
+    struct iovec iov[AL_BATCH];
+    char timebuf[AL_TIMEBUF];
+    time_t last_sec = -1;
+    int count = 0, total = 0;
+    int i, num_rings;
+
+    num_rings = atomic_load(&log->num_rings);
+    if (num_rings > AL_MAX_RINGS)
+        num_rings = AL_MAX_RINGS;
+
+    for (i=0; i<num_rings; i++) {
+        al_ring* ring = log->rings[i];
+        if (!ring)
+            continue;
+        unsigned long tail = atomic_load_explicit(&ring->tail,
+                                                  memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&ring->head,
+                                                  memory_order_acquire);
+        for (; tail != head; tail++) {
+            const al_record* rec = &ring->records[tail & (AL_RING_SIZE-1)];
+            iov[count].iov_base = lines[count];
+            iov[count].iov_len = al_format(rec, lines[count],
+                                           &last_sec, timebuf);
+            count++;
+            if (count == AL_BATCH){
+                atomic_store_explicit(&ring->tail, tail+1,
+                                      memory_order_release);
+                al_writev_all(log->fd, iov, count);
+                total += count;
+                count = 0;
+            }
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    if (count){
+        al_writev_all(log->fd, iov, count);
+        total += count;
+    }
+    return total;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * common log format line, with the serving time appended.
+ * the date string is cached while records stay in the same second.
+ */
+static int al_format(const al_record* rec, char* line, time_t* last_sec,
+                     char* timebuf){
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in;
+    struct tm tm;
+    time_t sec = (time_t)(rec->time_us / 1000000);
+    int len;
+
+    if (sec != *last_sec){
+        gmtime_r(&sec, &tm);
+        strftime(timebuf, AL_TIMEBUF, LOG_TIMEFMT, &tm);
+        *last_sec = sec;
+    }
+    in.s_addr = rec->addr;
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+    len = snprintf(line, AL_LINE_LEN, "%s - - %s \"%s\" %d %lu %uus\n",
+                   addr, timebuf, rec->request, rec->status, rec->bytes,
+                   rec->duration_us);
+    if (len >= AL_LINE_LEN){
+        len = AL_LINE_LEN-1;
+        line[len-1] = '\n';
+    }
+    return len;
+}
+
+//----------------------------------------------------------------------------//
+static void al_writev_all(int fd, struct iovec* iov, int iovcnt){
+    ssize_t wc;
+    while (iovcnt > 0) {
+        wc = writev(fd, iov, iovcnt);
+        if (wc < 0){
+            if (errno == EINTR)
+                continue;
+            return; //nothing sane to do, the records are lost
+        }
+        while (iovcnt > 0 && (size_t)wc >= iov->iov_len){
+            wc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0){
+            iov->iov_base = (char*)iov->iov_base + wc;
+            iov->iov_len -= wc;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------//
+static int al_open(const char* path){
+    return open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+}
+
+//----------------------------------------------------------------------------//
+static void al_signal_handler(int signum){
+    if (rotate_target)
+        rotate_target->reopen = TRUE;
+}
@@ -0,0 +1,95 @@
+//
+//  accesslog.h
+//  ex_3
+//
+
+#ifndef accesslog_h
+#define accesslog_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include "threadpool.h"
+
+// records in every per thread ring, must be a power of two
+#define AL_RING_SIZE 1024
+// one ring per pool thread, plus the accepting thread
+#define AL_MAX_RINGS (MAXT_IN_POOL+1)
+// request line bytes kept in a record, longer lines are truncated
+#define AL_REQ_LEN 100
+// records the writer thread formats into one writev() call
+#define AL_BATCH 64
+
+
+/**
+ * fixed size entry a worker drops into its ring, formatting is left
+ * to the writer thread
+ */
+typedef struct _al_record {
+    int64_t time_us;        //wall clock time the request started
+    uint32_t addr;          //peer IPv4 address, network order
+    int status;             //response status code
+    unsigned long bytes;    //bytes written to the client
+    uint32_t duration_us;   //time spent serving the request
+    char request[AL_REQ_LEN];   //request line, '\0' terminated
+} al_record;
+
+
+/**
+ * single producer, single consumer ring. head is only written by the
+ * owning worker and tail only by the writer thread.
+ */
+typedef struct _al_ring {
+    _Atomic unsigned long head;     //next slot to fill
+    _Atomic unsigned long tail;     //next slot to drain
+    al_record records[AL_RING_SIZE];
+} al_ring;
+
+
+/**
+ * The access log
+ */
+typedef struct _accesslog_st {
+    char* path;
+    int fd;
+    pthread_t writer;
+    al_ring* rings[AL_MAX_RINGS];
+    _Atomic int num_rings;              //rings handed out so far
+    _Atomic unsigned long dropped;      //records lost to full rings
+    unsigned long dropped_reported;     //writer's copy of dropped
+    volatile sig_atomic_t reopen;       //1 if rotation was requested
+    _Atomic int shutdown;               //1 if the log is being destroyed
+} accesslog;
+
+
+/**
+ * create_accesslog opens (appends to) the log file and starts the
+ * writer thread. returns NULL on failure.
+ */
+accesslog* create_accesslog(const char* path);
+
+/**
+ * al_write copies a record into the calling thread's ring. never blocks
+ * and never takes a lock, a full ring drops the record and counts it.
+ */
+void al_write(accesslog* log, const al_record* record);
+
+/**
+ * al_rotate_on_signal makes signum reopen the log file, so it can be
+ * moved away by an external rotation tool.
+ */
+void al_rotate_on_signal(accesslog* log, int signum);
+
+/**
+ * al_now_us returns the wall clock in microseconds, for al_record stamps.
+ */
+int64_t al_now_us(void);
+
+/**
+ * destroy_accesslog writes out every pending record, stops the writer
+ * thread and closes the file.
+ */
+void destroy_accesslog(accesslog* log);
+
+#endif /* accesslog_h */
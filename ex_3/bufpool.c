@@ -0,0 +1,77 @@
+//
+//  bufpool.c
+//  ex_3
+//
+
+#include "bufpool.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+/**
+ * an idle buffer, the link is kept in the buffer itself
+ */
+typedef struct _bp_free {
+    struct _bp_free* next;
+} bp_free;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static bp_free* idle = NULL;
+static unsigned long num_idle = 0;
+static unsigned long num_lent = 0;
+
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+void* bp_get(void){
+    bp_free* buf;
+    pthread_mutex_lock(&pool_lock);
+    buf = idle;
+    if (buf){
+        idle = buf->next;
+        num_idle--;
+    }
+    num_lent++;
+    pthread_mutex_unlock(&pool_lock);
+    if (!buf && !(buf = (bp_free*)malloc(BP_BUF_SIZE))){
+        pthread_mutex_lock(&pool_lock);
+        num_lent--;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return buf;
+}
+
+//----------------------------------------------------------------------------//
+void bp_put(void* buf){
+    if (!buf)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    num_lent--;
+    if (num_idle < BP_POOL_BUFS){
+        ((bp_free*)buf)->next = idle;
+        idle = (bp_free*)buf;
+        num_idle++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(buf);
+}
+
+//----------------------------------------------------------------------------//
+void bp_stats(unsigned long* lent, unsigned long* pooled){
+    pthread_mutex_lock(&pool_lock);
+    *lent = num_lent;
+    *pooled = num_idle;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+//----------------------------------------------------------------------------//
+void bp_release(void){
+    bp_free* buf;
+    pthread_mutex_lock(&pool_lock);
+    while ((buf = idle)) {
+        idle = buf->next;
+        free(buf);
+    }
+    num_idle = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,37 @@
+//
+//  bufpool.h
+//  ex_3
+//
+
+#ifndef bufpool_h
+#define bufpool_h
+
+// bytes in every buffer
+#define BP_BUF_SIZE 16384
+// idle buffers kept for the next borrower, more are freed
+#define BP_POOL_BUFS 256
+
+
+/**
+ * bp_get lends a buffer of BP_BUF_SIZE bytes, NULL if out of memory.
+ * buffers are meant to be held only while data is in flight, so a
+ * connection waiting for its client holds none.
+ */
+void* bp_get(void);
+
+/**
+ * bp_put returns a buffer from bp_get(), NULL is ignored
+ */
+void bp_put(void* buf);
+
+/**
+ * bp_stats reports the buffers lent out and the idle ones kept
+ */
+void bp_stats(unsigned long* lent, unsigned long* pooled);
+
+/**
+ * bp_release frees the idle buffers
+ */
+void bp_release(void);
+
+#endif /* bufpool_h */
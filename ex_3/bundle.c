@@ -0,0 +1,121 @@
+//
+//  bundle.c
+//  ex_3
+//
+
+#include "bundle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+bundle* open_bundle(const char* path){
+    struct stat statbuf;
+    const bundle_header* header;
+    bundle* b;
+    void* base;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &statbuf) == -1 ||
+        (size_t)statbuf.st_size < sizeof(bundle_header)){
+        perror("Error on bundle open");
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED){
+        perror("Error on bundle mmap");
+        close(fd);
+        return NULL;
+    }
+
+    header = (const bundle_header*)base;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BUNDLE_VERSION ||
+        header->file_size != (uint64_t)statbuf.st_size ||
+        header->seeds_off + header->num_buckets*sizeof(uint32_t) >
+                                                        header->file_size ||
+        header->slots_off + header->num_slots*sizeof(uint32_t) >
+                                                        header->file_size ||
+        header->entries_off + header->num_entries*sizeof(bundle_entry) >
+                                                        header->file_size ||
+        header->num_buckets == 0 || header->num_slots == 0){
+        fprintf(stderr, "Error on bundle open: %s is not a valid bundle\n",
+                path);
+        munmap(base, statbuf.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    b = (bundle*)malloc(sizeof(bundle));
+    if (!b){
+        munmap(base, statbuf.st_size);
+        close(fd);
+        return NULL;
+    }
+    b->fd = fd;
+    b->base = (const unsigned char*)base;
+    b->size = statbuf.st_size;
+    b->header = header;
+    b->seeds = (const uint32_t*)(b->base+header->seeds_off);
+    b->slots = (const uint32_t*)(b->base+header->slots_off);
+    b->entries = (const bundle_entry*)(b->base+header->entries_off);
+    return b;
+}
+
+//----------------------------------------------------------------------------//
+const bundle_entry* bundle_lookup(bundle* b, const char* path, size_t len){
+    uint32_t bucket = bundle_hash(path, len, 0) % b->header->num_buckets;
+    uint32_t slot = bundle_hash(path, len, b->seeds[bucket]) %
+                                                    b->header->num_slots;
+    uint32_t index = b->slots[slot];
+    const bundle_entry* entry;
+
+    if (index == BUNDLE_NO_ENTRY || index >= b->header->num_entries)
+        return NULL;
+    /*the hash is perfect only for the packed paths, anything else has to
+     *be compared*/
+    entry = &b->entries[index];
+    if (entry->path_len != len ||
+        memcmp(b->base+entry->path_off, path, len) != 0)
+        return NULL;
+    return entry;
+}
+
+//----------------------------------------------------------------------------//
+const char* bundle_string(bundle* b, uint64_t off){
+    return (const char*)b->base+off;
+}
+
+//----------------------------------------------------------------------------//
+uint32_t bundle_hash(const char* key, size_t len, uint32_t seed){
+    uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ULL);
+    size_t i;
+    for (i=0; i<len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    /*murmur3 finalizer, spreads FNV's weak low bits*/
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+//----------------------------------------------------------------------------//
+void close_bundle(bundle* b){
+    if (!b)
+        return;
+    munmap((void*)b->base, b->size);
+    close(b->fd);
+    free(b);
+}
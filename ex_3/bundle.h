@@ -0,0 +1,104 @@
+//
+//  bundle.h
+//  ex_3
+//
+
+#ifndef bundle_h
+#define bundle_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUNDLE_MAGIC "EX3BNDL1"
+#define BUNDLE_VERSION 1
+// payloads of at least a page start on a page boundary, others on 64 bytes
+#define BUNDLE_PAGE 4096
+#define BUNDLE_ALIGN 64
+#define BUNDLE_NO_ENTRY 0xffffffffu
+
+// variants of a file, an empty variant has data_len 0 and headers_off 0
+#define BUNDLE_IDENTITY 0
+#define BUNDLE_GZIP 1
+#define BUNDLE_VARIANTS 2
+
+
+/**
+ * file layout: header, bucket seeds, slots, entries, strings, payloads.
+ * every offset is from the start of the file. all integers are in host
+ * order, a bundle is built on the machine (architecture) serving it.
+ */
+typedef struct _bundle_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t num_buckets;
+    uint32_t num_slots;
+    uint64_t seeds_off;     //uint32_t[num_buckets]
+    uint64_t slots_off;     //uint32_t[num_slots], entry index or NO_ENTRY
+    uint64_t entries_off;   //bundle_entry[num_entries]
+    uint64_t file_size;
+} bundle_header;
+
+typedef struct _bundle_variant {
+    uint64_t data_off;
+    uint64_t data_len;
+    uint64_t headers_off;   //pre-rendered HTTP/1 header lines
+    uint32_t headers_len;
+    uint32_t reserved;
+} bundle_variant;
+
+typedef struct _bundle_entry {
+    uint64_t path_off;      //request path without the leading '/'
+    uint32_t path_len;
+    uint32_t reserved;
+    int64_t mtime;
+    uint64_t mime_off;      //0 if the type is unknown
+    uint64_t last_modified_off;
+    bundle_variant variants[BUNDLE_VARIANTS];
+} bundle_entry;
+
+
+/**
+ * an open, mapped bundle
+ */
+typedef struct _bundle_st {
+    int fd;
+    const unsigned char* base;
+    size_t size;
+    const bundle_header* header;
+    const uint32_t* seeds;
+    const uint32_t* slots;
+    const bundle_entry* entries;
+} bundle;
+
+
+/**
+ * open_bundle maps a bundle file and checks its header. nothing is done
+ * per entry, so opening costs the same for any number of files.
+ * returns NULL on failure, after printing the reason.
+ */
+bundle* open_bundle(const char* path);
+
+/**
+ * bundle_lookup finds the entry of a path (no leading '/') with one probe
+ * of the perfect hash. returns NULL if the path is not in the bundle.
+ */
+const bundle_entry* bundle_lookup(bundle* b, const char* path, size_t len);
+
+/**
+ * bundle_string returns the '\0' terminated string stored at off.
+ */
+const char* bundle_string(bundle* b, uint64_t off);
+
+/**
+ * bundle_hash is the seeded hash behind the perfect hash index, shared
+ * by the packer and the server.
+ */
+uint32_t bundle_hash(const char* key, size_t len, uint32_t seed);
+
+/**
+ * close_bundle unmaps and closes the bundle.
+ */
+void close_bundle(bundle* b);
+
+#endif /* bundle_h */
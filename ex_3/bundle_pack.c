@@ -0,0 +1,536 @@
+//
+//  bundle_pack.c
+//  ex_3
+//
+//  Packs a directory into an asset bundle served by "server -B".
+//  cc -o bundle_pack bundle_pack.c bundle.c mime.c -lz
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "bundle.h"
+#include "mime.h"
+
+#define USAGE "Usage: bundle_pack <directory> <output> [-z]\n"
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+#define TIMEBUF 128
+#define HEADERS_SIZE 512
+#define SUCCESS 0
+#define FAILURE -1
+#define TRUE 1
+#define FALSE 0
+// bodies smaller than this are not worth a compressed variant
+#define GZIP_MIN_SIZE 256
+// seeds tried for one bucket before the slot table is grown
+#define MAX_SEED_TRIES (1 << 20)
+
+typedef struct _pack_file {
+    char* path;             //relative to the packed directory
+    struct stat statbuf;
+    unsigned char* gzip;    //compressed body, NULL if not worth it
+    unsigned long gzip_len;
+}pack_file;
+
+typedef struct _pack_attributes {
+    pack_file* files;
+    uint32_t num_files;
+    uint32_t capacity;
+    dev_t out_dev;          //the output file is never packed into itself
+    ino_t out_ino;
+    char* strings;
+    size_t strings_len;
+    size_t strings_capacity;
+}pack_attribs;
+
+//----------------------------------------------------------------------------//
+//--------------------------FUNCTION DECLARATION------------------------------//
+//----------------------------------------------------------------------------//
+int collect_files(pack_attribs* pack, const char* dir);
+
+int add_file(pack_attribs* pack, const char* path, struct stat* statbuf);
+
+int compress_file(pack_file* file);
+
+int build_index(pack_attribs* pack, uint32_t* num_buckets, uint32_t* num_slots,
+                uint32_t** seeds, uint32_t** slots);
+
+uint64_t add_string(pack_attribs* pack, uint64_t base, const char* str);
+
+int write_bundle(pack_attribs* pack, int out_fd);
+
+int copy_file(int out_fd, pack_file* file, uint64_t offset);
+
+int write_all(int fd, const void* buf, size_t len, uint64_t offset);
+
+uint64_t align_payload(uint64_t offset, uint64_t len);
+
+int compare_files(const void* a, const void* b);
+//----------------------------------------------------------------------------//
+//------------------------------M A I N---------------------------------------//
+//----------------------------------------------------------------------------//
+int main(int argc, const char * argv[]) {
+    pack_attribs pack;
+    struct stat statbuf;
+    int use_gzip = FALSE, out_fd, rc = SUCCESS;
+    uint32_t i;
+
+    if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "-z") != 0)){
+        printf(USAGE);
+        return FAILURE;
+    }
+    use_gzip = argc == 4;
+    memset(&pack, 0, sizeof(pack));
+
+    out_fd = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1 || fstat(out_fd, &statbuf) == -1){
+        perror("Error on output open");
+        return FAILURE;
+    }
+    pack.out_dev = statbuf.st_dev;
+    pack.out_ino = statbuf.st_ino;
+
+    /*paths are kept relative, as the server resolves them from its cwd*/
+    if (chdir(argv[1]) == -1){
+        perror("Error on chdir");
+        close(out_fd);
+        return FAILURE;
+    }
+    if (collect_files(&pack, ".") == FAILURE)
+        rc = FAILURE;
+    qsort(pack.files, pack.num_files, sizeof(pack_file), compare_files);
+
+    for (i=0; rc == SUCCESS && use_gzip && i<pack.num_files; i++)
+        rc = compress_file(&pack.files[i]);
+    if (rc == SUCCESS)
+        rc = write_bundle(&pack, out_fd);
+    if (rc == SUCCESS)
+        printf("%u files packed into %s\n", pack.num_files, argv[2]);
+
+    for (i=0; i<pack.num_files; i++) {
+        free(pack.files[i].path);
+        free(pack.files[i].gzip);
+    }
+    free(pack.files);
+    free(pack.strings);
+    close(out_fd);
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+//------------------------FUNCTIONS IMPLEMENTATION----------------------------//
+//----------------------------------------------------------------------------//
+/**
+ * walks dir and keeps what the server would serve: world readable regular
+ * files under directories that everyone may search
+ */
+int collect_files(pack_attribs* pack, const char* dir){
+    DIR* dirp = opendir(dir);
+    struct dirent* ent;
+    struct stat statbuf;
+    char* path;
+    int rc = SUCCESS;
+
+    if (!dirp){
+        perror(dir);
+        return FAILURE;
+    }
+    while (rc == SUCCESS && (ent = readdir(dirp))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        path = (char*)malloc(strlen(dir)+strlen(ent->d_name)+2);
+        if (!path){
+            rc = FAILURE;
+            break;
+        }
+        sprintf(path, "%s/%s", dir, ent->d_name);
+
+        /*symbolic links to directories are not followed, they may loop*/
+        if (lstat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)){
+            if ((S_IXUSR & statbuf.st_mode) && (S_IXGRP & statbuf.st_mode) &&
+                (S_IXOTH & statbuf.st_mode))
+                rc = collect_files(pack, path);
+        } else if (stat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode) &&
+                   (S_IRUSR & statbuf.st_mode) && (S_IRGRP & statbuf.st_mode)
+                   && (S_IROTH & statbuf.st_mode) &&
+                   !(statbuf.st_dev == pack->out_dev &&
+                     statbuf.st_ino == pack->out_ino))
+            rc = add_file(pack, path+2, &statbuf); //without the "./"
+        free(path);
+    }
+    closedir(dirp);
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+int add_file(pack_attribs* pack, const char* path, struct stat* statbuf){
+    pack_file* files;
+    if (pack->num_files == pack->capacity){
+        pack->capacity = pack->capacity ? pack->capacity*2 : 64;
+        files = (pack_file*)realloc(pack->files,
+                                    pack->capacity*sizeof(pack_file));
+        if (!files){
+            perror("realloc failure");
+            return FAILURE;
+        }
+        pack->files = files;
+    }
+    files = &pack->files[pack->num_files];
+    memset(files, 0, sizeof(pack_file));
+    files->path = strdup(path);
+    if (!files->path)
+        return FAILURE;
+    files->statbuf = *statbuf;
+    pack->num_files++;
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * gzip variant of a file, kept only if it saves at least an eighth
+ */
+int compress_file(pack_file* file){
+    unsigned long len = (unsigned long)file->statbuf.st_size;
+    unsigned char* body;
+    z_stream zs;
+    int fd, rc;
+
+    if (len < GZIP_MIN_SIZE)
+        return SUCCESS;
+    fd = open(file->path, O_RDONLY);
+    if (fd == -1){
+        perror(file->path);
+        return FAILURE;
+    }
+    body = (unsigned char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (body == MAP_FAILED){
+        perror(file->path);
+        return FAILURE;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    /*window bits 15+16 asks zlib for a gzip wrapper*/
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK){
+        munmap(body, len);
+        return FAILURE;
+    }
+    file->gzip_len = deflateBound(&zs, len);
+    file->gzip = (unsigned char*)malloc(file->gzip_len);
+    if (!file->gzip){
+        deflateEnd(&zs);
+        munmap(body, len);
+        return FAILURE;
+    }
+    zs.next_in = body;
+    zs.avail_in = (uInt)len;
+    zs.next_out = file->gzip;
+    zs.avail_out = (uInt)file->gzip_len;
+    rc = deflate(&zs, Z_FINISH);
+    file->gzip_len = zs.total_out;
+    deflateEnd(&zs);
+    munmap(body, len);
+
+    if (rc != Z_STREAM_END || file->gzip_len > len-len/8){
+        free(file->gzip);
+        file->gzip = NULL;
+        file->gzip_len = 0;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * hash and displace: the paths are split into buckets by a first hash,
+ * largest buckets first, each bucket gets the first seed that sends all
+ * of its paths to free slots. a lookup is then two hashes and one compare.
+ */
+int build_index(pack_attribs* pack, uint32_t* num_buckets, uint32_t* num_slots,
+                uint32_t** seeds, uint32_t** slots){
+    uint32_t n = pack->num_files, i, j, b, seed, size, max_size = 0;
+    uint32_t *bucket_of, *first, *members, *taken;
+    uint32_t* bucket;
+    int placed;
+
+    *num_buckets = n/4+1;
+    *num_slots = n+n/4+1;
+    bucket_of = (uint32_t*)malloc((n+1)*sizeof(uint32_t));
+    first = (uint32_t*)calloc(*num_buckets+1, sizeof(uint32_t));
+    members = (uint32_t*)malloc((n+1)*sizeof(uint32_t));
+    taken = (uint32_t*)malloc((n+1)*sizeof(uint32_t));
+    *seeds = (uint32_t*)calloc(*num_buckets, sizeof(uint32_t));
+    *slots = NULL;
+    if (!bucket_of || !first || !members || !taken || !*seeds){
+        perror("malloc failure");
+        free(bucket_of); free(first); free(members); free(taken);
+        return FAILURE;
+    }
+    /*members of bucket b are members[first[b]..first[b+1]-1]*/
+    for (i=0; i<n; i++) {
+        bucket_of[i] = bundle_hash(pack->files[i].path,
+                                   strlen(pack->files[i].path), 0) %
+                                                                *num_buckets;
+        first[bucket_of[i]+1]++;
+    }
+    for (b=0; b<*num_buckets; b++) {
+        if (first[b+1] > max_size)
+            max_size = first[b+1];
+        first[b+1] += first[b];
+    }
+    for (b=0; b<*num_buckets; b++)
+        taken[b] = first[b];
+    for (i=0; i<n; i++)
+        members[taken[bucket_of[i]]++] = i;
+
+retry:
+    free(*slots);
+    *slots = (uint32_t*)malloc(*num_slots*sizeof(uint32_t));
+    if (!*slots){
+        free(bucket_of); free(first); free(members); free(taken);
+        return FAILURE;
+    }
+    for (i=0; i<*num_slots; i++)
+        (*slots)[i] = BUNDLE_NO_ENTRY;
+
+    /*largest buckets first, while the table is still empty*/
+    for (size=max_size; size>0; size--) {
+        for (b=0; b<*num_buckets; b++) {
+            if (first[b+1]-first[b] != size)
+                continue;
+            bucket = members+first[b];
+            placed = FALSE;
+            for (seed=1; seed<MAX_SEED_TRIES && !placed; seed++) {
+                for (i=0; i<size; i++) {
+                    taken[i] = bundle_hash(pack->files[bucket[i]].path,
+                                           strlen(pack->files[bucket[i]].path),
+                                           seed) % *num_slots;
+                    if ((*slots)[taken[i]] != BUNDLE_NO_ENTRY)
+                        break;
+                    for (j=0; j<i && taken[j] != taken[i]; j++);
+                    if (j < i)
+                        break;
+                }
+                if (i < size)
+                    continue;
+                for (i=0; i<size; i++)
+                    (*slots)[taken[i]] = bucket[i];
+                (*seeds)[b] = seed;
+                placed = TRUE;
+            }
+            if (!placed){
+                *num_slots += *num_slots/4+1;
+                goto retry;
+            }
+        }
+    }
+
+    free(bucket_of); free(first); free(members); free(taken);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * appends str with its '\0' to the strings area that starts at base,
+ * returns its file offset or 0 on failure
+ */
+uint64_t add_string(pack_attribs* pack, uint64_t base, const char* str){
+    size_t len = strlen(str)+1;
+    char* strings;
+    uint64_t off;
+    while (pack->strings_len+len > pack->strings_capacity) {
+        pack->strings_capacity = pack->strings_capacity ?
+                                 pack->strings_capacity*2 : 4096;
+        strings = (char*)realloc(pack->strings, pack->strings_capacity);
+        if (!strings)
+            return 0;
+        pack->strings = strings;
+    }
+    memcpy(pack->strings+pack->strings_len, str, len);
+    off = base+pack->strings_len;
+    pack->strings_len += len;
+    return off;
+}
+
+//----------------------------------------------------------------------------//
+int write_bundle(pack_attribs* pack, int out_fd){
+    bundle_header header;
+    bundle_entry* entries;
+    bundle_variant* variant;
+    pack_file* file;
+    uint32_t *seeds = NULL, *slots = NULL;
+    uint64_t strings_off, offset;
+    char last_modified[TIMEBUF];
+    char headers[HEADERS_SIZE];
+    char* mime;
+    uint32_t i;
+    int v, rc = FAILURE;
+
+    memset(&header, 0, sizeof(header));
+    if (build_index(pack, &header.num_buckets, &header.num_slots,
+                    &seeds, &slots) == FAILURE)
+        return FAILURE;
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.num_entries = pack->num_files;
+    header.seeds_off = sizeof(bundle_header);
+    header.slots_off = header.seeds_off+header.num_buckets*sizeof(uint32_t);
+    header.entries_off = (header.slots_off+header.num_slots*sizeof(uint32_t)
+                          +7) & ~(uint64_t)7;
+    strings_off = header.entries_off+pack->num_files*sizeof(bundle_entry);
+
+    entries = (bundle_entry*)calloc(pack->num_files+1, sizeof(bundle_entry));
+    if (!entries)
+        goto out;
+    for (i=0; i<pack->num_files; i++) {
+        file = &pack->files[i];
+        mime = get_mime_type(file->path);
+        strftime(last_modified, TIMEBUF, RFC1123FMT,
+                 gmtime(&file->statbuf.st_mtime));
+        entries[i].path_len = (uint32_t)strlen(file->path);
+        entries[i].path_off = add_string(pack, strings_off, file->path);
+        entries[i].mtime = file->statbuf.st_mtime;
+        entries[i].last_modified_off = add_string(pack, strings_off,
+                                                  last_modified);
+        if (!entries[i].path_off || !entries[i].last_modified_off ||
+            (mime && !(entries[i].mime_off = add_string(pack, strings_off,
+                                                        mime))))
+            goto out;
+
+        /*same lines, in the same order, build_resp_head() would write*/
+        for (v=0; v<BUNDLE_VARIANTS; v++) {
+            if (v == BUNDLE_GZIP && !file->gzip)
+                continue;
+            snprintf(headers, HEADERS_SIZE, "%s%s%s"
+                     "Content-Length: %lu\r\nLast-Modified: %s\r\n%s%s",
+                     mime ? "Content-Type: " : "", mime ? mime : "",
+                     mime ? "\r\n" : "",
+                     v == BUNDLE_GZIP ? file->gzip_len :
+                                    (unsigned long)file->statbuf.st_size,
+                     last_modified,
+                     v == BUNDLE_GZIP ? "Content-Encoding: gzip\r\n" : "",
+                     file->gzip ? "Vary: Accept-Encoding\r\n" : "");
+            entries[i].variants[v].headers_len = (uint32_t)strlen(headers);
+            entries[i].variants[v].headers_off = add_string(pack, strings_off,
+                                                            headers);
+            if (!entries[i].variants[v].headers_off)
+                goto out;
+        }
+    }
+
+    /*payloads follow the strings*/
+    offset = strings_off+pack->strings_len;
+    for (i=0; i<pack->num_files; i++) {
+        file = &pack->files[i];
+        variant = &entries[i].variants[BUNDLE_IDENTITY];
+        variant->data_len = (uint64_t)file->statbuf.st_size;
+        variant->data_off = align_payload(offset, variant->data_len);
+        offset = variant->data_off+variant->data_len;
+        if (file->gzip){
+            variant = &entries[i].variants[BUNDLE_GZIP];
+            variant->data_len = file->gzip_len;
+            variant->data_off = align_payload(offset, variant->data_len);
+            offset = variant->data_off+variant->data_len;
+        }
+    }
+    header.file_size = offset;
+
+    if (ftruncate(out_fd, (off_t)header.file_size) == -1 ||
+        write_all(out_fd, &header, sizeof(header), 0) == FAILURE ||
+        write_all(out_fd, seeds, header.num_buckets*sizeof(uint32_t),
+                  header.seeds_off) == FAILURE ||
+        write_all(out_fd, slots, header.num_slots*sizeof(uint32_t),
+                  header.slots_off) == FAILURE ||
+        write_all(out_fd, entries, pack->num_files*sizeof(bundle_entry),
+                  header.entries_off) == FAILURE ||
+        write_all(out_fd, pack->strings, pack->strings_len,
+                  strings_off) == FAILURE){
+        perror("Error on bundle write");
+        goto out;
+    }
+    for (i=0; i<pack->num_files; i++) {
+        file = &pack->files[i];
+        if (copy_file(out_fd, file,
+                   entries[i].variants[BUNDLE_IDENTITY].data_off) == FAILURE ||
+            (file->gzip && write_all(out_fd, file->gzip, file->gzip_len,
+                   entries[i].variants[BUNDLE_GZIP].data_off) == FAILURE))
+            goto out;
+    }
+    rc = SUCCESS;
+
+out:
+    free(entries);
+    free(seeds);
+    free(slots);
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * copies the body of file, which must still have the size it was packed
+ * with, so the pre-rendered Content-Length stays true
+ */
+int copy_file(int out_fd, pack_file* file, uint64_t offset){
+    unsigned char buf[65536];
+    uint64_t left = (uint64_t)file->statbuf.st_size;
+    ssize_t rc;
+    int fd = open(file->path, O_RDONLY);
+
+    if (fd == -1){
+        perror(file->path);
+        return FAILURE;
+    }
+    while (left > 0) {
+        rc = read(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (rc <= 0 || write_all(out_fd, buf, rc, offset) == FAILURE){
+            fprintf(stderr, "%s: changed while packing\n", file->path);
+            close(fd);
+            return FAILURE;
+        }
+        offset += rc;
+        left -= rc;
+    }
+    close(fd);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+int write_all(int fd, const void* buf, size_t len, uint64_t offset){
+    const unsigned char* p = (const unsigned char*)buf;
+    ssize_t wc;
+    while (len > 0) {
+        wc = pwrite(fd, p, len, (off_t)offset);
+        if (wc == -1){
+            if (errno == EINTR)
+                continue;
+            return FAILURE;
+        }
+        p += wc;
+        len -= wc;
+        offset += wc;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * bodies of a page or more start on a page boundary, so each is mapped
+ * and sent without touching its neighbours, smaller ones share pages
+ */
+uint64_t align_payload(uint64_t offset, uint64_t len){
+    uint64_t align = len >= BUNDLE_PAGE ? BUNDLE_PAGE : BUNDLE_ALIGN;
+    return (offset+align-1) & ~(align-1);
+}
+
+//----------------------------------------------------------------------------//
+int compare_files(const void* a, const void* b){
+    return strcmp(((const pack_file*)a)->path, ((const pack_file*)b)->path);
+}
@@ -0,0 +1,241 @@
+//
+//  capture.c
+//  ex_3
+//
+
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+#define CAP_IDLE_NS 20000000L   //writer nap when all rings are empty
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static void* cap_writer(void* p);
+static cap_ring* cap_thread_ring(capture* cap);
+static int cap_drain(capture* cap);
+static void cap_copy_in(cap_ring* ring, unsigned long pos, const void* src,
+                        size_t len);
+static int cap_write_all(int fd, struct iovec* iov, int iovcnt);
+static int64_t mono_us(void);
+
+static __thread cap_ring* thread_ring = NULL;
+static __thread capture* thread_ring_owner = NULL;
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+capture* create_capture(const char* path){
+    cap_file_header header;
+    struct timespec ts;
+    struct iovec iov;
+    capture* cap = (capture*)calloc(1, sizeof(capture));
+    if (!cap)
+        return NULL;
+
+    cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (cap->fd == -1){
+        perror("Error on capture open");
+        free(cap);
+        return NULL;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cap->start_us = (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+    cap->start_mono_us = mono_us();
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAP_MAGIC, sizeof(header.magic));
+    header.start_us = cap->start_us;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    if (cap_write_all(cap->fd, &iov, 1) == FAILURE ||
+        pthread_create(&cap->writer, NULL, cap_writer, cap) != 0){
+        close(cap->fd);
+        free(cap);
+        return NULL;
+    }
+    return cap;
+}
+
+//----------------------------------------------------------------------------//
+void cap_request(capture* cap, uint32_t client, uint64_t conn,
+                 const char* line, const char* headers){
+    cap_ring* ring = cap_thread_ring(cap);
+    cap_record record;
+    size_t line_len = strlen(line);
+    size_t headers_len;
+    unsigned long head, tail;
+
+    if (!ring){
+        atomic_fetch_add_explicit(&cap->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (!headers)
+        headers = "";
+    headers_len = strlen(headers);
+    if (sizeof(record)+line_len > CAP_MAX_RECORD)
+        line_len = CAP_MAX_RECORD-sizeof(record);
+    if (sizeof(record)+line_len+headers_len > CAP_MAX_RECORD)
+        headers_len = CAP_MAX_RECORD-sizeof(record)-line_len;
+
+    memset(&record, 0, sizeof(record));
+    record.offset_us = mono_us() - cap->start_mono_us;
+    record.conn = conn;
+    record.size = (uint32_t)(sizeof(record)+line_len+headers_len);
+    record.client = client;
+    record.line_len = (uint16_t)line_len;
+    record.headers_len = (uint16_t)headers_len;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (CAP_RING_SIZE - (head - tail) < record.size){
+        atomic_fetch_add_explicit(&cap->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    cap_copy_in(ring, head, &record, sizeof(record));
+    cap_copy_in(ring, head+sizeof(record), line, line_len);
+    cap_copy_in(ring, head+sizeof(record)+line_len, headers, headers_len);
+    atomic_store_explicit(&ring->head, head+record.size, memory_order_release);
+}
+
+//----------------------------------------------------------------------------//
+void destroy_capture(capture* cap){
+    int i;
+    unsigned long dropped;
+    if (!cap)
+        return;
+
+    atomic_store(&cap->shutdown, TRUE);
+    pthread_join(cap->writer, NULL);
+
+    dropped = atomic_load(&cap->dropped);
+    if (dropped)
+        fprintf(stderr, "capture: %lu requests dropped\n", dropped);
+    for (i=0; i<atomic_load(&cap->num_rings) && i<CAP_MAX_RINGS; i++)
+        free(cap->rings[i]);
+    close(cap->fd);
+    free(cap);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the ring of the calling thread, allocated and registered on first use
+ */
+static cap_ring* cap_thread_ring(capture* cap){
+    if (thread_ring_owner == cap)
+        return thread_ring;
+
+    int index = atomic_fetch_add(&cap->num_rings, 1);
+    if (index >= CAP_MAX_RINGS)
+        return NULL;
+    cap_ring* ring = (cap_ring*)calloc(1, sizeof(cap_ring));
+    cap->rings[index] = ring; //may stay NULL, the writer skips it
+    thread_ring = ring;
+    thread_ring_owner = cap;
+    return ring;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * The work function of the writer thread
+ */
+static void* cap_writer(void* p){
+    capture* cap = (capture*)p;
+    struct timespec nap = {0, CAP_IDLE_NS};
+    int done, drained;
+
+    while (TRUE) {
+        done = atomic_load(&cap->shutdown);
+        drained = cap_drain(cap);
+        if (done && !drained)
+            break;
+        if (!drained)
+            nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * writes out what every ring holds, as is. returns the number of bytes
+ * written.
+ */
+static int cap_drain(capture* cap){
+    struct iovec iov[2];
+    unsigned long head, tail, start, len;
+    int i, num_rings, iovcnt, total = 0;
+
+    num_rings = atomic_load(&cap->num_rings);
+    if (num_rings > CAP_MAX_RINGS)
+        num_rings = CAP_MAX_RINGS;
+
+    for (i=0; i<num_rings; i++) {
+        cap_ring* ring = cap->rings[i];
+        if (!ring)
+            continue;
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == tail)
+            continue;
+        /*the filled part, in two pieces if it wraps*/
+        start = tail & (CAP_RING_SIZE-1);
+        len = head - tail;
+        iov[0].iov_base = ring->data+start;
+        iov[0].iov_len = len < CAP_RING_SIZE-start ? len : CAP_RING_SIZE-start;
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = len - iov[0].iov_len;
+        iovcnt = iov[1].iov_len ? 2 : 1;
+        cap_write_all(cap->fd, iov, iovcnt);
+        atomic_store_explicit(&ring->tail, head, memory_order_release);
+        total += (int)len;
+    }
+    return total;
+}
+
+//----------------------------------------------------------------------------//
+static void cap_copy_in(cap_ring* ring, unsigned long pos, const void* src,
+                        size_t len){
+    size_t start = pos & (CAP_RING_SIZE-1);
+    size_t first = len < CAP_RING_SIZE-start ? len : CAP_RING_SIZE-start;
+    memcpy(ring->data+start, src, first);
+    memcpy(ring->data, (const unsigned char*)src+first, len-first);
+}
+
+//----------------------------------------------------------------------------//
+static int cap_write_all(int fd, struct iovec* iov, int iovcnt){
+    ssize_t wc;
+    while (iovcnt > 0) {
+        wc = writev(fd, iov, iovcnt);
+        if (wc == -1){
+            if (errno == EINTR)
+                continue;
+            return FAILURE;
+        }
+        while (iovcnt > 0 && (size_t)wc >= iov->iov_len) {
+            wc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0){
+            iov->iov_base = (char*)iov->iov_base + wc;
+            iov->iov_len -= wc;
+        }
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static int64_t mono_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
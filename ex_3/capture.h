@@ -0,0 +1,96 @@
+//
+//  capture.h
+//  ex_3
+//
+
+#ifndef capture_h
+#define capture_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+// first bytes of a capture file
+#define CAP_MAGIC "EX3CAP01"
+// bytes in every per thread ring, must be a power of two
+#define CAP_RING_SIZE (256*1024)
+// one ring per pool thread, plus the accepting thread
+#define CAP_MAX_RINGS (MAXT_IN_POOL+1)
+// largest record, requests with longer heads are cut to fit
+#define CAP_MAX_RECORD 8192
+
+
+/**
+ * start of a capture file. numbers are in the byte order of the
+ * capturing host.
+ */
+typedef struct _cap_file_header {
+    char magic[8];
+    int64_t start_us;       //wall clock time the capture started
+} cap_file_header;
+
+
+/**
+ * a captured request, followed by line_len bytes of request line and
+ * headers_len bytes of "name: value\r\n" header lines. records of
+ * different threads are not in time order in the file.
+ */
+typedef struct _cap_record {
+    int64_t offset_us;      //since the capture started
+    uint64_t conn;          //connection number, shared by HTTP/2 streams
+    uint32_t size;          //whole record, this header included
+    uint32_t client;        //peer IPv4 address, network order
+    uint16_t line_len;
+    uint16_t headers_len;
+    uint32_t reserved;
+} cap_record;
+
+
+/**
+ * single producer, single consumer byte ring, whole records only.
+ * head is only written by the owning worker and tail only by the
+ * writer thread.
+ */
+typedef struct _cap_ring {
+    _Atomic unsigned long head;
+    _Atomic unsigned long tail;
+    unsigned char data[CAP_RING_SIZE];
+} cap_ring;
+
+
+/**
+ * The capture
+ */
+typedef struct _capture_st {
+    int fd;
+    int64_t start_us;
+    int64_t start_mono_us;          //monotonic clock at start_us
+    pthread_t writer;
+    cap_ring* rings[CAP_MAX_RINGS];
+    _Atomic int num_rings;          //rings handed out so far
+    _Atomic unsigned long dropped;  //records lost to full rings
+    _Atomic int shutdown;           //1 if the capture is being destroyed
+} capture;
+
+
+/**
+ * create_capture creates (truncates) the capture file and starts the
+ * writer thread. returns NULL on failure.
+ */
+capture* create_capture(const char* path);
+
+/**
+ * cap_request records a request. never blocks and never takes a lock, a
+ * full ring drops the record and counts it.
+ */
+void cap_request(capture* cap, uint32_t client, uint64_t conn,
+                 const char* line, const char* headers);
+
+/**
+ * destroy_capture writes out every pending record, stops the writer
+ * thread and closes the file.
+ */
+void destroy_capture(capture* cap);
+
+#endif /* capture_h */
@@ -0,0 +1,277 @@
+//
+//  coldio.c
+//  ex_3
+//
+
+#ifdef __linux__
+#define _GNU_SOURCE //O_DIRECT
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+#endif
+#include "coldio.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+#define UNSUPPORTED 1   //no direct reads here, nothing was sent
+
+/**
+ * one read in flight. with Linux native AIO the read runs while the
+ * caller sends the previous buffer, elsewhere it happens on read_end().
+ */
+typedef struct _cio_reader {
+    int fd;
+    void* buf;
+    off_t offset;
+#ifdef __linux__
+    aio_context_t aio;  //0 - reads are synchronous
+    struct iocb cb;
+    int submitted;
+#endif
+} cio_reader;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void* buffers[CIO_POOL_BUFS];
+static int num_buffers;
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static void* get_buffer(void);
+static void put_buffer(void* buf);
+static int open_direct(const char* path);
+static void read_begin(cio_reader* r, void* buf, off_t offset);
+static ssize_t read_end(cio_reader* r);
+static int send_all(cio_sink* sink, const void* buf, size_t len,
+                    unsigned long* sent);
+static int stream_direct(int fd, unsigned long length, cio_sink* sink,
+                         unsigned long* sent);
+static unsigned long stream_dropping(int fd, unsigned long length,
+                                     cio_sink* sink);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+unsigned long cold_send(const char* path, int fd, unsigned long length,
+                        cio_sink* sink){
+    unsigned long sent = 0;
+    int direct_fd, rc;
+
+    direct_fd = open_direct(path);
+    if (direct_fd != -1){
+        rc = stream_direct(direct_fd, length, sink, &sent);
+        close(direct_fd);
+        if (rc != UNSUPPORTED)
+            return sent;
+    }
+    return stream_dropping(fd, length, sink);
+}
+
+//----------------------------------------------------------------------------//
+void cold_release_buffers(void){
+    pthread_mutex_lock(&pool_lock);
+    while (num_buffers > 0)
+        free(buffers[--num_buffers]);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+//----------------------------------------------------------------------------//
+static void* get_buffer(void){
+    void* buf = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (num_buffers > 0)
+        buf = buffers[--num_buffers];
+    pthread_mutex_unlock(&pool_lock);
+    if (!buf && posix_memalign(&buf, CIO_ALIGN, CIO_BUF_SIZE) != 0)
+        return NULL;
+    return buf;
+}
+
+//----------------------------------------------------------------------------//
+static void put_buffer(void* buf){
+    if (!buf)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    if (num_buffers < CIO_POOL_BUFS){
+        buffers[num_buffers++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(buf);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * a second descriptor of path whose reads bypass the page cache, -1 if
+ * the system or the file system has none
+ */
+static int open_direct(const char* path){
+#if defined(O_DIRECT)
+    return open(path, O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+    int fd = open(path, O_RDONLY);
+    if (fd != -1 && fcntl(fd, F_NOCACHE, 1) == -1){
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+//----------------------------------------------------------------------------//
+static void read_begin(cio_reader* r, void* buf, off_t offset){
+    r->buf = buf;
+    r->offset = offset;
+#ifdef __linux__
+    struct iocb* cbs[1] = {&r->cb};
+    r->submitted = FALSE;
+    if (r->aio){
+        memset(&r->cb, 0, sizeof(r->cb));
+        r->cb.aio_fildes = r->fd;
+        r->cb.aio_lio_opcode = IOCB_CMD_PREAD;
+        r->cb.aio_buf = (uint64_t)(uintptr_t)buf;
+        r->cb.aio_nbytes = CIO_BUF_SIZE;
+        r->cb.aio_offset = offset;
+        r->submitted = syscall(SYS_io_submit, r->aio, 1, cbs) == 1;
+    }
+#endif
+}
+
+//----------------------------------------------------------------------------//
+static ssize_t read_end(cio_reader* r){
+#ifdef __linux__
+    struct io_event event;
+    long rc;
+    if (r->submitted){
+        r->submitted = FALSE;
+        do {
+            rc = syscall(SYS_io_getevents, r->aio, 1, 1, &event, NULL);
+        } while (rc == -1 && errno == EINTR);
+        if (rc != 1)
+            return -1;
+        if ((int64_t)event.res < 0){
+            errno = (int)-(int64_t)event.res;
+            return -1;
+        }
+        return (ssize_t)event.res;
+    }
+#endif
+    return pread(r->fd, r->buf, CIO_BUF_SIZE, r->offset);
+}
+
+//----------------------------------------------------------------------------//
+static int send_all(cio_sink* sink, const void* buf, size_t len,
+                    unsigned long* sent){
+    const unsigned char* p = (const unsigned char*)buf;
+    ssize_t wc;
+    while (len > 0) {
+        wc = sink->write(sink->ctx, p, len);
+        if (wc <= 0)
+            return FAILURE;
+        p += wc;
+        len -= wc;
+        *sent += wc;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * double buffered: block i+1 is read into one buffer while block i is
+ * sent from the other. reads stay CIO_BUF_SIZE long at aligned offsets,
+ * the last one comes back short at the end of the file.
+ */
+static int stream_direct(int fd, unsigned long length, cio_sink* sink,
+                         unsigned long* sent){
+    void* buf[2];
+    cio_reader r;
+    off_t offset = 0;
+    ssize_t n;
+    int cur = 0, rc = SUCCESS;
+
+    buf[0] = get_buffer();
+    buf[1] = get_buffer();
+    if (!buf[0] || !buf[1]){
+        put_buffer(buf[0]);
+        put_buffer(buf[1]);
+        return UNSUPPORTED;
+    }
+    memset(&r, 0, sizeof(r));
+    r.fd = fd;
+#ifdef __linux__
+    if (syscall(SYS_io_setup, 1, &r.aio) == -1)
+        r.aio = 0;
+#endif
+
+    read_begin(&r, buf[cur], offset);
+    while (*sent < length) {
+        n = read_end(&r);
+        if (n <= 0){
+            /*O_DIRECT opens fine on some file systems and fails reading*/
+            rc = n == -1 && errno == EINVAL && *sent == 0 ?
+                 UNSUPPORTED : FAILURE;
+            break;
+        }
+        offset += n;
+        if ((unsigned long)n > length-*sent)
+            n = (ssize_t)(length-*sent);
+        if (n == CIO_BUF_SIZE && *sent+n < length)
+            read_begin(&r, buf[cur^1], offset);
+        if (send_all(sink, buf[cur], n, sent) == FAILURE){
+            rc = FAILURE;
+            break;
+        }
+        if (n < CIO_BUF_SIZE)
+            break; //end of the file
+        cur ^= 1;
+    }
+
+#ifdef __linux__
+    if (r.aio)
+        syscall(SYS_io_destroy, r.aio); //waits for a read still in flight
+#endif
+    put_buffer(buf[0]);
+    put_buffer(buf[1]);
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the usual zero copy path, dropping what was sent every CIO_DROP_EVERY
+ * bytes so the file never holds more than that of the cache
+ */
+static unsigned long stream_dropping(int fd, unsigned long length,
+                                     cio_sink* sink){
+    off_t offset = 0, dropped = 0;
+    ssize_t wc;
+    size_t count;
+
+    while (offset < (off_t)length) {
+        count = length-offset;
+        if (count > (size_t)(dropped+CIO_DROP_EVERY-offset))
+            count = dropped+CIO_DROP_EVERY-offset;
+        wc = sink->sendfile(sink->ctx, fd, &offset, count);
+        if (wc <= 0)
+            break; //client is gone or the file was truncated
+        if (offset-dropped >= CIO_DROP_EVERY){
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(fd, dropped, offset-dropped, POSIX_FADV_DONTNEED);
+#endif
+            dropped = offset;
+        }
+    }
+#ifdef POSIX_FADV_DONTNEED
+    if (offset > dropped)
+        posix_fadvise(fd, dropped, offset-dropped, POSIX_FADV_DONTNEED);
+#endif
+    return (unsigned long)offset;
+}
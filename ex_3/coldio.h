@@ -0,0 +1,48 @@
+//
+//  coldio.h
+//  ex_3
+//
+
+#ifndef coldio_h
+#define coldio_h
+
+#include <sys/types.h>
+
+// bytes read from the disk at once, a multiple of CIO_ALIGN
+#define CIO_BUF_SIZE (1024*1024)
+// buffer, offset and length alignment O_DIRECT asks for
+#define CIO_ALIGN 4096
+// idle read buffers kept for later streams
+#define CIO_POOL_BUFS 16
+// bytes sent between two page cache drops when O_DIRECT is not available
+#define CIO_DROP_EVERY (8*1024*1024)
+
+
+/**
+ * where a cold file goes, the same calls send_responce() makes
+ */
+typedef struct _cio_sink {
+    void* ctx;
+    ssize_t (*write)(void* ctx, const void* buf, size_t len);
+    ssize_t (*sendfile)(void* ctx, int fd, off_t* offset, size_t count);
+} cio_sink;
+
+
+/**
+ * cold_send sends the first length bytes of the file at path, open as
+ * fd, without leaving it in the page cache. the file is read with
+ * O_DIRECT (F_NOCACHE on macOS) into pooled aligned buffers, the next
+ * read in flight while the previous buffer is sent. where the file
+ * system refuses that, fd is sent as usual and the pages sent are
+ * dropped behind it.
+ * returns the number of bytes sent.
+ */
+unsigned long cold_send(const char* path, int fd, unsigned long length,
+                        cio_sink* sink);
+
+/**
+ * cold_release_buffers frees the pooled buffers
+ */
+void cold_release_buffers(void);
+
+#endif /* coldio_h */
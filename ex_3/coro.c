@@ -0,0 +1,591 @@
+//
+//  coro.c
+//  ex_3
+//
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE 600   //ucontext is deprecated, not gone
+#define _DARWIN_C_SOURCE
+#endif
+#include "coro.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static __thread co_loop* current_loop = NULL;
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static void co_entry(void);
+static coroutine* new_coroutine(co_loop* loop, co_fn fn, void* arg);
+static int push_inbox(co_loop* loop, coroutine* co);
+static int take_inbox(co_loop* loop);
+static void start(co_loop* loop, coroutine* co);
+static void resume(co_loop* loop, coroutine* co);
+static void make_ready(co_loop* loop, coroutine* co);
+static void* get_stack(co_loop* loop);
+static void put_stack(co_loop* loop, void* stack);
+static int arm(co_loop* loop, coroutine* co);
+static void disarm(co_loop* loop, coroutine* co);
+static int wait_events(co_loop* loop, coroutine** ready, int timeout_ms);
+static int next_timeout(co_loop* loop);
+static void expire_timers(co_loop* loop);
+static int timer_push(co_loop* loop, coroutine* co);
+static void timer_remove(co_loop* loop, coroutine* co);
+static void timer_swap(co_loop* loop, int a, int b);
+static void timer_sift(co_loop* loop, int i);
+static long long now_ms(void);
+static size_t page_size(void);
+static size_t ctx_space(void);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+co_loop* create_co_loop(void){
+    co_loop* loop = (co_loop*)calloc(1, sizeof(co_loop));
+    if (!loop)
+        return NULL;
+    loop->wake[0] = loop->wake[1] = -1;
+    pthread_mutex_init(&loop->inbox_lock, NULL);
+#ifdef __linux__
+    struct epoll_event ev;
+    loop->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    struct kevent ev;
+    loop->poll_fd = kqueue();
+#endif
+    if (loop->poll_fd == -1 || pipe(loop->wake) == -1){
+        destroy_co_loop(loop);
+        return NULL;
+    }
+    fcntl(loop->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(loop->wake[1], F_SETFL, O_NONBLOCK);
+    /*the wake pipe is the one event without a coroutine*/
+#ifdef __linux__
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, loop->wake[0], &ev) == -1){
+#else
+    EV_SET(&ev, loop->wake[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (kevent(loop->poll_fd, &ev, 1, NULL, 0, NULL) == -1){
+#endif
+        destroy_co_loop(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+//----------------------------------------------------------------------------//
+int co_run(void* arg){
+    co_loop* loop = (co_loop*)arg;
+    coroutine* ready[CORO_MAX_EVENTS];
+    int i, n, drained;
+
+    current_loop = loop;
+    while (TRUE) {
+        drained = take_inbox(loop);
+        while (loop->run_head) {
+            coroutine* co = loop->run_head;
+            loop->run_head = co->next;
+            if (!loop->run_head)
+                loop->run_tail = NULL;
+            resume(loop, co);
+        }
+        if (drained && loop->live == 0)
+            break;
+
+        n = wait_events(loop, ready, next_timeout(loop));
+        for (i=0; i<n; i++) {
+            if (!ready[i]->stack){
+                /*first data of a parked coroutine*/
+                loop->parked--;
+                ready[i]->wait_fd = -1;
+                start(loop, ready[i]);
+                continue;
+            }
+            timer_remove(loop, ready[i]);
+            make_ready(loop, ready[i]);
+        }
+        expire_timers(loop);
+    }
+    current_loop = NULL;
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+int co_spawn(co_loop* loop, co_fn fn, void* arg){
+    coroutine* co = new_coroutine(loop, fn, arg);
+    if (!co)
+        return FAILURE;
+    return push_inbox(loop, co);
+}
+
+//----------------------------------------------------------------------------//
+int co_spawn_io(co_loop* loop, int fd, co_fn fn, void* arg){
+    coroutine* co = new_coroutine(loop, fn, arg);
+    if (!co)
+        return FAILURE;
+    co->wait_fd = fd;
+    co->wait_events = CO_READ;
+    return push_inbox(loop, co);
+}
+
+//----------------------------------------------------------------------------//
+void co_stats(co_loop* loop, co_loop_stats* stats){
+    int live = __atomic_load_n(&loop->live, __ATOMIC_RELAXED);
+    stats->parked = __atomic_load_n(&loop->parked, __ATOMIC_RELAXED);
+    stats->running = live > stats->parked ? live - stats->parked : 0;
+    stats->stacks = __atomic_load_n(&loop->num_mapped, __ATOMIC_RELAXED);
+    stats->pooled_stacks = __atomic_load_n(&loop->num_stacks, __ATOMIC_RELAXED);
+}
+
+//----------------------------------------------------------------------------//
+static coroutine* new_coroutine(co_loop* loop, co_fn fn, void* arg){
+    coroutine* co = (coroutine*)calloc(1, sizeof(coroutine));
+    if (!co)
+        return NULL;
+    co->fn = fn;
+    co->arg = arg;
+    co->loop = loop;
+    co->wait_fd = -1;
+    co->timer = -1;
+    return co;
+}
+
+//----------------------------------------------------------------------------//
+static int push_inbox(co_loop* loop, coroutine* co){
+    int was_empty;
+    pthread_mutex_lock(&loop->inbox_lock);
+    if (loop->stopping){
+        pthread_mutex_unlock(&loop->inbox_lock);
+        free(co);
+        return FAILURE;
+    }
+    was_empty = loop->inbox_head == NULL;
+    if (loop->inbox_tail)
+        loop->inbox_tail->next = co;
+    else
+        loop->inbox_head = co;
+    loop->inbox_tail = co;
+    pthread_mutex_unlock(&loop->inbox_lock);
+
+    /*one byte is enough until the loop takes the inbox*/
+    if (was_empty)
+        write(loop->wake[1], "", 1);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+int co_wait_fd(int fd, int events, int timeout_ms){
+    co_loop* loop = current_loop;
+    coroutine* co = loop ? loop->current : NULL;
+    struct pollfd pfd;
+    int rc;
+
+    if (!co){
+        pfd.fd = fd;
+        pfd.events = (events & CO_READ ? POLLIN : 0) |
+                     (events & CO_WRITE ? POLLOUT : 0);
+        pfd.revents = 0;
+        do {
+            rc = poll(&pfd, 1, timeout_ms);
+        } while (rc == -1 && errno == EINTR);
+        if (rc == 0)
+            errno = ETIMEDOUT;
+        return rc > 0 ? SUCCESS : FAILURE;
+    }
+
+    co->wait_fd = fd;
+    co->wait_events = events;
+    co->timed_out = FALSE;
+    if (arm(loop, co) == FAILURE){
+        co->wait_fd = -1;
+        return FAILURE;
+    }
+    if (timeout_ms >= 0){
+        co->deadline_ms = now_ms() + timeout_ms;
+        if (timer_push(loop, co) == FAILURE){
+            disarm(loop, co);
+            co->wait_fd = -1;
+            return FAILURE;
+        }
+    }
+    swapcontext(co->ctx, &loop->main_ctx);
+
+    co->wait_fd = -1;
+    if (co->timed_out){
+        errno = ETIMEDOUT;
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+int co_active(void){
+    return current_loop && current_loop->current;
+}
+
+//----------------------------------------------------------------------------//
+void co_stop(co_loop* loop){
+    pthread_mutex_lock(&loop->inbox_lock);
+    loop->stopping = TRUE;
+    pthread_mutex_unlock(&loop->inbox_lock);
+    write(loop->wake[1], "", 1);
+}
+
+//----------------------------------------------------------------------------//
+void destroy_co_loop(co_loop* loop){
+    coroutine* co;
+    if (!loop)
+        return;
+    while (loop->inbox_head) {
+        co = loop->inbox_head;
+        loop->inbox_head = co->next;
+        free(co);
+    }
+    while (loop->num_stacks > 0) {
+        munmap(loop->stacks[--loop->num_stacks], CORO_STACK_SIZE+page_size());
+        loop->num_mapped--;
+    }
+    if (loop->poll_fd != -1)
+        close(loop->poll_fd);
+    if (loop->wake[0] != -1){
+        close(loop->wake[0]);
+        close(loop->wake[1]);
+    }
+    pthread_mutex_destroy(&loop->inbox_lock);
+    free(loop->timers);
+    free(loop);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * every coroutine starts here, on its own stack. a coroutine that
+ * returned is recycled by resume(), once back on the loop's stack.
+ */
+static void co_entry(void){
+    co_loop* loop = current_loop;
+    coroutine* co = loop->current;
+    co->fn(co->arg);
+    co->fn = NULL;
+    setcontext(&loop->main_ctx);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * starts what was spawned since the last call. returns TRUE if the loop
+ * is stopping and nothing more can come.
+ */
+static int take_inbox(co_loop* loop){
+    coroutine* co;
+    int stopping;
+
+    pthread_mutex_lock(&loop->inbox_lock);
+    co = loop->inbox_head;
+    loop->inbox_head = loop->inbox_tail = NULL;
+    stopping = loop->stopping;
+    pthread_mutex_unlock(&loop->inbox_lock);
+
+    while (co) {
+        coroutine* next = co->next;
+        co->next = NULL;
+        loop->live++;
+        if (co->wait_fd != -1 && arm(loop, co) == SUCCESS)
+            loop->parked++;
+        else {
+            co->wait_fd = -1;
+            start(loop, co);
+        }
+        co = next;
+    }
+    return stopping;
+}
+
+//----------------------------------------------------------------------------//
+static void start(co_loop* loop, coroutine* co){
+    co->stack = get_stack(loop);
+    if (co->stack)
+        co->ctx = (ucontext_t*)((char*)co->stack + page_size() +
+                                CORO_STACK_SIZE - ctx_space());
+    if (!co->stack || getcontext(co->ctx) == -1){
+        /*no stack to spare, it runs right here and its waits block*/
+        put_stack(loop, co->stack);
+        co->fn(co->arg);
+        free(co);
+        loop->live--;
+        return;
+    }
+    co->ctx->uc_stack.ss_sp = (char*)co->stack + page_size();
+    co->ctx->uc_stack.ss_size = CORO_STACK_SIZE - ctx_space();
+    co->ctx->uc_link = NULL;
+    makecontext(co->ctx, co_entry, 0);
+    make_ready(loop, co);
+}
+
+//----------------------------------------------------------------------------//
+static void resume(co_loop* loop, coroutine* co){
+    loop->current = co;
+    swapcontext(&loop->main_ctx, co->ctx);
+    loop->current = NULL;
+    if (!co->fn){
+        put_stack(loop, co->stack);
+        free(co);
+        loop->live--;
+    }
+}
+
+//----------------------------------------------------------------------------//
+static void make_ready(co_loop* loop, coroutine* co){
+    co->next = NULL;
+    if (loop->run_tail)
+        loop->run_tail->next = co;
+    else
+        loop->run_head = co;
+    loop->run_tail = co;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * a pooled stack or a new mapping, with a guard page below the stack so
+ * an overflow faults instead of writing over the neighbour
+ */
+static void* get_stack(co_loop* loop){
+    void* stack;
+    if (loop->num_stacks > 0)
+        return loop->stacks[--loop->num_stacks];
+    stack = mmap(NULL, CORO_STACK_SIZE+page_size(), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED)
+        return NULL;
+    if (mprotect(stack, page_size(), PROT_NONE) == -1){
+        munmap(stack, CORO_STACK_SIZE+page_size());
+        return NULL;
+    }
+    loop->num_mapped++;
+    return stack;
+}
+
+//----------------------------------------------------------------------------//
+static void put_stack(co_loop* loop, void* stack){
+    if (!stack)
+        return;
+    if (loop->num_stacks < CORO_POOL_STACKS)
+        loop->stacks[loop->num_stacks++] = stack;
+    else {
+        munmap(stack, CORO_STACK_SIZE+page_size());
+        loop->num_mapped--;
+    }
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * one shot registration, the descriptor is reported once and then stays
+ * quiet until it is armed again
+ */
+static int arm(co_loop* loop, coroutine* co){
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLONESHOT | (co->wait_events & CO_READ ? EPOLLIN : 0) |
+                (co->wait_events & CO_WRITE ? EPOLLOUT : 0);
+    ev.data.ptr = co;
+    if (epoll_ctl(loop->poll_fd, EPOLL_CTL_MOD, co->wait_fd, &ev) == -1){
+        if (errno != ENOENT)
+            return FAILURE;
+        return epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, co->wait_fd, &ev);
+    }
+    return SUCCESS;
+#else
+    struct kevent ev;
+    EV_SET(&ev, co->wait_fd, co->wait_events & CO_READ ? EVFILT_READ :
+                                                         EVFILT_WRITE,
+           EV_ADD | EV_ONESHOT, 0, 0, co);
+    return kevent(loop->poll_fd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+//----------------------------------------------------------------------------//
+static void disarm(co_loop* loop, coroutine* co){
+#ifdef __linux__
+    epoll_ctl(loop->poll_fd, EPOLL_CTL_DEL, co->wait_fd, NULL);
+#else
+    struct kevent ev;
+    EV_SET(&ev, co->wait_fd, co->wait_events & CO_READ ? EVFILT_READ :
+                                                         EVFILT_WRITE,
+           EV_DELETE, 0, 0, NULL);
+    kevent(loop->poll_fd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * waits up to timeout_ms for the armed descriptors. fills ready with the
+ * coroutines whose descriptor fired, returns how many.
+ */
+static int wait_events(co_loop* loop, coroutine** ready, int timeout_ms){
+    char drain[64];
+    int i, n, num_ready = 0;
+#ifdef __linux__
+    struct epoll_event events[CORO_MAX_EVENTS];
+    n = epoll_wait(loop->poll_fd, events, CORO_MAX_EVENTS, timeout_ms);
+#else
+    struct kevent events[CORO_MAX_EVENTS];
+    struct timespec ts, *tsp = NULL;
+    if (timeout_ms >= 0){
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    n = kevent(loop->poll_fd, NULL, 0, events, CORO_MAX_EVENTS, tsp);
+#endif
+    for (i=0; i<n; i++) {
+#ifdef __linux__
+        coroutine* co = (coroutine*)events[i].data.ptr;
+#else
+        coroutine* co = (coroutine*)events[i].udata;
+#endif
+        if (co)
+            ready[num_ready++] = co;
+        else
+            while (read(loop->wake[0], drain, sizeof(drain)) > 0);
+    }
+    return num_ready;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * milliseconds until the nearest deadline, 0 if something can run now
+ * and -1 if nothing has a deadline
+ */
+static int next_timeout(co_loop* loop){
+    long long left;
+    if (loop->run_head)
+        return 0;
+    if (loop->num_timers == 0)
+        return -1;
+    left = loop->timers[0]->deadline_ms - now_ms();
+    return left < 0 ? 0 : (int)left;
+}
+
+//----------------------------------------------------------------------------//
+static void expire_timers(co_loop* loop){
+    long long now;
+    coroutine* co;
+    if (loop->num_timers == 0)
+        return;
+    now = now_ms();
+    while (loop->num_timers > 0 && loop->timers[0]->deadline_ms <= now) {
+        co = loop->timers[0];
+        timer_remove(loop, co);
+        disarm(loop, co);
+        co->timed_out = TRUE;
+        make_ready(loop, co);
+    }
+}
+
+//----------------------------------------------------------------------------//
+static int timer_push(co_loop* loop, coroutine* co){
+    coroutine** timers;
+    int size;
+    if (loop->num_timers == loop->timers_size){
+        size = loop->timers_size ? loop->timers_size*2 : 64;
+        timers = (coroutine**)realloc(loop->timers, size*sizeof(coroutine*));
+        if (!timers)
+            return FAILURE;
+        loop->timers = timers;
+        loop->timers_size = size;
+    }
+    co->timer = loop->num_timers;
+    loop->timers[loop->num_timers++] = co;
+    timer_sift(loop, co->timer);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static void timer_remove(co_loop* loop, coroutine* co){
+    int i = co->timer;
+    if (i == -1)
+        return;
+    co->timer = -1;
+    loop->num_timers--;
+    if (i == loop->num_timers)
+        return;
+    loop->timers[i] = loop->timers[loop->num_timers];
+    loop->timers[i]->timer = i;
+    timer_sift(loop, i);
+}
+
+//----------------------------------------------------------------------------//
+static void timer_swap(co_loop* loop, int a, int b){
+    coroutine* co = loop->timers[a];
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = co;
+    loop->timers[a]->timer = a;
+    loop->timers[b]->timer = b;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * moves entry i up or down until the heap is in order again
+ */
+static void timer_sift(co_loop* loop, int i){
+    coroutine** t = loop->timers;
+    int child;
+    while (i > 0 && t[i]->deadline_ms < t[(i-1)/2]->deadline_ms) {
+        timer_swap(loop, i, (i-1)/2);
+        i = (i-1)/2;
+    }
+    while ((child = 2*i+1) < loop->num_timers) {
+        if (child+1 < loop->num_timers &&
+            t[child+1]->deadline_ms < t[child]->deadline_ms)
+            child++;
+        if (t[i]->deadline_ms <= t[child]->deadline_ms)
+            break;
+        timer_swap(loop, i, child);
+        i = child;
+    }
+}
+
+//----------------------------------------------------------------------------//
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * room for the saved registers at the top of a stack mapping, keeping
+ * the stack below it aligned
+ */
+static size_t ctx_space(void){
+    return (sizeof(ucontext_t)+63) & ~(size_t)63;
+}
+
+//----------------------------------------------------------------------------//
+static size_t page_size(void){
+    static size_t size = 0;
+    if (!size)
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
@@ -0,0 +1,141 @@
+//
+//  coro.h
+//  ex_3
+//
+
+#ifndef coro_h
+#define coro_h
+
+#include <pthread.h>
+#include <ucontext.h>
+
+// address space of a coroutine stack, only the pages it touches are used.
+// the coroutine's saved registers are kept at its top.
+#define CORO_STACK_SIZE (256*1024)
+// idle stacks a loop keeps for its next coroutines
+#define CORO_POOL_STACKS 256
+// events handled per wait of the loop
+#define CORO_MAX_EVENTS 256
+
+// what co_wait_fd() waits for
+#define CO_READ 1
+#define CO_WRITE 2
+
+typedef int (*co_fn)(void* arg);
+
+
+/**
+ * a coroutine and what it waits for. one spawned with co_spawn_io() is
+ * just this record until its descriptor turns readable.
+ */
+typedef struct _coroutine {
+    ucontext_t* ctx;            //in the stack mapping
+    void* stack;                //mapping of CORO_STACK_SIZE plus a guard page,
+                                //NULL until the coroutine starts
+    co_fn fn;
+    void* arg;
+    struct _co_loop* loop;
+    int wait_fd;                //-1 when not waiting on a descriptor
+    int wait_events;
+    int timed_out;              //1 if the last wait ran out of time
+    long long deadline_ms;      //of the current wait, -1 - none
+    int timer;                  //index in the loop's timer heap, -1 - none
+    struct _coroutine* next;    //run queue, inbox and free list link
+} coroutine;
+
+
+/**
+ * an event loop running coroutines on one thread. co_spawn() may be
+ * called from any thread, everything else belongs to the loop thread.
+ */
+typedef struct _co_loop {
+    int poll_fd;                //epoll, kqueue on macOS
+    int wake[2];                //pipe co_spawn() writes to
+    ucontext_t main_ctx;        //co_run() itself
+    coroutine* current;         //NULL while the loop runs
+    coroutine* run_head;        //ready to run
+    coroutine* run_tail;
+    coroutine** timers;         //min heap by deadline
+    int num_timers;
+    int timers_size;
+    void* stacks[CORO_POOL_STACKS];  //idle stacks
+    int num_stacks;
+    int live;                   //coroutines spawned and not done
+    int parked;                 //of them, not started yet
+    int num_mapped;             //stacks mapped, pooled ones included
+    pthread_mutex_t inbox_lock;
+    coroutine* inbox_head;      //spawned, not yet seen by the loop
+    coroutine* inbox_tail;
+    int stopping;               //1 once co_stop() was called
+} co_loop;
+
+
+/**
+ * what a loop holds, see co_stats()
+ */
+typedef struct _co_loop_stats {
+    int running;        //coroutines started and not done
+    int parked;         //waiting for their first byte, no stack yet
+    int stacks;         //stacks mapped
+    int pooled_stacks;  //of them, idle
+} co_loop_stats;
+
+
+/**
+ * create_co_loop creates a loop, it does nothing until co_run()
+ * runs it. returns NULL on failure.
+ */
+co_loop* create_co_loop(void);
+
+/**
+ * co_run runs the loop on the calling thread until co_stop() was called
+ * and every coroutine returned. it fits dispatch(), so a pool thread
+ * can be given over to a loop.
+ */
+int co_run(void* loop);
+
+/**
+ * co_spawn starts fn(arg) as a coroutine of the loop. safe from any
+ * thread. returns -1 if the loop is stopping or out of memory.
+ */
+int co_spawn(co_loop* loop, co_fn fn, void* arg);
+
+/**
+ * co_spawn_io is co_spawn() for a coroutine serving fd: it is started
+ * once fd turns readable, so a peer that sends nothing yet costs no
+ * stack.
+ */
+int co_spawn_io(co_loop* loop, int fd, co_fn fn, void* arg);
+
+/**
+ * co_stats reports what the loop holds. safe from any thread, the
+ * numbers may be a moment old.
+ */
+void co_stats(co_loop* loop, co_loop_stats* stats);
+
+/**
+ * co_wait_fd suspends the calling coroutine until fd is ready for
+ * events (CO_READ, CO_WRITE) or timeout_ms passed, -1 waits for ever.
+ * outside a coroutine it blocks in poll() instead.
+ * returns -1 with errno ETIMEDOUT if the time ran out.
+ */
+int co_wait_fd(int fd, int events, int timeout_ms);
+
+/**
+ * co_active returns TRUE when called from a coroutine
+ */
+int co_active(void);
+
+/**
+ * co_stop makes co_run() return once the loop's coroutines are done.
+ * no coroutine may be spawned after it.
+ */
+void co_stop(co_loop* loop);
+
+/**
+ * destroy_co_loop frees a loop co_run() has returned from, or that never
+ * ran
+ */
+void destroy_co_loop(co_loop* loop);
+
+#endif /* coro_h */
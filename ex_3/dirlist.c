@@ -0,0 +1,473 @@
+//
+//  dirlist.c
+//  ex_3
+//
+
+#include "dirlist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "singleflight.h"
+
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+#define TIMEBUF 128
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+/**
+ * growing output buffer
+ */
+typedef struct _dl_buf {
+    char* data;
+    size_t len;
+    size_t capacity;
+    int failed;
+} dl_buf;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dl_index* cache[DL_CACHE_DIRS];
+static unsigned long cache_used[DL_CACHE_DIRS];    //LRU stamps
+static unsigned long cache_clock;
+static sf_group builds = SF_GROUP_INITIALIZER;     //indexes being built
+static __thread const dl_item* sort_items;          //for the comparators
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static dl_index* acquire_index(const char* path);
+static void release_index(dl_index* index);
+static void* build_cached_index(const char* path, void* arg);
+static void* share_index(void* result, void* arg);
+static dl_index* build_index(const char* path, struct stat* dirstat);
+static void free_index(dl_index* index);
+static int compare_name(const void* a, const void* b);
+static int compare_mtime(const void* a, const void* b);
+static int compare_size(const void* a, const void* b);
+static void render_html(dl_buf* out, const char* path, dl_index* index,
+                        const dl_query* query, int first, int last);
+static void render_json(dl_buf* out, const char* path, dl_index* index,
+                        const dl_query* query, int first, int last);
+static void render_item(dl_buf* out, const dl_item* item);
+static void append(dl_buf* out, const char* fmt, ...);
+static void append_json_string(dl_buf* out, const char* str);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+void dl_parse_query(const char* query_string, int format, dl_query* query){
+    char *copy, *param, *value, *saveptr;
+
+    query->offset = 0;
+    query->limit = -1;
+    query->sort = DL_SORT_NAME;
+    query->descending = FALSE;
+    query->format = format;
+    if (!query_string || !(copy = strdup(query_string)))
+        return;
+
+    for (param = strtok_r(copy, "&", &saveptr); param;
+         param = strtok_r(NULL, "&", &saveptr)) {
+        value = strchr(param, '=');
+        if (!value)
+            continue;
+        *value++ = '\0';
+        if (strcmp(param, "offset") == 0 && atoi(value) > 0)
+            query->offset = atoi(value);
+        else if (strcmp(param, "limit") == 0 && atoi(value) >= 0 &&
+                 *value >= '0' && *value <= '9')
+            query->limit = atoi(value);
+        else if (strcmp(param, "sort") == 0){
+            if (*value == '-'){
+                query->descending = TRUE;
+                value++;
+            }
+            if (strcmp(value, "mtime") == 0)
+                query->sort = DL_SORT_MTIME;
+            else if (strcmp(value, "size") == 0)
+                query->sort = DL_SORT_SIZE;
+        }
+    }
+    free(copy);
+}
+
+//----------------------------------------------------------------------------//
+char* dl_render(const char* path, const dl_query* query, unsigned long* len){
+    dl_index* index = acquire_index(path);
+    dl_buf out;
+    int first, last;
+
+    if (!index)
+        return NULL;
+    first = query->offset < index->num_items ? query->offset :
+                                               index->num_items;
+    last = index->num_items;
+    if (query->limit >= 0 && query->limit < last-first)
+        last = first+query->limit;
+
+    memset(&out, 0, sizeof(out));
+    if (query->format == DL_HTML)
+        render_html(&out, path, index, query, first, last);
+    else
+        render_json(&out, path, index, query, first, last);
+    release_index(index);
+
+    if (out.failed || !out.data){
+        free(out.data);
+        return NULL;
+    }
+    *len = out.len;
+    return out.data;
+}
+
+//----------------------------------------------------------------------------//
+void dl_clear_cache(void){
+    int i;
+    pthread_mutex_lock(&cache_lock);
+    for (i=0; i<DL_CACHE_DIRS; i++) {
+        if (cache[i] && --cache[i]->refs == 0)
+            free_index(cache[i]);
+        cache[i] = NULL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the cached index of path if it is still valid, a new one otherwise.
+ * building happens outside the lock, concurrent misses on the same
+ * directory wait for the first one's index instead of each building one.
+ */
+static dl_index* acquire_index(const char* path){
+    struct stat dirstat;
+    dl_index* index = NULL;
+    time_t now = time(NULL);
+    int i;
+
+    if (stat(path, &dirstat) == -1)
+        return NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i=0; i<DL_CACHE_DIRS; i++) {
+        if (cache[i] && strcmp(cache[i]->path, path) == 0){
+            if (cache[i]->dev == dirstat.st_dev &&
+                cache[i]->ino == dirstat.st_ino &&
+                cache[i]->mtime == dirstat.st_mtime &&
+                cache[i]->mtime_nsec == MTIME_NSEC(dirstat) &&
+                now - cache[i]->built < DL_MAX_AGE){
+                index = cache[i];
+                index->refs++;
+                cache_used[i] = ++cache_clock;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (index)
+        return index;
+    return (dl_index*)sf_do(&builds, path, build_cached_index, share_index,
+                            &dirstat);
+}
+
+//----------------------------------------------------------------------------//
+static void* build_cached_index(const char* path, void* arg){
+    dl_index* index = build_index(path, (struct stat*)arg);
+    int i, slot = 0;
+    if (!index)
+        return NULL;
+
+    /*replacing the stale entry of path, or the least recently used*/
+    pthread_mutex_lock(&cache_lock);
+    for (i=0; i<DL_CACHE_DIRS; i++) {
+        if (cache[i] && strcmp(cache[i]->path, path) == 0){
+            slot = i;
+            break;
+        }
+        if (!cache[i] || (cache[slot] && cache_used[i] < cache_used[slot]))
+            slot = i;
+    }
+    if (cache[slot] && --cache[slot]->refs == 0)
+        free_index(cache[slot]);
+    cache[slot] = index;
+    cache_used[slot] = ++cache_clock;
+    index->refs = 2; //the cache and the caller
+    pthread_mutex_unlock(&cache_lock);
+    return index;
+}
+
+//----------------------------------------------------------------------------//
+static void* share_index(void* result, void* arg){
+    dl_index* index = (dl_index*)result;
+    (void)arg;
+    pthread_mutex_lock(&cache_lock);
+    index->refs++;
+    pthread_mutex_unlock(&cache_lock);
+    return index;
+}
+
+//----------------------------------------------------------------------------//
+static void release_index(dl_index* index){
+    int refs;
+    pthread_mutex_lock(&cache_lock);
+    refs = --index->refs;
+    pthread_mutex_unlock(&cache_lock);
+    if (refs == 0)
+        free_index(index);
+}
+
+//----------------------------------------------------------------------------//
+static dl_index* build_index(const char* path, struct stat* dirstat){
+    int (*compare[DL_SORTS])(const void*, const void*) = {compare_name,
+                                                          compare_mtime,
+                                                          compare_size};
+    dl_index* index = (dl_index*)calloc(1, sizeof(dl_index));
+    struct dirent **namelist;
+    struct stat statbuf;
+    char* item_path;
+    int num_entries, i, s;
+
+    if (!index)
+        return NULL;
+    num_entries = scandir(path, &namelist, NULL, NULL);
+    if (num_entries < 0){
+        free(index);
+        return NULL;
+    }
+    index->path = strdup(path);
+    index->items = (dl_item*)malloc((num_entries+1)*sizeof(dl_item));
+    item_path = (char*)malloc(strlen(path)+sizeof(namelist[0]->d_name)+1);
+    for (i=0; i<num_entries; i++) {
+        if (index->path && index->items && item_path &&
+            strcmp(namelist[i]->d_name, ".") != 0 &&
+            strcmp(namelist[i]->d_name, "..") != 0){
+            strcpy(item_path, path);
+            strcat(item_path, namelist[i]->d_name);
+            /*an entry removed since scandir() is just left out*/
+            if (stat(item_path, &statbuf) == 0 &&
+                (index->items[index->num_items].name =
+                                            strdup(namelist[i]->d_name))){
+                index->items[index->num_items].mtime = statbuf.st_mtime;
+                index->items[index->num_items].size = S_ISREG(statbuf.st_mode) ?
+                                                      statbuf.st_size : 0;
+                index->items[index->num_items].is_dir =
+                                                    S_ISDIR(statbuf.st_mode);
+                index->num_items++;
+            }
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    free(item_path);
+    if (!index->path || !index->items){
+        free_index(index);
+        return NULL;
+    }
+
+    sort_items = index->items;
+    for (s=0; s<DL_SORTS; s++) {
+        index->order[s] = (int*)malloc((index->num_items+1)*sizeof(int));
+        if (!index->order[s]){
+            free_index(index);
+            return NULL;
+        }
+        for (i=0; i<index->num_items; i++)
+            index->order[s][i] = i;
+        qsort(index->order[s], index->num_items, sizeof(int), compare[s]);
+    }
+    index->dev = dirstat->st_dev;
+    index->ino = dirstat->st_ino;
+    index->mtime = dirstat->st_mtime;
+    index->mtime_nsec = MTIME_NSEC(*dirstat);
+    index->built = time(NULL);
+    return index;
+}
+
+//----------------------------------------------------------------------------//
+static void free_index(dl_index* index){
+    int i;
+    for (i=0; index->items && i<index->num_items; i++)
+        free(index->items[i].name);
+    for (i=0; i<DL_SORTS; i++)
+        free(index->order[i]);
+    free(index->items);
+    free(index->path);
+    free(index);
+}
+
+//----------------------------------------------------------------------------//
+static int compare_name(const void* a, const void* b){
+    return strcoll(sort_items[*(const int*)a].name,
+                   sort_items[*(const int*)b].name);
+}
+
+//----------------------------------------------------------------------------//
+static int compare_mtime(const void* a, const void* b){
+    const dl_item* ia = &sort_items[*(const int*)a];
+    const dl_item* ib = &sort_items[*(const int*)b];
+    if (ia->mtime != ib->mtime)
+        return ia->mtime < ib->mtime ? -1 : 1;
+    return compare_name(a, b);
+}
+
+//----------------------------------------------------------------------------//
+static int compare_size(const void* a, const void* b){
+    const dl_item* ia = &sort_items[*(const int*)a];
+    const dl_item* ib = &sort_items[*(const int*)b];
+    if (ia->size != ib->size)
+        return ia->size < ib->size ? -1 : 1;
+    return compare_name(a, b);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the classic listing page. "." and ".." head the first page, a link to
+ * the next page follows the table when the listing is cut.
+ */
+static void render_html(dl_buf* out, const char* path, dl_index* index,
+                        const dl_query* query, int first, int last){
+    static const char* sorts[DL_SORTS] = {"name", "mtime", "size"};
+    const char* specials[] = {".", ".."};
+    struct stat statbuf;
+    char timebuf[TIMEBUF];
+    char* special_path;
+    int i, n;
+
+    append(out, "<HTML>\n<HEAD><TITLE>Index of %s</TITLE></HEAD>\n\n"
+           "<BODY>\n<H4>%s</H4>\n\n<table CELLSPACING=8>\n"
+           "<th>Name</th><th>Last Modified</th><th>Size</th></tr>\n\n",
+           path, path);
+    for (i=0; first == 0 && i<2; i++) {
+        special_path = (char*)malloc(strlen(path)+strlen(specials[i])+1);
+        if (!special_path){
+            out->failed = TRUE;
+            return;
+        }
+        sprintf(special_path, "%s%s", path, specials[i]);
+        if (stat(special_path, &statbuf) == 0){
+            strftime(timebuf, TIMEBUF, RFC1123FMT, gmtime(&statbuf.st_mtime));
+            append(out, "<tr>\n<td><A HREF=\"%s\">%s</A></td><td>%s</td>\n"
+                   "<td></td>\n</tr>\n\n", specials[i], specials[i], timebuf);
+        }
+        free(special_path);
+    }
+    for (i=first; i<last; i++) {
+        n = index->order[query->sort][query->descending ?
+                                      index->num_items-1-i : i];
+        strftime(timebuf, TIMEBUF, RFC1123FMT,
+                 gmtime(&index->items[n].mtime));
+        append(out, "<tr>\n<td><A HREF=\"%s\">%s</A></td><td>%s</td>\n<td>",
+               index->items[n].name, index->items[n].name, timebuf);
+        if (!index->items[n].is_dir)
+            append(out, "%lu", (unsigned long)index->items[n].size);
+        append(out, "</td>\n</tr>\n\n");
+    }
+    append(out, "</table>\n\n");
+    if (last < index->num_items)
+        append(out, "<A HREF=\"?offset=%d&limit=%d&sort=%s%s\">Next page</A>"
+               "\n\n", last, last-first, query->descending ? "-" : "",
+               sorts[query->sort]);
+    append(out, "<HR>\n\n<ADDRESS>webserver/1.1</ADDRESS>\n\n</BODY></HTML>");
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * JSON: an object with the page and where the next one starts (null at
+ * the end). NDJSON: only the entries, one object per line.
+ */
+static void render_json(dl_buf* out, const char* path, dl_index* index,
+                        const dl_query* query, int first, int last){
+    int i, n;
+
+    if (query->format == DL_JSON){
+        append(out, "{\"path\":");
+        append_json_string(out, path);
+        append(out, ",\"total\":%d,\"offset\":%d,\"next\":", index->num_items,
+               first);
+        if (last < index->num_items)
+            append(out, "%d", last);
+        else
+            append(out, "null");
+        append(out, ",\"entries\":[");
+    }
+    for (i=first; i<last; i++) {
+        n = index->order[query->sort][query->descending ?
+                                      index->num_items-1-i : i];
+        if (query->format == DL_JSON && i > first)
+            append(out, ",");
+        render_item(out, &index->items[n]);
+        if (query->format == DL_NDJSON)
+            append(out, "\n");
+    }
+    if (query->format == DL_JSON)
+        append(out, "]}\n");
+    else if (!out->data)
+        append(out, ""); //an empty page is still a page
+}
+
+//----------------------------------------------------------------------------//
+static void render_item(dl_buf* out, const dl_item* item){
+    append(out, "{\"name\":");
+    append_json_string(out, item->name);
+    append(out, ",\"type\":\"%s\",\"size\":%lu,\"mtime\":%lld}",
+           item->is_dir ? "dir" : "file", (unsigned long)item->size,
+           (long long)item->mtime);
+}
+
+//----------------------------------------------------------------------------//
+static void append(dl_buf* out, const char* fmt, ...){
+    va_list args;
+    size_t capacity;
+    char* data;
+    int len;
+
+    if (out->failed)
+        return;
+    while (TRUE) {
+        va_start(args, fmt);
+        len = vsnprintf(out->data ? out->data+out->len : NULL,
+                        out->data ? out->capacity-out->len : 0, fmt, args);
+        va_end(args);
+        if (len < 0){
+            out->failed = TRUE;
+            return;
+        }
+        if (out->data && out->len+len < out->capacity){
+            out->len += len;
+            return;
+        }
+        capacity = out->capacity ? out->capacity*2 : 4096;
+        while (capacity <= out->len+len)
+            capacity *= 2;
+        data = (char*)realloc(out->data, capacity);
+        if (!data){
+            out->failed = TRUE;
+            return;
+        }
+        out->data = data;
+        out->capacity = capacity;
+    }
+}
+
+//----------------------------------------------------------------------------//
+static void append_json_string(dl_buf* out, const char* str){
+    append(out, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            append(out, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            append(out, "\\u%04x", (unsigned char)*str);
+        else
+            append(out, "%c", *str);
+    }
+    append(out, "\"");
+}
@@ -0,0 +1,90 @@
+//
+//  dirlist.h
+//  ex_3
+//
+
+#ifndef dirlist_h
+#define dirlist_h
+
+#include <time.h>
+#include <sys/types.h>
+
+// listing orders, ?sort=name|mtime|size, "-" in front for descending
+#define DL_SORT_NAME 0
+#define DL_SORT_MTIME 1
+#define DL_SORT_SIZE 2
+#define DL_SORTS 3
+
+// listing formats, chosen by Accept
+#define DL_HTML 0
+#define DL_JSON 1       //application/json
+#define DL_NDJSON 2     //application/x-ndjson, an entry per line
+
+// directories whose index is cached
+#define DL_CACHE_DIRS 16
+// seconds an index is trusted, file sizes and times change without
+// touching the directory
+#define DL_MAX_AGE 10
+
+
+/**
+ * an entry of a directory, "." and ".." excluded
+ */
+typedef struct _dl_item {
+    char* name;
+    time_t mtime;
+    off_t size;
+    int is_dir;
+} dl_item;
+
+
+/**
+ * sorted index of a directory, immutable once built. it is rebuilt when
+ * the directory changes or gets older than DL_MAX_AGE.
+ */
+typedef struct _dl_index {
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_nsec;
+    time_t built;
+    int num_items;
+    dl_item* items;
+    int* order[DL_SORTS];   //items in every order, ascending
+    int refs;               //cache reference plus renders in progress
+} dl_index;
+
+
+/**
+ * a page of a listing
+ */
+typedef struct _dl_query {
+    int offset;
+    int limit;          //-1 - to the end
+    int sort;
+    int descending;
+    int format;
+} dl_query;
+
+
+/**
+ * dl_parse_query fills query from a query string (without the '?'),
+ * NULL gives the full listing by name. unknown parameters are ignored.
+ */
+void dl_parse_query(const char* query_string, int format, dl_query* query);
+
+/**
+ * dl_render returns an allocated page of the listing of path (ending
+ * with '/'), its length in *len. the first listing of a directory reads
+ * and sorts it, later pages cost only their own entries.
+ * returns NULL on failure.
+ */
+char* dl_render(const char* path, const dl_query* query, unsigned long* len);
+
+/**
+ * dl_clear_cache drops every cached index
+ */
+void dl_clear_cache(void);
+
+#endif /* dirlist_h */
@@ -0,0 +1,346 @@
+//
+//  hotset.c
+//  ex_3
+//
+
+#include "hotset.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+#define LINE_SIZE 4096
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static uint32_t hash_path(const char* path);
+static void add_hits(hotset* set, const char* path, uint64_t hits);
+static int load_hotset(hotset* set);
+static int save_hotset(hotset* set);
+static void age_shard(hs_shard* shard);
+static int compare_hits(const void* a, const void* b);
+static void* saver_thread(void* p);
+static void* prefetcher_thread(void* p);
+static void free_hotset(hotset* set);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+hotset* create_hotset(const char* path, hs_prefetch_fn prefetch, void* ctx){
+    hotset* set = (hotset*)calloc(1, sizeof(hotset));
+    int i, loaded;
+    if (!set)
+        return NULL;
+    set->path = strdup(path);
+    if (!set->path){
+        free(set);
+        return NULL;
+    }
+    for (i=0; i<HS_SHARDS; i++)
+        pthread_mutex_init(&set->shards[i].lock, NULL);
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->wakeup, NULL);
+    set->prefetch = prefetch;
+    set->ctx = ctx;
+
+    /*no saved set yet is the usual first start*/
+    loaded = load_hotset(set);
+    if (pthread_create(&set->saver, NULL, saver_thread, set) != 0){
+        perror("Error on hot set thread");
+        free_hotset(set);
+        return NULL;
+    }
+    if (loaded == SUCCESS && prefetch)
+        set->prefetching = pthread_create(&set->prefetcher, NULL,
+                                          prefetcher_thread, set) == 0;
+    return set;
+}
+
+//----------------------------------------------------------------------------//
+void hs_hit(hotset* set, const char* path){
+    add_hits(set, path, 1);
+}
+
+//----------------------------------------------------------------------------//
+uint64_t hs_hits(hotset* set, const char* path){
+    uint32_t h = hash_path(path);
+    hs_shard* shard = &set->shards[h & (HS_SHARDS-1)];
+    hs_entry* entry;
+    uint64_t hits = 0;
+    uint32_t i;
+
+    pthread_mutex_lock(&shard->lock);
+    for (i=0; i<HS_SHARD_SLOTS; i++) {
+        entry = &shard->slots[((h / HS_SHARDS) + i) & (HS_SHARD_SLOTS-1)];
+        if (!entry->path)
+            break;
+        if (strcmp(entry->path, path) == 0){
+            hits = entry->hits;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return hits;
+}
+
+//----------------------------------------------------------------------------//
+void destroy_hotset(hotset* set){
+    if (!set)
+        return;
+    pthread_mutex_lock(&set->lock);
+    set->shutdown = TRUE;
+    pthread_cond_broadcast(&set->wakeup);
+    pthread_mutex_unlock(&set->lock);
+    pthread_join(set->saver, NULL);
+    if (set->prefetching)
+        pthread_join(set->prefetcher, NULL);
+    free_hotset(set);
+}
+
+//----------------------------------------------------------------------------//
+static void free_hotset(hotset* set){
+    hs_entry* entry;
+    int i, j;
+    for (i=0; i<HS_SHARDS; i++) {
+        for (j=0; j<HS_SHARD_SLOTS; j++) {
+            entry = &set->shards[i].slots[j];
+            free(entry->path);
+        }
+        pthread_mutex_destroy(&set->shards[i].lock);
+    }
+    pthread_mutex_destroy(&set->lock);
+    pthread_cond_destroy(&set->wakeup);
+    free(set->path);
+    free(set);
+}
+
+//----------------------------------------------------------------------------//
+static uint32_t hash_path(const char* path){
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//----------------------------------------------------------------------------//
+static void add_hits(hotset* set, const char* path, uint64_t hits){
+    uint32_t h = hash_path(path);
+    hs_shard* shard = &set->shards[h & (HS_SHARDS-1)];
+    hs_entry* entry;
+    uint32_t i, slot;
+
+    pthread_mutex_lock(&shard->lock);
+    for (i=0; i<HS_SHARD_SLOTS; i++) {
+        /*linear probing on the bits the shard index did not use*/
+        slot = ((h / HS_SHARDS) + i) & (HS_SHARD_SLOTS-1);
+        entry = &shard->slots[slot];
+        if (!entry->path){
+            entry->path = strdup(path);
+            if (entry->path)
+                entry->hits = hits;
+            break;
+        }
+        if (strcmp(entry->path, path) == 0){
+            entry->hits += hits;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * reads "<hits> <path>" lines back into the table
+ */
+static int load_hotset(hotset* set){
+    char line[LINE_SIZE];
+    unsigned long long hits;
+    char* path;
+    size_t len;
+    FILE* file = fopen(set->path, "r");
+    if (!file)
+        return FAILURE;
+    while (fgets(line, sizeof(line), file)) {
+        len = strlen(line);
+        if (len && line[len-1] == '\n')
+            line[--len] = '\0';
+        hits = strtoull(line, &path, 10);
+        /*the file is not trusted, paths leaving the document root go*/
+        if (*path != ' ' || !path[1] || path[1] == '/' || strstr(path, ".."))
+            continue;
+        add_hits(set, path+1, hits);
+    }
+    fclose(file);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * writes the hottest paths, through a temporary file and rename() so a
+ * crash never leaves half a file behind, then halves every count
+ */
+static int save_hotset(hotset* set){
+    hs_entry* entries;
+    hs_entry* entry;
+    char* tmp_path;
+    FILE* file;
+    int i, j, count = 0, rc = SUCCESS;
+
+    entries = (hs_entry*)malloc(HS_SHARDS*HS_SHARD_SLOTS*sizeof(hs_entry));
+    tmp_path = (char*)malloc(strlen(set->path)+5);
+    if (!entries || !tmp_path){
+        free(entries);
+        free(tmp_path);
+        return FAILURE;
+    }
+
+    /*copies of the paths, the table keeps changing while writing*/
+    for (i=0; i<HS_SHARDS; i++) {
+        pthread_mutex_lock(&set->shards[i].lock);
+        for (j=0; j<HS_SHARD_SLOTS; j++) {
+            entry = &set->shards[i].slots[j];
+            if (entry->path && entry->hits &&
+                (entries[count].path = strdup(entry->path))){
+                entries[count].hits = entry->hits;
+                count++;
+            }
+        }
+        pthread_mutex_unlock(&set->shards[i].lock);
+    }
+    qsort(entries, count, sizeof(hs_entry), compare_hits);
+
+    sprintf(tmp_path, "%s.tmp", set->path);
+    file = fopen(tmp_path, "w");
+    if (file){
+        for (i=0; i<count && i<HS_MAX_SAVED; i++)
+            fprintf(file, "%llu %s\n", (unsigned long long)entries[i].hits,
+                    entries[i].path);
+        if (fclose(file) != 0 || rename(tmp_path, set->path) == -1)
+            rc = FAILURE;
+    } else
+        rc = FAILURE;
+    if (rc == FAILURE)
+        perror("Error on hot set save");
+    for (i=0; i<count; i++)
+        free(entries[i].path);
+    free(entries);
+    free(tmp_path);
+
+    for (i=0; i<HS_SHARDS; i++) {
+        pthread_mutex_lock(&set->shards[i].lock);
+        age_shard(&set->shards[i]);
+        pthread_mutex_unlock(&set->shards[i].lock);
+    }
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * halves every count and drops the paths that reach zero. emptying a slot
+ * in place would break the probe chains through it, so the survivors are
+ * inserted again into a cleared shard. the caller holds the shard lock.
+ */
+static void age_shard(hs_shard* shard){
+    hs_entry kept[HS_SHARD_SLOTS];
+    hs_entry* entry;
+    uint32_t h, slot;
+    int i, j, count = 0;
+
+    for (i=0; i<HS_SHARD_SLOTS; i++) {
+        entry = &shard->slots[i];
+        if (!entry->path)
+            continue;
+        entry->hits /= 2;
+        if (entry->hits)
+            kept[count++] = *entry;
+        else
+            free(entry->path);
+        entry->path = NULL;
+        entry->hits = 0;
+    }
+    for (i=0; i<count; i++) {
+        h = hash_path(kept[i].path);
+        for (j=0; j<HS_SHARD_SLOTS; j++) {
+            slot = ((h / HS_SHARDS) + j) & (HS_SHARD_SLOTS-1);
+            if (!shard->slots[slot].path){
+                shard->slots[slot] = kept[i];
+                break;
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------//
+static int compare_hits(const void* a, const void* b){
+    uint64_t ha = ((const hs_entry*)a)->hits, hb = ((const hs_entry*)b)->hits;
+    return ha < hb ? 1 : ha > hb ? -1 : 0;
+}
+
+//----------------------------------------------------------------------------//
+static void* saver_thread(void* p){
+    hotset* set = (hotset*)p;
+    struct timespec deadline;
+    int shutdown;
+
+    pthread_mutex_lock(&set->lock);
+    while (!set->shutdown) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += HS_PERSIST_PERIOD;
+        while (!set->shutdown &&
+               pthread_cond_timedwait(&set->wakeup, &set->lock,
+                                      &deadline) != ETIMEDOUT);
+        shutdown = set->shutdown;
+        pthread_mutex_unlock(&set->lock);
+        save_hotset(set);
+        pthread_mutex_lock(&set->lock);
+        if (shutdown)
+            break;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * hands the loaded paths, hottest first, to the prefetch callback
+ */
+static void* prefetcher_thread(void* p){
+    hotset* set = (hotset*)p;
+    hs_entry* entries;
+    hs_entry* entry;
+    int i, j, count = 0, shutdown;
+
+    entries = (hs_entry*)malloc(HS_SHARDS*HS_SHARD_SLOTS*sizeof(hs_entry));
+    if (!entries)
+        return NULL;
+    for (i=0; i<HS_SHARDS; i++) {
+        pthread_mutex_lock(&set->shards[i].lock);
+        for (j=0; j<HS_SHARD_SLOTS; j++) {
+            entry = &set->shards[i].slots[j];
+            if (entry->path && (entries[count].path = strdup(entry->path))){
+                entries[count].hits = entry->hits;
+                count++;
+            }
+        }
+        pthread_mutex_unlock(&set->shards[i].lock);
+    }
+    qsort(entries, count, sizeof(hs_entry), compare_hits);
+
+    for (i=0; i<count; i++) {
+        pthread_mutex_lock(&set->lock);
+        shutdown = set->shutdown;
+        pthread_mutex_unlock(&set->lock);
+        if (!shutdown)
+            set->prefetch(set->ctx, entries[i].path);
+        free(entries[i].path);
+    }
+    free(entries);
+    return NULL;
+}
@@ -0,0 +1,82 @@
+//
+//  hotset.h
+//  ex_3
+//
+
+#ifndef hotset_h
+#define hotset_h
+
+#include <stdint.h>
+#include <pthread.h>
+
+// number of independent shards in the table, must be a power of two
+#define HS_SHARDS 16
+// paths tracked by each shard, must be a power of two
+#define HS_SHARD_SLOTS 256
+// seconds between two saves of the hot set
+#define HS_PERSIST_PERIOD 30
+// hottest paths written to the file
+#define HS_MAX_SAVED 512
+
+
+/**
+ * prefetch callback, called from a background thread for every path of
+ * the saved hot set, hottest first
+ */
+typedef void (*hs_prefetch_fn)(void* ctx, const char* path);
+
+
+typedef struct _hs_entry {
+    char* path;             //NULL while the slot is free
+    uint64_t hits;
+} hs_entry;
+
+
+typedef struct _hs_shard {
+    pthread_mutex_t lock;
+    hs_entry slots[HS_SHARD_SLOTS];
+} hs_shard;
+
+
+/**
+ * The hot set: hit counts of served files. counts are halved after every
+ * save, so files that went cold age out of the set.
+ */
+typedef struct _hotset_st {
+    char* path;
+    pthread_t saver;
+    pthread_t prefetcher;
+    int prefetching;            //1 if the prefetcher was started
+    pthread_mutex_t lock;       //guards shutdown
+    pthread_cond_t wakeup;
+    int shutdown;
+    hs_prefetch_fn prefetch;
+    void* ctx;
+    hs_shard shards[HS_SHARDS];
+} hotset;
+
+
+/**
+ * create_hotset loads the hot set saved at path, if any, and starts
+ * prefetching its files in the background and saving it periodically.
+ * returns NULL on failure.
+ */
+hotset* create_hotset(const char* path, hs_prefetch_fn prefetch, void* ctx);
+
+/**
+ * hs_hit counts a request served from path. paths that do not fit in
+ * the table are not counted.
+ */
+void hs_hit(hotset* set, const char* path);
+
+/**
+ * hs_hits returns the recent hits of path, 0 if it is not in the table
+ */
+uint64_t hs_hits(hotset* set, const char* path);
+
+/**
+ * destroy_hotset stops the threads, saves the set a last time and frees it
+ */
+void destroy_hotset(hotset* set);
+
+#endif /* hotset_h */
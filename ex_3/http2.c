@@ -0,0 +1,1334 @@
+//
+//  http2.c
+//  ex_3
+//
+
+#include "http2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384      //our SETTINGS_MAX_FRAME_SIZE, the default
+#define H2_INBUF ((H2_FRAME_HEADER+H2_MAX_FRAME)*2)
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_HEADER_TABLE 4096    //our SETTINGS_HEADER_TABLE_SIZE, the default
+#define H2_TABLE_SLOTS (H2_HEADER_TABLE/32+1)
+#define H2_ENTRY_OVERHEAD 32
+#define H2_MAX_HEADER_BLOCK 65536
+#define H2_MAX_HEADER_LINES 16384
+#define H2_RESP_HEADERS 2048
+#define H2_STATIC_ENTRIES 61
+#define H2_WINDOW_THRESHOLD 32768
+#define H2_HUFF_NODES 512
+
+/*frame types*/
+#define F_DATA 0x0
+#define F_HEADERS 0x1
+#define F_PRIORITY 0x2
+#define F_RST_STREAM 0x3
+#define F_SETTINGS 0x4
+#define F_PUSH_PROMISE 0x5
+#define F_PING 0x6
+#define F_GOAWAY 0x7
+#define F_WINDOW_UPDATE 0x8
+#define F_CONTINUATION 0x9
+
+/*frame flags*/
+#define FL_END_STREAM 0x1
+#define FL_ACK 0x1
+#define FL_END_HEADERS 0x4
+#define FL_PADDED 0x8
+#define FL_PRIORITY 0x20
+
+/*settings identifiers*/
+#define S_HEADER_TABLE_SIZE 0x1
+#define S_MAX_CONCURRENT_STREAMS 0x3
+#define S_INITIAL_WINDOW_SIZE 0x4
+#define S_MAX_FRAME_SIZE 0x5
+
+/*error codes*/
+#define E_NO_ERROR 0x0
+#define E_PROTOCOL 0x1
+#define E_INTERNAL 0x2
+#define E_FLOW_CONTROL 0x3
+#define E_FRAME_SIZE 0x6
+#define E_REFUSED_STREAM 0x7
+#define E_COMPRESSION 0x9
+
+/*read_frame results*/
+#define FRAME_OK 0
+#define FRAME_CLOSED 1
+#define FRAME_TOO_BIG 2
+#define FRAME_ERROR -1
+
+static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+
+typedef struct _hpack_entry {
+    char* name;
+    char* value;
+    size_t size;        //name + value + 32, as defined by HPACK
+} hpack_entry;
+
+/**
+ * HPACK dynamic table, a ring with the newest entry at head
+ */
+typedef struct _hpack_table {
+    hpack_entry entries[H2_TABLE_SLOTS];
+    int head;
+    int count;
+    size_t size;
+    size_t max_size;
+} hpack_table;
+
+typedef struct _h2_frame {
+    uint32_t length;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream;
+} h2_frame;
+
+typedef struct _h2_stream {
+    uint32_t id;            //0 - free slot
+    int64_t window;         //send window
+    off_t offset;           //body bytes sent so far
+    h2_response resp;
+} h2_stream;
+
+typedef struct _h2_conn {
+    h2_callbacks* cb;
+    unsigned char in[H2_INBUF];
+    size_t in_pos;
+    size_t in_len;
+    hpack_table decoder;
+    int64_t window;             //connection send window
+    int64_t initial_window;     //peer SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t max_frame;         //peer SETTINGS_MAX_FRAME_SIZE
+    uint32_t last_stream;       //highest stream opened by the client
+    int goaway;                 //1 if the client sent GOAWAY
+    int num_streams;
+    int next_stream;            //round robin cursor
+    h2_stream streams[H2_MAX_STREAMS];
+    unsigned char* block;       //header block waiting for CONTINUATION
+    size_t block_len;
+    uint32_t block_stream;
+    unsigned long recv_unacked; //DATA bytes not yet returned to the client
+} h2_conn;
+
+/**
+ * decoded request header block
+ */
+typedef struct _h2_headers {
+    char* method;
+    char* path;
+    char lines[H2_MAX_HEADER_LINES];    //regular headers, HTTP/1 style
+    size_t lines_len;
+} h2_headers;
+
+/*HPACK tables, RFC 7541 appendix A and B*/
+static const uint32_t huff_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff
+};
+
+static const unsigned char huff_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+static const char* static_table[H2_STATIC_ENTRIES][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}
+};
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static int h2_fill(h2_conn* conn, size_t need);
+static int h2_read_frame(h2_conn* conn, h2_frame* frame,
+                         unsigned char** payload);
+static int h2_frame_buffered(h2_conn* conn);
+static int h2_write_all(h2_conn* conn, const void* buf, size_t len);
+static void h2_put_frame_header(unsigned char* buf, uint32_t length,
+                                uint8_t type, uint8_t flags, uint32_t stream);
+static int h2_send_frame(h2_conn* conn, uint8_t type, uint8_t flags,
+                         uint32_t stream, const unsigned char* payload,
+                         uint32_t length);
+static int h2_send_u32(h2_conn* conn, uint8_t type, uint32_t stream,
+                       uint32_t value);
+static int h2_send_goaway(h2_conn* conn, uint32_t error);
+static int h2_apply_settings(h2_conn* conn, const unsigned char* payload,
+                             uint32_t length);
+static int h2_handle_frame(h2_conn* conn, h2_frame* frame,
+                           unsigned char* payload);
+static int h2_handle_headers(h2_conn* conn, h2_frame* frame,
+                             unsigned char* payload);
+static int h2_handle_data(h2_conn* conn, h2_frame* frame);
+static int h2_handle_window_update(h2_conn* conn, h2_frame* frame,
+                                   unsigned char* payload);
+static int h2_end_header_block(h2_conn* conn, uint32_t stream_id,
+                               const unsigned char* block, size_t len);
+static h2_stream* h2_find_stream(h2_conn* conn, uint32_t id);
+static int h2_start_stream(h2_conn* conn, uint32_t id, const char* method,
+                           const char* path, const char* headers);
+static int h2_send_headers(h2_conn* conn, h2_stream* stream);
+static int h2_send_data_round(h2_conn* conn);
+static int h2_data_pending(h2_conn* conn);
+static void h2_release_stream(h2_conn* conn, h2_stream* stream);
+static int hpack_decode_block(hpack_table* table, const unsigned char* p,
+                              size_t len, h2_headers* out);
+static int hpack_decode_int(const unsigned char** p, const unsigned char* end,
+                            int prefix, uint32_t* value);
+static char* hpack_decode_string(const unsigned char** p,
+                                 const unsigned char* end);
+static int hpack_lookup(hpack_table* table, uint32_t index,
+                        const char** name, const char** value);
+static void hpack_add(hpack_table* table, const char* name, const char* value);
+static void hpack_evict(hpack_table* table, size_t max_size);
+static int hpack_encode(unsigned char* buf, size_t cap, size_t* pos,
+                        const char* name, const char* value);
+static void huff_build(void);
+static char* huff_decode(const unsigned char* p, size_t len);
+static int h2_add_header(h2_headers* out, const char* name, const char* value);
+static int base64url_decode(const char* in, unsigned char* out, size_t cap);
+
+static short huff_tree[H2_HUFF_NODES][2];
+static pthread_once_t huff_once = PTHREAD_ONCE_INIT;
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+int h2_serve(h2_callbacks* cb, const h2_start* start){
+    h2_conn* conn;
+    h2_frame frame;
+    unsigned char* payload;
+    unsigned char settings[H2_MAX_FRAME];
+    int settings_len, rc, error = E_NO_ERROR, result = SUCCESS, i;
+    /*MAX_CONCURRENT_STREAMS, everything else keeps the protocol default*/
+    const unsigned char server_settings[] = {
+        0, S_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS
+    };
+
+    pthread_once(&huff_once, huff_build);
+    conn = (h2_conn*)calloc(1, sizeof(h2_conn));
+    if (!conn)
+        return FAILURE;
+    conn->cb = cb;
+    conn->window = H2_DEFAULT_WINDOW;
+    conn->initial_window = H2_DEFAULT_WINDOW;
+    conn->max_frame = H2_MAX_FRAME;
+    conn->decoder.max_size = H2_HEADER_TABLE;
+
+    if (start->preread_len > H2_INBUF){
+        free(conn);
+        return FAILURE;
+    }
+    memcpy(conn->in, start->preread, start->preread_len);
+    conn->in_len = start->preread_len;
+
+    if (start->mode == H2_UPGRADE && start->settings){
+        settings_len = base64url_decode(start->settings, settings,
+                                        sizeof(settings));
+        if (settings_len < 0 ||
+            h2_apply_settings(conn, settings, settings_len) != E_NO_ERROR){
+            free(conn);
+            return FAILURE;
+        }
+    }
+
+    if (h2_send_frame(conn, F_SETTINGS, 0, 0, server_settings,
+                      sizeof(server_settings)) == FAILURE){
+        free(conn);
+        return FAILURE;
+    }
+
+    /*checking the (rest of the) client preface*/
+    const char* preface = client_preface;
+    size_t preface_len = H2_PREFACE_LEN;
+    if (start->mode == H2_PRIOR_KNOWLEDGE){
+        preface += H2_PREFACE_LEN - 6; //"SM\r\n\r\n" is still to come
+        preface_len = 6;
+    }
+    if (h2_fill(conn, preface_len) != FRAME_OK ||
+        memcmp(conn->in+conn->in_pos, preface, preface_len) != 0){
+        h2_send_goaway(conn, E_PROTOCOL);
+        free(conn);
+        return FAILURE;
+    }
+    conn->in_pos += preface_len;
+
+    if (start->mode == H2_UPGRADE){
+        conn->last_stream = 1;
+        h2_start_stream(conn, 1, start->method, start->path, start->headers);
+    }
+
+    while (TRUE) {
+        int pending = h2_data_pending(conn);
+        if (!pending && conn->goaway && conn->num_streams == 0)
+            break;
+
+        if (!pending || h2_frame_buffered(conn) || cb->readable(cb->ctx)){
+            rc = h2_read_frame(conn, &frame, &payload);
+            if (rc == FRAME_CLOSED)
+                break;
+            if (rc != FRAME_OK){
+                if (rc == FRAME_TOO_BIG)
+                    error = E_FRAME_SIZE;
+                result = FAILURE;
+                break;
+            }
+            error = h2_handle_frame(conn, &frame, payload);
+            if (error != E_NO_ERROR){
+                result = FAILURE;
+                break;
+            }
+            continue;
+        }
+
+        if (h2_send_data_round(conn) == FAILURE){
+            result = FAILURE;
+            break;
+        }
+    }
+
+    h2_send_goaway(conn, error);
+    for (i=0; i<H2_MAX_STREAMS; i++)
+        if (conn->streams[i].id)
+            h2_release_stream(conn, &conn->streams[i]);
+    hpack_evict(&conn->decoder, 0);
+    free(conn->block);
+    free(conn);
+    return result;
+}
+
+//----------------------------------------------------------------------------//
+//-------------------------------FRAMING--------------------------------------//
+//----------------------------------------------------------------------------//
+/**
+ * makes sure need bytes are buffered, reading as much as fits.
+ */
+static int h2_fill(h2_conn* conn, size_t need){
+    ssize_t rc;
+    if (conn->in_len - conn->in_pos >= need)
+        return FRAME_OK;
+    if (need > H2_INBUF)
+        return FRAME_ERROR;
+
+    if (conn->in_pos + need > H2_INBUF){
+        memmove(conn->in, conn->in+conn->in_pos, conn->in_len-conn->in_pos);
+        conn->in_len -= conn->in_pos;
+        conn->in_pos = 0;
+    }
+    while (conn->in_len - conn->in_pos < need) {
+        rc = conn->cb->read(conn->cb->ctx, conn->in+conn->in_len,
+                            H2_INBUF-conn->in_len);
+        if (rc == 0)
+            return FRAME_CLOSED;
+        if (rc < 0)
+            return FRAME_ERROR;
+        conn->in_len += rc;
+    }
+    return FRAME_OK;
+}
+
+//----------------------------------------------------------------------------//
+static int h2_read_frame(h2_conn* conn, h2_frame* frame,
+                         unsigned char** payload){
+    unsigned char* p;
+    int rc = h2_fill(conn, H2_FRAME_HEADER);
+    if (rc != FRAME_OK)
+        return rc;
+
+    p = conn->in+conn->in_pos;
+    frame->length = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    frame->type = p[3];
+    frame->flags = p[4];
+    frame->stream = (((uint32_t)p[5] << 24) | ((uint32_t)p[6] << 16) |
+                     ((uint32_t)p[7] << 8) | p[8]) & 0x7fffffff;
+    if (frame->length > H2_MAX_FRAME)
+        return FRAME_TOO_BIG;
+
+    rc = h2_fill(conn, H2_FRAME_HEADER+frame->length);
+    if (rc != FRAME_OK)
+        return rc;
+    *payload = conn->in+conn->in_pos+H2_FRAME_HEADER;
+    conn->in_pos += H2_FRAME_HEADER+frame->length;
+    return FRAME_OK;
+}
+
+//----------------------------------------------------------------------------//
+static int h2_frame_buffered(h2_conn* conn){
+    size_t avail = conn->in_len - conn->in_pos;
+    unsigned char* p = conn->in+conn->in_pos;
+    if (avail < H2_FRAME_HEADER)
+        return FALSE;
+    return avail >= H2_FRAME_HEADER +
+                (((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2]);
+}
+
+//----------------------------------------------------------------------------//
+static int h2_write_all(h2_conn* conn, const void* buf, size_t len){
+    size_t offset = 0;
+    ssize_t wc;
+    while (offset < len) {
+        wc = conn->cb->write(conn->cb->ctx, (const char*)buf+offset,
+                             len-offset);
+        if (wc <= 0)
+            return FAILURE;
+        offset += wc;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static void h2_put_frame_header(unsigned char* buf, uint32_t length,
+                                uint8_t type, uint8_t flags, uint32_t stream){
+    buf[0] = (length >> 16) & 0xff;
+    buf[1] = (length >> 8) & 0xff;
+    buf[2] = length & 0xff;
+    buf[3] = type;
+    buf[4] = flags;
+    buf[5] = (stream >> 24) & 0x7f;
+    buf[6] = (stream >> 16) & 0xff;
+    buf[7] = (stream >> 8) & 0xff;
+    buf[8] = stream & 0xff;
+}
+
+//----------------------------------------------------------------------------//
+static int h2_send_frame(h2_conn* conn, uint8_t type, uint8_t flags,
+                         uint32_t stream, const unsigned char* payload,
+                         uint32_t length){
+    unsigned char frame[H2_FRAME_HEADER+H2_MAX_FRAME];
+    if (length > H2_MAX_FRAME)
+        return FAILURE;
+    h2_put_frame_header(frame, length, type, flags, stream);
+    if (length)
+        memcpy(frame+H2_FRAME_HEADER, payload, length);
+    return h2_write_all(conn, frame, H2_FRAME_HEADER+length);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * frames whose payload is a single 32 bit value:
+ * RST_STREAM and WINDOW_UPDATE
+ */
+static int h2_send_u32(h2_conn* conn, uint8_t type, uint32_t stream,
+                       uint32_t value){
+    unsigned char payload[4];
+    payload[0] = (value >> 24) & 0xff;
+    payload[1] = (value >> 16) & 0xff;
+    payload[2] = (value >> 8) & 0xff;
+    payload[3] = value & 0xff;
+    return h2_send_frame(conn, type, 0, stream, payload, sizeof(payload));
+}
+
+//----------------------------------------------------------------------------//
+static int h2_send_goaway(h2_conn* conn, uint32_t error){
+    unsigned char payload[8];
+    uint32_t last = conn->last_stream;
+    payload[0] = (last >> 24) & 0x7f;
+    payload[1] = (last >> 16) & 0xff;
+    payload[2] = (last >> 8) & 0xff;
+    payload[3] = last & 0xff;
+    payload[4] = (error >> 24) & 0xff;
+    payload[5] = (error >> 16) & 0xff;
+    payload[6] = (error >> 8) & 0xff;
+    payload[7] = error & 0xff;
+    return h2_send_frame(conn, F_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+//----------------------------------------------------------------------------//
+//------------------------------FRAME HANDLING--------------------------------//
+//----------------------------------------------------------------------------//
+/**
+ * returns E_NO_ERROR, or the error code of a connection error
+ */
+static int h2_handle_frame(h2_conn* conn, h2_frame* frame,
+                           unsigned char* payload){
+    h2_stream* stream;
+    int error;
+
+    if (conn->block && frame->type != F_CONTINUATION)
+        return E_PROTOCOL; //header block must not be interrupted
+
+    switch (frame->type) {
+        case F_HEADERS:
+        case F_CONTINUATION:
+            return h2_handle_headers(conn, frame, payload);
+
+        case F_DATA:
+            return h2_handle_data(conn, frame);
+
+        case F_SETTINGS:
+            if (frame->stream != 0)
+                return E_PROTOCOL;
+            if (frame->flags & FL_ACK)
+                return frame->length ? E_FRAME_SIZE : E_NO_ERROR;
+            error = h2_apply_settings(conn, payload, frame->length);
+            if (error != E_NO_ERROR)
+                return error;
+            if (h2_send_frame(conn, F_SETTINGS, FL_ACK, 0, NULL, 0)==FAILURE)
+                return E_INTERNAL;
+            return E_NO_ERROR;
+
+        case F_PING:
+            if (frame->stream != 0)
+                return E_PROTOCOL;
+            if (frame->length != 8)
+                return E_FRAME_SIZE;
+            if (!(frame->flags & FL_ACK) &&
+                h2_send_frame(conn, F_PING, FL_ACK, 0, payload, 8) == FAILURE)
+                return E_INTERNAL;
+            return E_NO_ERROR;
+
+        case F_WINDOW_UPDATE:
+            return h2_handle_window_update(conn, frame, payload);
+
+        case F_RST_STREAM:
+            if (frame->stream == 0)
+                return E_PROTOCOL;
+            if (frame->length != 4)
+                return E_FRAME_SIZE;
+            stream = h2_find_stream(conn, frame->stream);
+            if (stream)
+                h2_release_stream(conn, stream);
+            return E_NO_ERROR;
+
+        case F_GOAWAY:
+            if (frame->stream != 0)
+                return E_PROTOCOL;
+            conn->goaway = TRUE;
+            return E_NO_ERROR;
+
+        case F_PRIORITY:
+            if (frame->stream == 0)
+                return E_PROTOCOL;
+            return E_NO_ERROR; //all streams get the same share
+
+        case F_PUSH_PROMISE:
+            return E_PROTOCOL; //clients must not push
+
+        default:
+            return E_NO_ERROR; //unknown frame types are ignored
+    }
+}
+
+//----------------------------------------------------------------------------//
+static int h2_apply_settings(h2_conn* conn, const unsigned char* payload,
+                             uint32_t length){
+    uint32_t i, value;
+    uint16_t id;
+    int64_t delta;
+    int j;
+
+    if (length % 6)
+        return E_FRAME_SIZE;
+    for (i=0; i<length; i+=6) {
+        id = (uint16_t)((payload[i] << 8) | payload[i+1]);
+        value = ((uint32_t)payload[i+2] << 24) | ((uint32_t)payload[i+3] << 16)
+              | ((uint32_t)payload[i+4] << 8) | payload[i+5];
+        switch (id) {
+            case S_INITIAL_WINDOW_SIZE:
+                if (value > H2_MAX_WINDOW)
+                    return E_FLOW_CONTROL;
+                delta = (int64_t)value - conn->initial_window;
+                conn->initial_window = value;
+                for (j=0; j<H2_MAX_STREAMS; j++) {
+                    if (!conn->streams[j].id)
+                        continue;
+                    conn->streams[j].window += delta;
+                    if (conn->streams[j].window > H2_MAX_WINDOW)
+                        return E_FLOW_CONTROL;
+                }
+                break;
+
+            case S_MAX_FRAME_SIZE:
+                if (value < H2_MAX_FRAME || value > 0xffffff)
+                    return E_PROTOCOL;
+                /*we never send frames above our own buffer size*/
+                conn->max_frame = H2_MAX_FRAME;
+                break;
+
+            default:
+                break; //the encoder does not index, table size is moot
+        }
+    }
+    return E_NO_ERROR;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * HEADERS and CONTINUATION: strips padding and priority, and collects the
+ * header block until END_HEADERS
+ */
+static int h2_handle_headers(h2_conn* conn, h2_frame* frame,
+                             unsigned char* payload){
+    uint32_t pad = 0, skip = 0;
+    unsigned char* grown;
+
+    if (frame->stream == 0)
+        return E_PROTOCOL;
+
+    if (frame->type == F_HEADERS){
+        if (frame->flags & FL_PADDED){
+            if (frame->length < 1)
+                return E_FRAME_SIZE;
+            pad = payload[0];
+            skip = 1;
+        }
+        if (frame->flags & FL_PRIORITY)
+            skip += 5;
+        if (skip + pad > frame->length)
+            return E_PROTOCOL;
+        if (frame->flags & FL_END_HEADERS)
+            return h2_end_header_block(conn, frame->stream, payload+skip,
+                                       frame->length-skip-pad);
+
+        conn->block = (unsigned char*)malloc(frame->length-skip-pad+1);
+        if (!conn->block)
+            return E_INTERNAL;
+        memcpy(conn->block, payload+skip, frame->length-skip-pad);
+        conn->block_len = frame->length-skip-pad;
+        conn->block_stream = frame->stream;
+        return E_NO_ERROR;
+    }
+
+    /*CONTINUATION*/
+    if (!conn->block || conn->block_stream != frame->stream)
+        return E_PROTOCOL;
+    if (conn->block_len + frame->length > H2_MAX_HEADER_BLOCK)
+        return E_INTERNAL;
+    grown = (unsigned char*)realloc(conn->block,
+                                    conn->block_len+frame->length+1);
+    if (!grown)
+        return E_INTERNAL;
+    conn->block = grown;
+    memcpy(conn->block+conn->block_len, payload, frame->length);
+    conn->block_len += frame->length;
+    if (!(frame->flags & FL_END_HEADERS))
+        return E_NO_ERROR;
+
+    int error = h2_end_header_block(conn, conn->block_stream, conn->block,
+                                    conn->block_len);
+    free(conn->block);
+    conn->block = NULL;
+    conn->block_len = 0;
+    return error;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * a complete header block: decoded even for streams that are ignored, to
+ * keep the HPACK state in sync, and starts a stream if it is a new one
+ */
+static int h2_end_header_block(h2_conn* conn, uint32_t stream_id,
+                               const unsigned char* block, size_t len){
+    h2_headers* headers = (h2_headers*)malloc(sizeof(h2_headers));
+    int error = E_NO_ERROR;
+    if (!headers)
+        return E_INTERNAL;
+    headers->method = NULL;
+    headers->path = NULL;
+    headers->lines[0] = '\0';
+    headers->lines_len = 0;
+
+    if (hpack_decode_block(&conn->decoder, block, len, headers) == FAILURE)
+        error = E_COMPRESSION;
+    else if (stream_id % 2 == 0)
+        error = E_PROTOCOL;
+    else if (stream_id > conn->last_stream){
+        conn->last_stream = stream_id;
+        if (!headers->method || !headers->path)
+            h2_send_u32(conn, F_RST_STREAM, stream_id, E_PROTOCOL);
+        else
+            h2_start_stream(conn, stream_id, headers->method, headers->path,
+                            headers->lines);
+    }
+    /*else trailers of a known stream, or a stale stream - ignored*/
+
+    free(headers->method);
+    free(headers->path);
+    free(headers);
+    return error;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * request bodies are not used, the data is dropped and the window handed
+ * back to the client right away
+ */
+static int h2_handle_data(h2_conn* conn, h2_frame* frame){
+    if (frame->stream == 0)
+        return E_PROTOCOL;
+    if (frame->length == 0)
+        return E_NO_ERROR;
+
+    if (!(frame->flags & FL_END_STREAM) &&
+        h2_send_u32(conn, F_WINDOW_UPDATE, frame->stream, frame->length)
+                                                                == FAILURE)
+        return E_INTERNAL;
+    conn->recv_unacked += frame->length;
+    if (conn->recv_unacked >= H2_WINDOW_THRESHOLD){
+        if (h2_send_u32(conn, F_WINDOW_UPDATE, 0,
+                        (uint32_t)conn->recv_unacked) == FAILURE)
+            return E_INTERNAL;
+        conn->recv_unacked = 0;
+    }
+    return E_NO_ERROR;
+}
+
+//----------------------------------------------------------------------------//
+static int h2_handle_window_update(h2_conn* conn, h2_frame* frame,
+                                   unsigned char* payload){
+    uint32_t increment;
+    h2_stream* stream;
+
+    if (frame->length != 4)
+        return E_FRAME_SIZE;
+    increment = (((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16) |
+                 ((uint32_t)payload[2] << 8) | payload[3]) & 0x7fffffff;
+
+    if (frame->stream == 0){
+        if (increment == 0)
+            return E_PROTOCOL;
+        conn->window += increment;
+        return conn->window > H2_MAX_WINDOW ? E_FLOW_CONTROL : E_NO_ERROR;
+    }
+
+    stream = h2_find_stream(conn, frame->stream);
+    if (!stream)
+        return E_NO_ERROR; //already finished
+    stream->window += increment;
+    if (increment == 0 || stream->window > H2_MAX_WINDOW){
+        h2_send_u32(conn, F_RST_STREAM, stream->id,
+                    increment ? E_FLOW_CONTROL : E_PROTOCOL);
+        h2_release_stream(conn, stream);
+    }
+    return E_NO_ERROR;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------STREAMS-------------------------------------//
+//----------------------------------------------------------------------------//
+static h2_stream* h2_find_stream(h2_conn* conn, uint32_t id){
+    int i;
+    for (i=0; i<H2_MAX_STREAMS; i++)
+        if (conn->streams[i].id == id)
+            return &conn->streams[i];
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * asks the server for the response and sends its headers, the body is
+ * left to the round robin scheduler
+ */
+static int h2_start_stream(h2_conn* conn, uint32_t id, const char* method,
+                           const char* path, const char* headers){
+    h2_stream* stream;
+    int verdict;
+    if (conn->num_streams == H2_MAX_STREAMS)
+        return h2_send_u32(conn, F_RST_STREAM, id, E_REFUSED_STREAM);
+
+    stream = h2_find_stream(conn, 0);
+    memset(stream, 0, sizeof(h2_stream));
+    stream->resp.file_fd = -1;
+    verdict = conn->cb->request(conn->cb->ctx, method, path, headers,
+                                &stream->resp);
+    if (verdict == H2_REFUSED)
+        return h2_send_u32(conn, F_RST_STREAM, id, E_REFUSED_STREAM);
+    if (verdict == FAILURE)
+        return h2_send_u32(conn, F_RST_STREAM, id, E_INTERNAL);
+
+    stream->id = id;
+    stream->window = conn->initial_window;
+    conn->num_streams++;
+
+    if (h2_send_headers(conn, stream) == FAILURE)
+        return FAILURE;
+    if (stream->resp.body_len == 0)
+        h2_release_stream(conn, stream);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static int h2_send_headers(h2_conn* conn, h2_stream* stream){
+    unsigned char block[H2_RESP_HEADERS];
+    char status[4];
+    size_t len = 0, offset = 0, chunk;
+    uint8_t type = F_HEADERS, flags;
+    int i;
+
+    snprintf(status, sizeof(status), "%d", stream->resp.status);
+    if (hpack_encode(block, sizeof(block), &len, ":status", status)==FAILURE)
+        return FAILURE;
+    for (i=0; i<stream->resp.num_headers; i++)
+        if (hpack_encode(block, sizeof(block), &len, stream->resp.names[i],
+                         stream->resp.values[i]) == FAILURE)
+            return FAILURE;
+
+    do {
+        chunk = len-offset > conn->max_frame ? conn->max_frame : len-offset;
+        flags = 0;
+        if (offset+chunk == len)
+            flags |= FL_END_HEADERS;
+        if (type == F_HEADERS && stream->resp.body_len == 0)
+            flags |= FL_END_STREAM;
+        if (h2_send_frame(conn, type, flags, stream->id, block+offset,
+                          (uint32_t)chunk) == FAILURE)
+            return FAILURE;
+        stream->resp.bytes_sent += H2_FRAME_HEADER+chunk;
+        offset += chunk;
+        type = F_CONTINUATION;
+    } while (offset < len);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static int h2_data_pending(h2_conn* conn){
+    int i;
+    if (conn->window <= 0)
+        return FALSE;
+    for (i=0; i<H2_MAX_STREAMS; i++)
+        if (conn->streams[i].id && conn->streams[i].window > 0 &&
+            (unsigned long)conn->streams[i].offset <
+                                        conn->streams[i].resp.body_len)
+            return TRUE;
+    return FALSE;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * one DATA frame for every stream that has both data and window, starting
+ * after the stream served last. file bodies go through sendfile so they
+ * stay zero copy.
+ */
+static int h2_send_data_round(h2_conn* conn){
+    unsigned char header[H2_FRAME_HEADER];
+    int i, index;
+    int64_t chunk;
+    off_t done;
+    ssize_t rc;
+    uint8_t flags;
+    h2_stream* stream;
+
+    for (i=0; i<H2_MAX_STREAMS && conn->window > 0; i++) {
+        index = (conn->next_stream+i) % H2_MAX_STREAMS;
+        stream = &conn->streams[index];
+        if (!stream->id || stream->window <= 0 ||
+            (unsigned long)stream->offset >= stream->resp.body_len)
+            continue;
+
+        chunk = stream->resp.body_len - stream->offset;
+        if (chunk > conn->max_frame)
+            chunk = conn->max_frame;
+        if (chunk > stream->window)
+            chunk = stream->window;
+        if (chunk > conn->window)
+            chunk = conn->window;
+        flags = (unsigned long)(stream->offset+chunk) ==
+                                stream->resp.body_len ? FL_END_STREAM : 0;
+
+        if (stream->resp.body){
+            if (h2_send_frame(conn, F_DATA, flags, stream->id,
+                              stream->resp.body+stream->offset,
+                              (uint32_t)chunk) == FAILURE)
+                return FAILURE;
+            stream->offset += chunk;
+        } else {
+            h2_put_frame_header(header, (uint32_t)chunk, F_DATA, flags,
+                                stream->id);
+            if (h2_write_all(conn, header, H2_FRAME_HEADER) == FAILURE)
+                return FAILURE;
+            done = 0;
+            while (done < chunk) {
+                rc = conn->cb->sendfile(conn->cb->ctx, stream->resp.file_fd,
+                                        &stream->offset, chunk-done);
+                if (rc <= 0)
+                    return FAILURE; //frame length was already promised
+                done += rc;
+            }
+        }
+        stream->window -= chunk;
+        conn->window -= chunk;
+        stream->resp.bytes_sent += H2_FRAME_HEADER+chunk;
+        conn->next_stream = index+1;
+        if (flags & FL_END_STREAM)
+            h2_release_stream(conn, stream);
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static void h2_release_stream(h2_conn* conn, h2_stream* stream){
+    conn->cb->release(conn->cb->ctx, &stream->resp);
+    stream->id = 0;
+    conn->num_streams--;
+}
+
+//----------------------------------------------------------------------------//
+//---------------------------------HPACK--------------------------------------//
+//----------------------------------------------------------------------------//
+static int hpack_decode_block(hpack_table* table, const unsigned char* p,
+                              size_t len, h2_headers* out){
+    const unsigned char* end = p+len;
+    const char *name, *value;
+    char *lit_name, *lit_value;
+    uint32_t index;
+    int indexing, rc, seen_field = FALSE;
+
+    while (p < end) {
+        if (*p & 0x80){                         //indexed field
+            if (hpack_decode_int(&p, end, 7, &index) == FAILURE ||
+                hpack_lookup(table, index, &name, &value) == FAILURE)
+                return FAILURE;
+            if (h2_add_header(out, name, value) == FAILURE)
+                return FAILURE;
+            seen_field = TRUE;
+            continue;
+        }
+        if ((*p & 0xe0) == 0x20){               //dynamic table size update
+            if (seen_field ||
+                hpack_decode_int(&p, end, 5, &index) == FAILURE ||
+                index > H2_HEADER_TABLE)
+                return FAILURE;
+            table->max_size = index;
+            hpack_evict(table, table->max_size);
+            continue;
+        }
+
+        /*literal, with incremental indexing (6 bit prefix) or without /
+         *never indexed (4 bit prefix)*/
+        indexing = (*p & 0xc0) == 0x40;
+        if (hpack_decode_int(&p, end, indexing ? 6 : 4, &index) == FAILURE)
+            return FAILURE;
+        lit_name = NULL;
+        if (index){
+            if (hpack_lookup(table, index, &name, &value) == FAILURE)
+                return FAILURE;
+        } else {
+            lit_name = hpack_decode_string(&p, end);
+            if (!lit_name)
+                return FAILURE;
+            name = lit_name;
+        }
+        lit_value = hpack_decode_string(&p, end);
+        if (!lit_value){
+            free(lit_name);
+            return FAILURE;
+        }
+        rc = h2_add_header(out, name, lit_value);
+        if (indexing)
+            hpack_add(table, name, lit_value);
+        free(lit_name);
+        free(lit_value);
+        if (rc == FAILURE)
+            return FAILURE;
+        seen_field = TRUE;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static int hpack_decode_int(const unsigned char** p, const unsigned char* end,
+                            int prefix, uint32_t* value){
+    uint32_t max = (1u << prefix) - 1;
+    uint32_t result;
+    int shift = 0;
+
+    if (*p >= end)
+        return FAILURE;
+    result = **p & max;
+    (*p)++;
+    if (result < max){
+        *value = result;
+        return SUCCESS;
+    }
+    while (*p < end) {
+        unsigned char b = **p;
+        (*p)++;
+        if (shift > 21)
+            return FAILURE; //more than 28 bits is not a sane header
+        result += (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80)){
+            *value = result;
+            return SUCCESS;
+        }
+    }
+    return FAILURE;
+}
+
+//----------------------------------------------------------------------------//
+static char* hpack_decode_string(const unsigned char** p,
+                                 const unsigned char* end){
+    uint32_t len;
+    int huffman;
+    char* str;
+
+    if (*p >= end)
+        return NULL;
+    huffman = **p & 0x80;
+    if (hpack_decode_int(p, end, 7, &len) == FAILURE ||
+        len > (uint32_t)(end - *p))
+        return NULL;
+
+    if (huffman)
+        str = huff_decode(*p, len);
+    else {
+        str = (char*)malloc(len+1);
+        if (str){
+            memcpy(str, *p, len);
+            str[len] = '\0';
+        }
+    }
+    *p += len;
+    return str;
+}
+
+//----------------------------------------------------------------------------//
+static int hpack_lookup(hpack_table* table, uint32_t index,
+                        const char** name, const char** value){
+    hpack_entry* entry;
+    if (index == 0)
+        return FAILURE;
+    if (index <= H2_STATIC_ENTRIES){
+        *name = static_table[index-1][0];
+        *value = static_table[index-1][1];
+        return SUCCESS;
+    }
+    index -= H2_STATIC_ENTRIES+1;
+    if (index >= (uint32_t)table->count)
+        return FAILURE;
+    entry = &table->entries[(table->head+index) % H2_TABLE_SLOTS];
+    *name = entry->name;
+    *value = entry->value;
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static void hpack_add(hpack_table* table, const char* name, const char* value){
+    size_t size = strlen(name)+strlen(value)+H2_ENTRY_OVERHEAD;
+    hpack_entry* entry;
+
+    if (size > table->max_size){
+        hpack_evict(table, 0); //too big entry empties the table
+        return;
+    }
+    hpack_evict(table, table->max_size-size);
+    if (table->count == H2_TABLE_SLOTS)
+        hpack_evict(table, table->size-1);
+
+    table->head = (table->head+H2_TABLE_SLOTS-1) % H2_TABLE_SLOTS;
+    entry = &table->entries[table->head];
+    entry->name = strdup(name);
+    entry->value = strdup(value);
+    if (!entry->name || !entry->value){
+        free(entry->name);
+        free(entry->value);
+        table->head = (table->head+1) % H2_TABLE_SLOTS;
+        return;
+    }
+    entry->size = size;
+    table->size += size;
+    table->count++;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * drops the oldest entries until the table fits in max_size
+ */
+static void hpack_evict(hpack_table* table, size_t max_size){
+    hpack_entry* entry;
+    while (table->count && table->size > max_size) {
+        entry = &table->entries[(table->head+table->count-1)%H2_TABLE_SLOTS];
+        table->size -= entry->size;
+        free(entry->name);
+        free(entry->value);
+        table->count--;
+    }
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * literal field without indexing and without huffman coding, the name
+ * is taken from the static table when it is there
+ */
+static int hpack_encode(unsigned char* buf, size_t cap, size_t* pos,
+                        const char* name, const char* value){
+    size_t name_len = strlen(name), value_len = strlen(value);
+    size_t i, len;
+    uint32_t name_index = 0, index;
+    const char* str;
+    int k;
+
+    for (i=0; i<H2_STATIC_ENTRIES; i++)
+        if (strcmp(static_table[i][0], name) == 0){
+            name_index = (uint32_t)i+1;
+            break;
+        }
+    if (*pos + name_len + value_len + 16 > cap)
+        return FAILURE;
+
+    /*4 bit prefix index, 0 means a literal name follows*/
+    index = name_index;
+    if (index < 15)
+        buf[(*pos)++] = (unsigned char)index;
+    else {
+        buf[(*pos)++] = 0x0f;
+        index -= 15;
+        while (index >= 0x80) {
+            buf[(*pos)++] = (unsigned char)((index & 0x7f) | 0x80);
+            index >>= 7;
+        }
+        buf[(*pos)++] = (unsigned char)index;
+    }
+
+    for (k = name_index ? 1 : 0; k<2; k++) {
+        str = k == 0 ? name : value;
+        len = k == 0 ? name_len : value_len;
+        if (len < 0x7f)
+            buf[(*pos)++] = (unsigned char)len;
+        else {
+            buf[(*pos)++] = 0x7f;
+            len -= 0x7f;
+            while (len >= 0x80) {
+                buf[(*pos)++] = (unsigned char)((len & 0x7f) | 0x80);
+                len >>= 7;
+            }
+            buf[(*pos)++] = (unsigned char)len;
+            len = k == 0 ? name_len : value_len;
+        }
+        memcpy(buf+*pos, str, len);
+        *pos += len;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * builds the decoding tree out of the code table. children are node
+ * indexes, leaves are stored as -(symbol+1), 0 is a missing child.
+ */
+static void huff_build(void){
+    int sym, bit, node, next = 1;
+    for (sym=0; sym<=256; sym++) {
+        node = 0;
+        for (bit = huff_lengths[sym]-1; bit >= 0; bit--) {
+            int b = (huff_codes[sym] >> bit) & 1;
+            if (bit == 0)
+                huff_tree[node][b] = (short)-(sym+1);
+            else {
+                if (huff_tree[node][b] == 0)
+                    huff_tree[node][b] = (short)next++;
+                node = huff_tree[node][b];
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------//
+static char* huff_decode(const unsigned char* p, size_t len){
+    /*the shortest code is 5 bits, so the output is at most 8/5 longer*/
+    char* out = (char*)malloc(len*8/5+2);
+    size_t i, out_len = 0;
+    int bit, node = 0, pad_bits = 0, pad_ones = TRUE;
+    short next;
+
+    if (!out)
+        return NULL;
+    for (i=0; i<len; i++) {
+        for (bit=7; bit>=0; bit--) {
+            int b = (p[i] >> bit) & 1;
+            next = huff_tree[node][b];
+            pad_bits++;
+            pad_ones = pad_ones && b;
+            if (next < 0){
+                if (next == -257){ //EOS inside a string is an error
+                    free(out);
+                    return NULL;
+                }
+                out[out_len++] = (char)(-next-1);
+                node = 0;
+                pad_bits = 0;
+                pad_ones = TRUE;
+            } else if (next == 0){
+                free(out);
+                return NULL;
+            } else
+                node = next;
+        }
+    }
+    /*padding is the most significant bits of EOS, at most 7 ones*/
+    if (node != 0 && (pad_bits > 7 || !pad_ones)){
+        free(out);
+        return NULL;
+    }
+    out[out_len] = '\0';
+    return out;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * keeps :method and :path aside, turns :authority into host and appends
+ * regular headers as "name: value\r\n" lines
+ */
+static int h2_add_header(h2_headers* out, const char* name, const char* value){
+    size_t len;
+    if (name[0] == ':'){
+        if (strcmp(name, ":method") == 0 && !out->method)
+            out->method = strdup(value);
+        else if (strcmp(name, ":path") == 0 && !out->path)
+            out->path = strdup(value);
+        else if (strcmp(name, ":authority") == 0)
+            return h2_add_header(out, "host", value);
+        return SUCCESS;
+    }
+    len = strlen(name)+strlen(value)+4;
+    if (out->lines_len + len + 1 > H2_MAX_HEADER_LINES)
+        return SUCCESS; //oversized headers are dropped, not fatal
+    out->lines_len += snprintf(out->lines+out->lines_len,
+                               H2_MAX_HEADER_LINES-out->lines_len,
+                               "%s: %s\r\n", name, value);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * decodes the HTTP2-Settings header, base64url without padding.
+ * returns the decoded length or -1.
+ */
+static int base64url_decode(const char* in, unsigned char* out, size_t cap){
+    uint32_t acc = 0;
+    int bits = 0, len = 0, v;
+    for (; *in && *in != '='; in++) {
+        char c = *in;
+        if (c >= 'A' && c <= 'Z') v = c-'A';
+        else if (c >= 'a' && c <= 'z') v = c-'a'+26;
+        else if (c >= '0' && c <= '9') v = c-'0'+52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else return -1;
+        acc = (acc << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8){
+            bits -= 8;
+            if ((size_t)len == cap)
+                return -1;
+            out[len++] = (unsigned char)((acc >> bits) & 0xff);
+        }
+    }
+    return len;
+}
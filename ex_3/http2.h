@@ -0,0 +1,85 @@
+//
+//  http2.h
+//  ex_3
+//
+
+#ifndef http2_h
+#define http2_h
+
+#include <sys/types.h>
+#include <stdint.h>
+
+// concurrent streams a client may open on one connection
+#define H2_MAX_STREAMS 100
+// response headers besides :status
+#define H2_MAX_RESP_HEADERS 8
+// size of the client connection preface
+#define H2_PREFACE_LEN 24
+
+// how the connection reached h2_serve()
+#define H2_PRIOR_KNOWLEDGE 0  //"PRI * HTTP/2.0\r\n\r\n" already consumed
+#define H2_DIRECT 1           //full preface follows (ALPN "h2")
+#define H2_UPGRADE 2          //101 sent, stream 1 is the upgraded request
+
+// request() verdict besides 0 and -1: refused, the client may retry it
+#define H2_REFUSED 1
+
+
+/**
+ * response of a single stream, filled by the request callback
+ */
+typedef struct _h2_response {
+    int status;
+    int num_headers;
+    const char* names[H2_MAX_RESP_HEADERS];     //lower case names
+    const char* values[H2_MAX_RESP_HEADERS];
+    const unsigned char* body;  //in memory body, NULL when sending a file
+    int file_fd;                //file body, -1 if none
+    unsigned long body_len;
+    unsigned long bytes_sent;   //frame bytes written, set by the connection
+    void* opaque;               //owned by the callbacks
+} h2_response;
+
+
+/**
+ * what a connection needs from the server: transport and responses.
+ * request() is called once per stream with the header block converted
+ * to HTTP/1 "name: value\r\n" lines, release() once the stream is done
+ * or reset. a request() that fails or returns H2_REFUSED is reset without
+ * release().
+ */
+typedef struct _h2_callbacks {
+    void* ctx;
+    ssize_t (*read)(void* ctx, void* buf, size_t len);
+    ssize_t (*write)(void* ctx, const void* buf, size_t len);
+    ssize_t (*sendfile)(void* ctx, int file_fd, off_t* offset, size_t count);
+    int (*readable)(void* ctx);     //TRUE if a read will not block
+    int (*request)(void* ctx, const char* method, const char* path,
+                   const char* headers, h2_response* resp);
+    void (*release)(void* ctx, h2_response* resp);
+} h2_callbacks;
+
+
+/**
+ * connection start up parameters
+ */
+typedef struct _h2_start {
+    int mode;
+    const unsigned char* preread;   //bytes already read past the request
+    size_t preread_len;
+    const char* settings;           //H2_UPGRADE: HTTP2-Settings header value
+    const char* method;             //H2_UPGRADE: request of stream 1
+    const char* path;
+    const char* headers;
+} h2_start;
+
+
+/**
+ * h2_serve runs an HTTP/2 connection until the client goes away, sends
+ * GOAWAY or an error occurs. stream bodies are sent round robin, one
+ * frame per stream at a time, within the flow control windows.
+ * returns 0 on a clean close, -1 on a connection error.
+ */
+int h2_serve(h2_callbacks* cb, const h2_start* start);
+
+#endif /* http2_h */
@@ -0,0 +1,15 @@
+//
+//  mime.h
+//  ex_3
+//
+
+#ifndef mime_h
+#define mime_h
+
+/**
+ * get_mime_type returns the Content-Type matching the extension of name,
+ * NULL if the extension is unknown.
+ */
+char *get_mime_type(char *name);
+
+#endif /* mime_h */
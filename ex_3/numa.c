@@ -0,0 +1,185 @@
+//
+//  numa.c
+//  ex_3
+//
+
+#include "numa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+#define ONLINE_CPUS "/sys/devices/system/cpu/online"
+#define CPULIST_SIZE 4096
+#define SUCCESS 0
+#define FAILURE -1
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static int read_cpulist(const char* path, int** cpus, int* num_cpus);
+static int add_node(numa_topology* topology, int* cpus, int num_cpus);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+numa_topology* load_numa_topology(void){
+    numa_topology* topology;
+    int *cpus, num_cpus, i, cpu, node;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+    char path[256];
+    struct dirent **namelist;
+    int num_entries;
+#endif
+
+    topology = (numa_topology*)calloc(1, sizeof(numa_topology));
+    if (!topology)
+        return NULL;
+
+#ifdef __linux__
+    num_entries = scandir(NODE_DIR, &namelist, NULL, alphasort);
+    for (i=0; i<num_entries; i++) {
+        if (strncmp(namelist[i]->d_name, "node", 4) == 0 &&
+            sscanf(namelist[i]->d_name+4, "%d", &node) == 1){
+            snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+            /*memory only nodes have no CPUs and no workers*/
+            if (read_cpulist(path, &cpus, &num_cpus) == SUCCESS &&
+                (num_cpus == 0 ||
+                 add_node(topology, cpus, num_cpus) == FAILURE))
+                free(cpus);
+        }
+        free(namelist[i]);
+    }
+    if (num_entries >= 0)
+        free(namelist);
+#endif
+
+    if (topology->num_nodes == 0){
+        /*one node of every online CPU*/
+        if (read_cpulist(ONLINE_CPUS, &cpus, &num_cpus) == FAILURE ||
+            num_cpus == 0){
+            free(cpus);
+            if (online < 1)
+                online = 1;
+            cpus = (int*)malloc(online*sizeof(int));
+            if (!cpus){
+                destroy_numa_topology(topology);
+                return NULL;
+            }
+            for (i=0; i<online; i++)
+                cpus[i] = i;
+            num_cpus = (int)online;
+        }
+        if (add_node(topology, cpus, num_cpus) == FAILURE){
+            free(cpus);
+            destroy_numa_topology(topology);
+            return NULL;
+        }
+    }
+
+    topology->node_of_cpu = (int*)malloc(topology->num_cpus*sizeof(int));
+    if (!topology->node_of_cpu){
+        destroy_numa_topology(topology);
+        return NULL;
+    }
+    memset(topology->node_of_cpu, -1, topology->num_cpus*sizeof(int));
+    for (node=0; node<topology->num_nodes; node++)
+        for (i=0; i<topology->node_num_cpus[node]; i++) {
+            cpu = topology->node_cpus[node][i];
+            topology->node_of_cpu[cpu] = node;
+        }
+    return topology;
+}
+
+//----------------------------------------------------------------------------//
+int numa_node_of_cpu(numa_topology* topology, int cpu){
+    if (cpu < 0 || cpu >= topology->num_cpus ||
+        topology->node_of_cpu[cpu] == -1)
+        return 0;
+    return topology->node_of_cpu[cpu];
+}
+
+//----------------------------------------------------------------------------//
+void destroy_numa_topology(numa_topology* topology){
+    int i;
+    if (!topology)
+        return;
+    for (i=0; i<topology->num_nodes; i++)
+        free(topology->node_cpus[i]);
+    free(topology->node_cpus);
+    free(topology->node_num_cpus);
+    free(topology->node_of_cpu);
+    free(topology);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * parses a list such as "0-3,8,10-11" into an allocated array
+ */
+static int read_cpulist(const char* path, int** cpus, int* num_cpus){
+    char list[CPULIST_SIZE];
+    char *range, *saveptr;
+    int first, last, cpu, count = 0, capacity = 0;
+    int* result = NULL, *grown;
+    FILE* file = fopen(path, "r");
+
+    *cpus = NULL;
+    *num_cpus = 0;
+    if (!file)
+        return FAILURE;
+    if (!fgets(list, sizeof(list), file))
+        list[0] = '\0';
+    fclose(file);
+
+    for (range = strtok_r(list, ",\n", &saveptr); range;
+         range = strtok_r(NULL, ",\n", &saveptr)) {
+        if (sscanf(range, "%d-%d", &first, &last) != 2){
+            if (sscanf(range, "%d", &first) != 1)
+                continue;
+            last = first;
+        }
+        for (cpu=first; cpu<=last; cpu++) {
+            if (count == capacity){
+                capacity = capacity ? capacity*2 : 16;
+                grown = (int*)realloc(result, capacity*sizeof(int));
+                if (!grown){
+                    free(result);
+                    return FAILURE;
+                }
+                result = grown;
+            }
+            result[count++] = cpu;
+        }
+    }
+    *cpus = result;
+    *num_cpus = count;
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static int add_node(numa_topology* topology, int* cpus, int num_cpus){
+    int** node_cpus;
+    int* node_num_cpus;
+    int i;
+
+    node_cpus = (int**)realloc(topology->node_cpus,
+                               (topology->num_nodes+1)*sizeof(int*));
+    if (!node_cpus)
+        return FAILURE;
+    topology->node_cpus = node_cpus;
+    node_num_cpus = (int*)realloc(topology->node_num_cpus,
+                                  (topology->num_nodes+1)*sizeof(int));
+    if (!node_num_cpus)
+        return FAILURE;
+    topology->node_num_cpus = node_num_cpus;
+
+    topology->node_cpus[topology->num_nodes] = cpus;
+    topology->node_num_cpus[topology->num_nodes] = num_cpus;
+    topology->num_nodes++;
+    for (i=0; i<num_cpus; i++)
+        if (cpus[i]+1 > topology->num_cpus)
+            topology->num_cpus = cpus[i]+1;
+    return SUCCESS;
+}
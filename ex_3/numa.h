@@ -0,0 +1,39 @@
+//
+//  numa.h
+//  ex_3
+//
+
+#ifndef numa_h
+#define numa_h
+
+/**
+ * CPUs of every NUMA node, as listed under /sys/devices/system/node.
+ * nodes are numbered densely from 0, whatever their ids in /sys are.
+ */
+typedef struct _numa_topology {
+    int num_nodes;
+    int num_cpus;           //entries in node_of_cpu
+    int* node_of_cpu;       //-1 for CPUs that are offline
+    int** node_cpus;        //CPUs of every node
+    int* node_num_cpus;
+} numa_topology;
+
+
+/**
+ * load_numa_topology reads the NUMA layout of the machine. where it is
+ * not available (not Linux, no /sys) all online CPUs form one node.
+ * returns NULL on allocation failure.
+ */
+numa_topology* load_numa_topology(void);
+
+/**
+ * numa_node_of_cpu returns the node of cpu, 0 if it is not known
+ */
+int numa_node_of_cpu(numa_topology* topology, int cpu);
+
+/**
+ * destroy_numa_topology frees the topology
+ */
+void destroy_numa_topology(numa_topology* topology);
+
+#endif /* numa_h */
@@ -0,0 +1,208 @@
+//
+//  prefork.c
+//  ex_3
+//
+
+#include "prefork.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+
+/**
+ * a worker slot of the master
+ */
+typedef struct _pf_worker {
+    pid_t pid;          //0 - not running
+    time_t started;
+} pf_worker;
+
+static volatile sig_atomic_t pending_signal = 0;
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static pid_t start_worker(pf_worker* worker, const sigset_t* mask);
+static void forward_signal(pf_worker* workers, int num_workers, int signum);
+static void on_signal(int signum);
+static void set_handlers(void (*handler)(int));
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+int pf_run(int num_workers, int* status, pf_upgrade_fn upgrade, void* ctx){
+    pf_worker* workers = (pf_worker*)calloc(num_workers, sizeof(pf_worker));
+    int i, wstatus, running = 0, stopping = FALSE;
+    sigset_t handled, mask;
+    pid_t pid;
+
+    *status = EXIT_SUCCESS;
+    if (!workers){
+        *status = EXIT_FAILURE;
+        return FAILURE;
+    }
+    /*signals only arrive in sigsuspend(), none is lost in between*/
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGHUP);
+    sigaddset(&handled, SIGUSR1);
+    sigaddset(&handled, SIGUSR2);
+    sigaddset(&handled, SIGQUIT);
+    sigaddset(&handled, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &handled, &mask);
+    set_handlers(on_signal);
+    for (i=0; i<num_workers && !stopping; i++) {
+        pid = start_worker(&workers[i], &mask);
+        if (pid == 0){
+            free(workers);
+            return i;
+        }
+        if (pid == -1){
+            *status = EXIT_FAILURE;
+            stopping = TRUE;
+            forward_signal(workers, num_workers, SIGTERM);
+        } else
+            running++;
+    }
+
+    while (running > 0) {
+        if (pending_signal){
+            if (pending_signal == SIGUSR2){
+                /*the new server shares the socket, the old workers drain*/
+                if (!stopping && upgrade && upgrade(ctx) == SUCCESS){
+                    stopping = TRUE;
+                    forward_signal(workers, num_workers, SIGQUIT);
+                }
+            } else {
+                if (pending_signal == SIGTERM || pending_signal == SIGINT ||
+                    pending_signal == SIGQUIT)
+                    stopping = TRUE;
+                forward_signal(workers, num_workers, pending_signal);
+            }
+            pending_signal = 0;
+        }
+        pid = waitpid(-1, &wstatus, WNOHANG);
+        if (pid == 0){
+            sigsuspend(&mask);
+            continue;
+        }
+        if (pid == -1)
+            break;
+        for (i=0; i<num_workers && workers[i].pid != pid; i++);
+        if (i == num_workers)
+            continue;
+        workers[i].pid = 0;
+        running--;
+        if (stopping || (WIFEXITED(wstatus) &&
+                         WEXITSTATUS(wstatus) == EXIT_SUCCESS))
+            continue;
+
+        if (WIFEXITED(wstatus) &&
+            time(NULL) - workers[i].started < PF_MIN_UPTIME){
+            fprintf(stderr, "worker %d failed to start, stopping\n", i);
+            *status = EXIT_FAILURE;
+            stopping = TRUE;
+            forward_signal(workers, num_workers, SIGTERM);
+            continue;
+        }
+        if (WIFSIGNALED(wstatus))
+            fprintf(stderr, "worker %d killed by signal %d, restarting\n",
+                    i, WTERMSIG(wstatus));
+        else
+            fprintf(stderr, "worker %d exited with %d, restarting\n",
+                    i, WEXITSTATUS(wstatus));
+        /*a worker crashing as it starts is not restarted in a tight loop*/
+        if (time(NULL) - workers[i].started < PF_MIN_UPTIME)
+            sleep(PF_RESTART_DELAY);
+        pid = start_worker(&workers[i], &mask);
+        if (pid == 0){
+            free(workers);
+            return i;
+        }
+        if (pid != -1)
+            running++;
+    }
+    free(workers);
+    set_handlers(SIG_DFL);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    return FAILURE;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * forks a worker, with the signal mask the master had before pf_run().
+ * returns 0 in the worker, the worker's pid in the master and -1 if the
+ * fork failed.
+ */
+static pid_t start_worker(pf_worker* worker, const sigset_t* mask){
+    pid_t pid = fork();
+    if (pid == -1){
+        perror("Error on fork");
+        return -1;
+    }
+    if (pid == 0){
+        set_handlers(SIG_DFL);
+        /*until the worker sets up its own handling*/
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGUSR2, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_SETMASK, mask, NULL);
+#ifdef __linux__
+        /*a worker does not outlive the master*/
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+            _exit(EXIT_FAILURE);
+#endif
+        return 0;
+    }
+    worker->pid = pid;
+    worker->started = time(NULL);
+    return pid;
+}
+
+//----------------------------------------------------------------------------//
+static void forward_signal(pf_worker* workers, int num_workers, int signum){
+    int i;
+    for (i=0; i<num_workers; i++)
+        if (workers[i].pid)
+            kill(workers[i].pid, signum);
+}
+
+//----------------------------------------------------------------------------//
+static void on_signal(int signum){
+    /*SIGCHLD only wakes sigsuspend()*/
+    if (signum != SIGCHLD)
+        pending_signal = signum;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * SIGCHLD needs a handler for sigsuspend() to return on it
+ */
+static void set_handlers(void (*handler)(int)){
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGQUIT, &action, NULL);
+    sigaction(SIGCHLD, &action, NULL);
+}
@@ -0,0 +1,41 @@
+//
+//  prefork.h
+//  ex_3
+//
+
+#ifndef prefork_h
+#define prefork_h
+
+// seconds a worker must run before exiting with an error counts as a
+// crash rather than a failed start
+#define PF_MIN_UPTIME 2
+// seconds before replacing a worker that crashed right after starting
+#define PF_RESTART_DELAY 1
+
+/**
+ * starts a new server to take over from this one, see pf_run(). returns
+ * 0 once it serves.
+ */
+typedef int (*pf_upgrade_fn)(void* ctx);
+
+
+/**
+ * pf_run forks num_workers workers, which inherit whatever the caller
+ * opened and mapped so far (the listening socket, the shared cache).
+ * it returns in every worker with the worker's number, from 0.
+ *
+ * the master stays inside and supervises. a worker killed by a signal or
+ * exiting with an error is replaced by a new one with the same number, a
+ * worker that exits cleanly is not. a worker failing within PF_MIN_UPTIME
+ * seconds of starting stops the whole server, so a bad setup does not
+ * fork forever. SIGTERM, SIGINT, SIGHUP, SIGUSR1 and SIGQUIT sent to the
+ * master are passed on to the workers, SIGTERM, SIGINT and SIGQUIT stop
+ * it. SIGUSR2 calls upgrade(ctx), if it succeeds the workers are sent
+ * SIGQUIT and the master stops. workers ignore SIGUSR1, SIGUSR2 and
+ * SIGQUIT until they set up their own handling.
+ * returns -1 in the master once every worker is gone, with *status set
+ * to what the master should exit with.
+ */
+int pf_run(int num_workers, int* status, pf_upgrade_fn upgrade, void* ctx);
+
+#endif /* prefork_h */
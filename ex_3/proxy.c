@@ -0,0 +1,676 @@
+//
+//  proxy.c
+//  ex_3
+//
+
+#include "proxy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+#define R_EOL "\r\n"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 //not available on macOS
+#endif
+
+// relay outcomes
+#define RELAY_OK 0          //the whole upstream message was read
+#define RELAY_CLIENT_GONE 1
+#define RELAY_UPSTREAM_ERROR 2
+
+/**
+ * buffered reading from an upstream connection
+ */
+typedef struct _px_reader {
+    int fd;
+    size_t pos;
+    size_t len;
+    int timed_out;
+    unsigned char buf[PX_BUF_SIZE];
+} px_reader;
+
+typedef struct _px_idle {
+    int fd;
+    time_t since;
+} px_idle;
+
+/*every worker has its own idle connections, no locking*/
+static __thread px_idle idle_pool[PX_MAX_ROUTES][PX_IDLE_PER_ROUTE];
+static __thread int idle_count[PX_MAX_ROUTES];
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static int64_t now_ms(void);
+static int connect_upstream(px_route* route);
+static int get_connection(px_route* route, int* reused);
+static void put_connection(px_route* route, int fd);
+static int send_all(int fd, const void* buf, size_t len);
+static int client_send(px_io* io, const void* buf, size_t len,
+                       unsigned long* bytes_sent);
+static const char* find_header(const char* headers, const char* name,
+                               size_t* value_len);
+static int is_hop_by_hop(const char* line, size_t line_len);
+static char* build_upstream_head(px_route* route, const px_request* request);
+static char* build_client_head(const char* head);
+static int read_head(px_reader* r, char* head);
+static ssize_t fill(px_reader* r);
+static int read_line(px_reader* r, char* line, size_t size);
+static int relay_length(px_reader* r, px_io* io, unsigned long long length,
+                        unsigned long* bytes_sent);
+static int relay_chunked(px_reader* r, px_io* io, unsigned long* bytes_sent);
+static int relay_to_close(px_reader* r, px_io* io, unsigned long* bytes_sent);
+static int stream_request_body(int fd, px_io* io, unsigned long long length);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+proxy* create_proxy(void){
+    return (proxy*)calloc(1, sizeof(proxy));
+}
+
+//----------------------------------------------------------------------------//
+int proxy_add_route(proxy* px, const char* spec){
+    const char* upstream = strchr(spec, '=');
+    px_route* route;
+    struct sockaddr_un* sun;
+    struct addrinfo hints, *res;
+    char *host, *port;
+
+    if (!upstream || upstream == spec || spec[0] != '/' ||
+        px->num_routes == PX_MAX_ROUTES)
+        return FAILURE;
+    route = &px->routes[px->num_routes];
+    memset(route, 0, sizeof(px_route));
+    route->prefix = strndup(spec, upstream-spec);
+    route->prefix_len = upstream-spec;
+    route->upstream = strdup(upstream+1);
+    if (!route->prefix || !route->upstream)
+        goto fail;
+
+    if (strncmp(route->upstream, "unix:", 5) == 0){
+        sun = (struct sockaddr_un*)&route->addr;
+        if (strlen(route->upstream+5) >= sizeof(sun->sun_path))
+            goto fail;
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, route->upstream+5);
+        route->addr_len = sizeof(struct sockaddr_un);
+    } else {
+        host = strdup(route->upstream);
+        port = host ? strrchr(host, ':') : NULL;
+        if (!port){
+            free(host);
+            goto fail;
+        }
+        *port++ = '\0';
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, port, &hints, &res) != 0){
+            fprintf(stderr, "Error on proxy route: cannot resolve %s\n",
+                    route->upstream);
+            free(host);
+            goto fail;
+        }
+        memcpy(&route->addr, res->ai_addr, res->ai_addrlen);
+        route->addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+        free(host);
+    }
+    route->index = px->num_routes;
+    atomic_init(&route->down_until_ms, 0);
+    px->num_routes++;
+    return SUCCESS;
+
+fail:
+    free(route->prefix);
+    free(route->upstream);
+    return FAILURE;
+}
+
+//----------------------------------------------------------------------------//
+px_route* proxy_match(proxy* px, const char* target){
+    int i;
+    for (i=0; i<px->num_routes; i++)
+        if (strncmp(target, px->routes[i].prefix,
+                    px->routes[i].prefix_len) == 0)
+            return &px->routes[i];
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+int proxy_forward(px_route* route, px_io* io, const px_request* request,
+                  int* status, unsigned long* bytes_sent){
+    char head[PX_HEAD_SIZE+1];
+    char *upstream_head, *client_head;
+    const char* value;
+    size_t value_len, in_memory;
+    unsigned long long body_len = 0, resp_len = 0;
+    int fd = -1, reused, attempt, rc, minor, keep_alive, has_length;
+    int no_body, chunked;
+    px_reader* r;
+
+    *status = 0;
+    *bytes_sent = 0;
+    if (atomic_load(&route->down_until_ms) > now_ms())
+        return PX_BAD_GATEWAY;
+    if (find_header(request->headers, "Transfer-Encoding", &value_len))
+        return PX_LENGTH_REQUIRED;
+    value = find_header(request->headers, "Content-Length", &value_len);
+    if (value)
+        body_len = strtoull(value, NULL, 10);
+    in_memory = request->body_start_len < body_len ?
+                request->body_start_len : (size_t)body_len;
+
+    r = (px_reader*)malloc(sizeof(px_reader));
+    upstream_head = build_upstream_head(route, request);
+    if (!r || !upstream_head){
+        free(r);
+        free(upstream_head);
+        return PX_BAD_GATEWAY;
+    }
+
+    /*a pooled connection the upstream closed meanwhile fails on first
+     *use, the request is then sent once more on a fresh connection*/
+    for (attempt=0; attempt<2; attempt++) {
+        fd = get_connection(route, &reused);
+        if (fd == -1){
+            atomic_store(&route->down_until_ms, now_ms()+PX_RETRY_AFTER);
+            rc = errno == ETIMEDOUT ? PX_GATEWAY_TIMEOUT : PX_BAD_GATEWAY;
+            free(r);
+            free(upstream_head);
+            return rc;
+        }
+        memset(r, 0, offsetof(px_reader, buf));
+        r->fd = fd;
+        rc = send_all(fd, upstream_head, strlen(upstream_head));
+        if (rc == SUCCESS && in_memory)
+            rc = send_all(fd, request->body_start, in_memory);
+        if (rc == SUCCESS && body_len > in_memory){
+            rc = stream_request_body(fd, io, body_len-in_memory);
+            reused = FALSE; //the body is consumed, no second attempt
+        }
+        if (rc == SUCCESS)
+            rc = read_head(r, head);
+        if (rc == SUCCESS || !reused || r->timed_out)
+            break;
+        close(fd);
+    }
+    free(upstream_head);
+    if (rc == FAILURE){
+        close(fd);
+        rc = r->timed_out ? PX_GATEWAY_TIMEOUT : PX_BAD_GATEWAY;
+        free(r);
+        return rc;
+    }
+    atomic_store(&route->down_until_ms, 0);
+
+    sscanf(head, "HTTP/1.%d %d", &minor, status);
+    value = find_header(strstr(head, R_EOL)+strlen(R_EOL), "Connection",
+                        &value_len);
+    keep_alive = minor == 1 &&
+                 !(value && value_len == 5 && strncasecmp(value, "close", 5) == 0);
+    value = find_header(strstr(head, R_EOL)+strlen(R_EOL), "Transfer-Encoding",
+                        &value_len);
+    chunked = value && value_len >= 7 &&
+              strncasecmp(value+value_len-7, "chunked", 7) == 0;
+    value = find_header(strstr(head, R_EOL)+strlen(R_EOL), "Content-Length",
+                        &value_len);
+    has_length = value != NULL;
+    if (value)
+        resp_len = strtoull(value, NULL, 10);
+    no_body = strcmp(request->method, "HEAD") == 0 || *status == 204 ||
+              *status == 304 || *status/100 == 1;
+
+    client_head = build_client_head(head);
+    if (!client_head){
+        close(fd);
+        free(r);
+        return PX_BAD_GATEWAY;
+    }
+    if (client_send(io, client_head, strlen(client_head), bytes_sent) ==
+                                                                    FAILURE)
+        rc = RELAY_CLIENT_GONE;
+    else if (no_body)
+        rc = RELAY_OK;
+    else if (chunked)
+        rc = relay_chunked(r, io, bytes_sent);
+    else if (has_length)
+        rc = relay_length(r, io, resp_len, bytes_sent);
+    else {
+        rc = relay_to_close(r, io, bytes_sent);
+        keep_alive = FALSE;
+    }
+    free(client_head);
+
+    /*reusable only if the message ended exactly where the buffer did*/
+    if (rc == RELAY_OK && keep_alive && *status != 101 && r->pos == r->len)
+        put_connection(route, fd);
+    else
+        close(fd);
+    free(r);
+    return PX_DONE;
+}
+
+//----------------------------------------------------------------------------//
+void destroy_proxy(proxy* px){
+    int i;
+    if (!px)
+        return;
+    for (i=0; i<px->num_routes; i++) {
+        free(px->routes[i].prefix);
+        free(px->routes[i].upstream);
+    }
+    free(px);
+}
+
+//----------------------------------------------------------------------------//
+static int64_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * non blocking connect bounded by PX_CONNECT_TIMEOUT, the socket is
+ * blocking with PX_IO_TIMEOUT on reads and writes afterwards
+ */
+static int connect_upstream(px_route* route){
+    struct timeval io_timeout = {PX_IO_TIMEOUT, 0};
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int fd, flags, err = 0;
+
+    fd = socket(route->addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int));
+#endif
+    flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, (struct sockaddr*)&route->addr, route->addr_len) == -1){
+        if (errno != EINPROGRESS){
+            close(fd);
+            return -1;
+        }
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, PX_CONNECT_TIMEOUT) != 1){
+            close(fd);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err){
+            close(fd);
+            errno = err ? err : ECONNREFUSED;
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+    return fd;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the newest idle connection of this worker that is still fit, or a new
+ * one. an idle connection with anything to read was closed (or broken)
+ * by the upstream.
+ */
+static int get_connection(px_route* route, int* reused){
+    px_idle* idle;
+    struct pollfd pfd;
+    time_t now = time(NULL);
+
+    while (idle_count[route->index] > 0) {
+        idle = &idle_pool[route->index][--idle_count[route->index]];
+        pfd.fd = idle->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (now - idle->since < PX_IDLE_TIMEOUT && poll(&pfd, 1, 0) == 0){
+            *reused = TRUE;
+            return idle->fd;
+        }
+        close(idle->fd);
+    }
+    *reused = FALSE;
+    return connect_upstream(route);
+}
+
+//----------------------------------------------------------------------------//
+static void put_connection(px_route* route, int fd){
+    px_idle* idle;
+    if (idle_count[route->index] == PX_IDLE_PER_ROUTE){
+        /*the oldest one goes*/
+        close(idle_pool[route->index][0].fd);
+        memmove(&idle_pool[route->index][0], &idle_pool[route->index][1],
+                (PX_IDLE_PER_ROUTE-1)*sizeof(px_idle));
+        idle_count[route->index]--;
+    }
+    idle = &idle_pool[route->index][idle_count[route->index]++];
+    idle->fd = fd;
+    idle->since = time(NULL);
+}
+
+//----------------------------------------------------------------------------//
+static int send_all(int fd, const void* buf, size_t len){
+    const unsigned char* p = (const unsigned char*)buf;
+    ssize_t wc;
+    while (len > 0) {
+        wc = send(fd, p, len, MSG_NOSIGNAL);
+        if (wc == -1){
+            if (errno == EINTR)
+                continue;
+            return FAILURE;
+        }
+        p += wc;
+        len -= wc;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static int client_send(px_io* io, const void* buf, size_t len,
+                       unsigned long* bytes_sent){
+    const unsigned char* p = (const unsigned char*)buf;
+    ssize_t wc;
+    while (len > 0) {
+        wc = io->write(io->ctx, p, len);
+        if (wc <= 0)
+            return FAILURE;
+        p += wc;
+        len -= wc;
+        *bytes_sent += wc;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * value of header name in a block of "name: value\r\n" lines, without
+ * surrounding white space. NULL if it is not there.
+ */
+static const char* find_header(const char* headers, const char* name,
+                               size_t* value_len){
+    size_t name_len = strlen(name), line_len;
+    const char *line = headers, *eol, *value, *end;
+
+    while (line && *line) {
+        eol = strstr(line, R_EOL);
+        line_len = eol ? (size_t)(eol-line) : strlen(line);
+        if (line_len > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0){
+            value = line+name_len+1;
+            end = line+line_len;
+            while (value < end && (*value == ' ' || *value == '\t'))
+                value++;
+            while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+                end--;
+            *value_len = end-value;
+            return value;
+        }
+        line = eol ? eol+strlen(R_EOL) : NULL;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * TRUE for headers that describe a single connection, they are not
+ * passed through in either direction
+ */
+static int is_hop_by_hop(const char* line, size_t line_len){
+    static const char* names[] = {"Connection", "Keep-Alive",
+                                  "Proxy-Connection", "TE", "Trailer",
+                                  "Transfer-Encoding", "Upgrade", "Expect",
+                                  NULL};
+    size_t name_len;
+    int i;
+    for (i=0; names[i]; i++) {
+        name_len = strlen(names[i]);
+        if (line_len > name_len && line[name_len] == ':' &&
+            strncasecmp(line, names[i], name_len) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+//----------------------------------------------------------------------------//
+static char* build_upstream_head(px_route* route, const px_request* request){
+    size_t len, line_len, value_len;
+    const char *line, *eol;
+    char *head, *p;
+    int has_host = find_header(request->headers, "Host", &value_len) != NULL;
+
+    len = strlen(request->method)+strlen(request->target)+
+          strlen(request->headers)+strlen(route->upstream)+
+          strlen(request->client_addr)+128;
+    head = (char*)malloc(len);
+    if (!head)
+        return NULL;
+    p = head + sprintf(head, "%s %s HTTP/1.1" R_EOL, request->method,
+                       request->target);
+    for (line = request->headers; *line; line = eol+strlen(R_EOL)) {
+        eol = strstr(line, R_EOL);
+        if (!eol)
+            break;
+        line_len = eol-line;
+        if (is_hop_by_hop(line, line_len))
+            continue;
+        memcpy(p, line, line_len+strlen(R_EOL));
+        p += line_len+strlen(R_EOL);
+    }
+    if (!has_host)
+        p += sprintf(p, "Host: %s" R_EOL, route->upstream);
+    sprintf(p, "X-Forwarded-For: %s" R_EOL "Connection: keep-alive" R_EOL R_EOL,
+            request->client_addr);
+    return head;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the upstream head as an HTTP/1.1 response on a connection that closes
+ * after it, framing headers of the upstream connection left out
+ */
+static char* build_client_head(const char* head){
+    const char* status = strchr(head, ' ');
+    const char *line, *eol;
+    size_t line_len;
+    char *client_head, *p;
+
+    client_head = (char*)malloc(strlen(head)+64);
+    if (!client_head || !status){
+        free(client_head);
+        return NULL;
+    }
+    eol = strstr(head, R_EOL);
+    p = client_head + sprintf(client_head, "HTTP/1.1%.*s" R_EOL,
+                              (int)(eol-status), status);
+    for (line = eol+strlen(R_EOL); (eol = strstr(line, R_EOL)) && eol != line;
+         line = eol+strlen(R_EOL)) {
+        line_len = eol-line;
+        if (is_hop_by_hop(line, line_len))
+            continue;
+        memcpy(p, line, line_len+strlen(R_EOL));
+        p += line_len+strlen(R_EOL);
+    }
+    strcpy(p, "Connection: close" R_EOL R_EOL);
+    return client_head;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * reads the response head into head, '\0' terminated, the body bytes
+ * read with it stay in the reader. interim 1xx responses are skipped.
+ */
+static int read_head(px_reader* r, char* head){
+    size_t len = 0, i, start;
+    ssize_t rc;
+    char* end;
+    int status;
+
+    while (TRUE) {
+        rc = recv(r->fd, head+len, PX_HEAD_SIZE-len, 0);
+        if (rc <= 0){
+            if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                r->timed_out = TRUE;
+            return FAILURE;
+        }
+        start = len > 3 ? len-3 : 0;
+        len += rc;
+        head[len] = '\0';
+        for (i=start; i+3<len; i++)
+            if (memcmp(head+i, "\r\n\r\n", 4) == 0)
+                break;
+        if (i+3 >= len){
+            if (len == PX_HEAD_SIZE)
+                return FAILURE; //head too large
+            continue;
+        }
+        end = head+i+4;
+        if (strncmp(head, "HTTP/1.", 7) != 0 ||
+            sscanf(head+8, " %d", &status) != 1)
+            return FAILURE;
+        if (status/100 == 1 && status != 101){
+            /*100 Continue and friends, the real response follows*/
+            len -= end-head;
+            memmove(head, end, len);
+            head[len] = '\0';
+            continue;
+        }
+        r->len = len-(end-head);
+        memcpy(r->buf, end, r->len);
+        end[-2] = '\0'; //keeping the last header's "\r\n"
+        return SUCCESS;
+    }
+}
+
+//----------------------------------------------------------------------------//
+static ssize_t fill(px_reader* r){
+    ssize_t rc;
+    r->pos = r->len = 0;
+    rc = recv(r->fd, r->buf, PX_BUF_SIZE, 0);
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        r->timed_out = TRUE;
+    if (rc > 0)
+        r->len = rc;
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+static int read_line(px_reader* r, char* line, size_t size){
+    size_t len = 0;
+    while (TRUE) {
+        if (r->pos == r->len && fill(r) <= 0)
+            return FAILURE;
+        if (r->buf[r->pos] == '\n'){
+            r->pos++;
+            if (len && line[len-1] == '\r')
+                len--;
+            line[len] = '\0';
+            return SUCCESS;
+        }
+        if (len+1 < size)
+            line[len++] = r->buf[r->pos];
+        r->pos++;
+    }
+}
+
+//----------------------------------------------------------------------------//
+static int relay_length(px_reader* r, px_io* io, unsigned long long length,
+                        unsigned long* bytes_sent){
+    size_t n;
+    while (length > 0) {
+        if (r->pos == r->len && fill(r) <= 0)
+            return RELAY_UPSTREAM_ERROR;
+        n = r->len-r->pos < length ? r->len-r->pos : (size_t)length;
+        if (client_send(io, r->buf+r->pos, n, bytes_sent) == FAILURE)
+            return RELAY_CLIENT_GONE;
+        r->pos += n;
+        length -= n;
+    }
+    return RELAY_OK;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * decodes a chunked body on the fly, trailers are dropped
+ */
+static int relay_chunked(px_reader* r, px_io* io, unsigned long* bytes_sent){
+    char line[256];
+    unsigned long long size;
+    char* end;
+    int rc;
+
+    while (TRUE) {
+        if (read_line(r, line, sizeof(line)) == FAILURE)
+            return RELAY_UPSTREAM_ERROR;
+        size = strtoull(line, &end, 16);
+        if (end == line)
+            return RELAY_UPSTREAM_ERROR;
+        if (size == 0){
+            do {
+                if (read_line(r, line, sizeof(line)) == FAILURE)
+                    return RELAY_UPSTREAM_ERROR;
+            } while (line[0] != '\0');
+            return RELAY_OK;
+        }
+        rc = relay_length(r, io, size, bytes_sent);
+        if (rc != RELAY_OK)
+            return rc;
+        if (read_line(r, line, sizeof(line)) == FAILURE || line[0] != '\0')
+            return RELAY_UPSTREAM_ERROR;
+    }
+}
+
+//----------------------------------------------------------------------------//
+static int relay_to_close(px_reader* r, px_io* io, unsigned long* bytes_sent){
+    ssize_t rc;
+    while (TRUE) {
+        if (r->pos < r->len){
+            if (client_send(io, r->buf+r->pos, r->len-r->pos, bytes_sent) ==
+                                                                    FAILURE)
+                return RELAY_CLIENT_GONE;
+            r->pos = r->len;
+        }
+        rc = fill(r);
+        if (rc == 0)
+            return RELAY_OK;
+        if (rc < 0)
+            return RELAY_UPSTREAM_ERROR;
+    }
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the part of the request body the client has not sent yet
+ */
+static int stream_request_body(int fd, px_io* io, unsigned long long length){
+    unsigned char buf[PX_BUF_SIZE];
+    ssize_t rc;
+    while (length > 0) {
+        rc = io->read(io->ctx, buf, length < sizeof(buf) ? length : sizeof(buf));
+        if (rc <= 0 || send_all(fd, buf, rc) == FAILURE)
+            return FAILURE;
+        length -= rc;
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,121 @@
+//
+//  proxy.h
+//  ex_3
+//
+
+#ifndef proxy_h
+#define proxy_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// routes a server may have
+#define PX_MAX_ROUTES 16
+// idle upstream connections every worker keeps per route
+#define PX_IDLE_PER_ROUTE 8
+// seconds an idle upstream connection is kept
+#define PX_IDLE_TIMEOUT 30
+// milliseconds allowed for connecting to an upstream
+#define PX_CONNECT_TIMEOUT 1000
+// seconds an upstream may stay silent in the middle of an exchange
+#define PX_IO_TIMEOUT 30
+// milliseconds requests fail fast after an upstream refused a connection
+#define PX_RETRY_AFTER 2000
+// largest upstream response head
+#define PX_HEAD_SIZE 8192
+// relay buffer
+#define PX_BUF_SIZE 16384
+
+// proxy_forward() results, besides PX_DONE an HTTP status for the error
+// page the caller still has to send
+#define PX_DONE 0
+#define PX_LENGTH_REQUIRED 411
+#define PX_BAD_GATEWAY 502
+#define PX_GATEWAY_TIMEOUT 504
+
+
+/**
+ * requests whose path starts with prefix go to the upstream at addr
+ */
+typedef struct _px_route {
+    char* prefix;
+    size_t prefix_len;
+    char* upstream;                     //as configured, "host:port" or "unix:path"
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int index;                          //in the per worker idle pools
+    _Atomic int64_t down_until_ms;      //fail fast until then, 0 - healthy
+} px_route;
+
+
+/**
+ * The route table, read only once the server runs
+ */
+typedef struct _proxy_st {
+    int num_routes;
+    px_route routes[PX_MAX_ROUTES];
+} proxy;
+
+
+/**
+ * the client side of a forwarded request
+ */
+typedef struct _px_io {
+    void* ctx;
+    ssize_t (*read)(void* ctx, void* buf, size_t len);
+    ssize_t (*write)(void* ctx, const void* buf, size_t len);
+} px_io;
+
+
+/**
+ * a request to forward. headers are the client's "name: value\r\n" lines,
+ * body_start the body bytes read along with them.
+ */
+typedef struct _px_request {
+    const char* method;
+    const char* target;
+    const char* headers;
+    const unsigned char* body_start;
+    size_t body_start_len;
+    const char* client_addr;    //for X-Forwarded-For
+} px_request;
+
+
+/**
+ * create_proxy allocates an empty route table. returns NULL on failure.
+ */
+proxy* create_proxy(void);
+
+/**
+ * proxy_add_route adds "prefix=upstream", upstream being "host:port" or
+ * "unix:/path/to/socket". host names are resolved once, here.
+ * returns 0 on success, -1 on a bad route or a full table.
+ */
+int proxy_add_route(proxy* px, const char* spec);
+
+/**
+ * proxy_match returns the first route whose prefix starts target, NULL
+ * if the request is not proxied
+ */
+px_route* proxy_match(proxy* px, const char* target);
+
+/**
+ * proxy_forward sends the request upstream over a pooled keep-alive
+ * connection and streams the response back as it arrives, closing the
+ * client connection when done. chunked upstream bodies are decoded and
+ * delimited by the close. request bodies need a Content-Length.
+ * returns PX_DONE once a response was relayed, *status and *bytes_sent
+ * describing it, or an error status if nothing was sent to the client.
+ */
+int proxy_forward(px_route* route, px_io* io, const px_request* request,
+                  int* status, unsigned long* bytes_sent);
+
+/**
+ * destroy_proxy frees the route table. idle connections belong to the
+ * worker threads and go with them.
+ */
+void destroy_proxy(proxy* px);
+
+#endif /* proxy_h */
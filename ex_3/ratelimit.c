@@ -0,0 +1,261 @@
+//
+//  ratelimit.c
+//  ex_3
+//
+
+#include "ratelimit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRUE 1
+#define FALSE 0
+#define MS_IN_SEC 1000
+#define TOKENS_MAX 0x7fffffff
+//request bucket counts thousandths of a request, so low rates refill smoothly
+#define REQ_UNIT 1000
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static uint32_t now_ms(void);
+static rl_entry* rl_lookup(ratelimit* limiter, uint32_t addr, int create);
+static int entry_idle(ratelimit* limiter, rl_entry* entry);
+static int bucket_full(_Atomic uint64_t* bucket, int64_t rate, int64_t burst);
+static int take_request(ratelimit* limiter, rl_entry* entry);
+static int bucket_take(_Atomic uint64_t* bucket, int64_t rate, int64_t burst,
+                       int64_t cost, int allow_debt);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+ratelimit* create_ratelimit(int max_conns, uint32_t req_rate,
+                            uint32_t byte_rate){
+    ratelimit* limiter = (ratelimit*)calloc(1, sizeof(ratelimit));
+    if (!limiter)
+        return NULL;
+
+    limiter->max_conns = max_conns;
+    limiter->req_rate = req_rate > TOKENS_MAX/REQ_UNIT ?
+                                        TOKENS_MAX/REQ_UNIT : req_rate;
+    limiter->byte_rate = byte_rate > TOKENS_MAX ? TOKENS_MAX : byte_rate;
+    return limiter;
+}
+
+//----------------------------------------------------------------------------//
+int rl_admit(ratelimit* limiter, uint32_t addr){
+    rl_entry* entry;
+    int conns;
+
+    for (;;) {
+        entry = rl_lookup(limiter, addr, TRUE);
+        if (!entry)
+            return RL_ADMIT; //window is busy - fail open rather than refuse all
+
+        conns = atomic_fetch_add_explicit(&entry->conns, 1,
+                                          memory_order_acq_rel);
+        /*the slot may have been reclaimed for another address between the
+         lookup and the increment, once counted it can't be reclaimed*/
+        if (rl_lookup(limiter, addr, FALSE) == entry)
+            break;
+        atomic_fetch_sub_explicit(&entry->conns, 1, memory_order_relaxed);
+    }
+    if (limiter->max_conns && conns >= limiter->max_conns){
+        rl_release(limiter, addr);
+        atomic_fetch_add_explicit(&limiter->rejected, 1, memory_order_relaxed);
+        return RL_TOO_MANY_CONNS;
+    }
+
+    if (!take_request(limiter, entry)){
+        rl_release(limiter, addr);
+        atomic_fetch_add_explicit(&limiter->rejected, 1, memory_order_relaxed);
+        return RL_RATE_LIMITED;
+    }
+    return RL_ADMIT;
+}
+
+//----------------------------------------------------------------------------//
+int rl_request(ratelimit* limiter, uint32_t addr){
+    /*the connection is counted, so its entry can't have been reclaimed*/
+    rl_entry* entry = rl_lookup(limiter, addr, FALSE);
+    if (!entry)
+        return RL_ADMIT; //admitted while the window was busy
+
+    if (!take_request(limiter, entry)){
+        atomic_fetch_add_explicit(&limiter->rejected, 1, memory_order_relaxed);
+        return RL_RATE_LIMITED;
+    }
+    return RL_ADMIT;
+}
+
+//----------------------------------------------------------------------------//
+void rl_release(ratelimit* limiter, uint32_t addr){
+    rl_entry* entry = rl_lookup(limiter, addr, FALSE);
+    if (!entry)
+        return;
+
+    /*never drop below zero, admits that failed open were not counted*/
+    int conns = atomic_load_explicit(&entry->conns, memory_order_relaxed);
+    while (conns > 0 &&
+           !atomic_compare_exchange_weak_explicit(&entry->conns, &conns,
+                                                  conns-1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+//----------------------------------------------------------------------------//
+int rl_consume_bytes(ratelimit* limiter, uint32_t addr, unsigned long bytes){
+    if (!limiter->byte_rate || !bytes)
+        return TRUE;
+    rl_entry* entry = rl_lookup(limiter, addr, FALSE);
+    if (!entry)
+        return TRUE;
+    if (bytes > TOKENS_MAX)
+        bytes = TOKENS_MAX;
+    return bucket_take(&entry->byte_bucket, limiter->byte_rate,
+                       limiter->byte_rate, (int64_t)bytes, TRUE);
+}
+
+//----------------------------------------------------------------------------//
+void destroy_ratelimit(ratelimit* limiter){
+    free(limiter);
+}
+
+//----------------------------------------------------------------------------//
+static uint32_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec*MS_IN_SEC + ts.tv_nsec/1000000);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * finds the entry of addr, claiming a free slot with a CAS when create is
+ * set. the shard is picked by the high bits of the hash and the slot by
+ * the low ones. slots are never emptied again, when the probe sequence
+ * holds neither addr nor a free slot, the first idle entry in it is
+ * reclaimed by swapping its key. returns NULL when none is idle.
+ */
+static rl_entry* rl_lookup(ratelimit* limiter, uint32_t addr, int create){
+    uint64_t key = (uint64_t)addr + 1;
+    uint32_t hash = addr * 0x9E3779B1u;
+    rl_shard* shard = &limiter->shards[(hash >> 28) & (RL_SHARDS-1)];
+    uint32_t slot = hash & (RL_SHARD_SLOTS-1);
+    rl_entry* idle = NULL;
+    uint64_t idle_key = 0;
+    int i;
+
+    for (i=0; i<RL_MAX_PROBE; i++, slot = (slot+1) & (RL_SHARD_SLOTS-1)) {
+        rl_entry* entry = &shard->slots[slot];
+        uint64_t curr = atomic_load_explicit(&entry->key,memory_order_acquire);
+        if (curr == key)
+            return entry;
+        if (curr != 0){
+            if (create && !idle && entry_idle(limiter, entry)){
+                idle = entry;
+                idle_key = curr;
+            }
+            continue;
+        }
+        if (!create)
+            return NULL;
+
+        uint64_t expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&entry->key, &expected,
+                                                    key, memory_order_acq_rel,
+                                                    memory_order_acquire)
+            || expected == key)
+            return entry;
+    }
+    /*an idle entry has full buckets, which is the same as untouched ones,
+     so only the key has to change hands*/
+    if (idle && atomic_load_explicit(&idle->conns, memory_order_acquire) == 0
+        && atomic_compare_exchange_strong_explicit(&idle->key, &idle_key, key,
+                                                   memory_order_acq_rel,
+                                                   memory_order_acquire))
+        return idle;
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * an entry is idle when it has no open connections and its buckets
+ * refilled up to the burst, forgetting it changes no verdict.
+ */
+static int entry_idle(ratelimit* limiter, rl_entry* entry){
+    if (atomic_load_explicit(&entry->conns, memory_order_acquire) != 0)
+        return FALSE;
+    return bucket_full(&entry->req_bucket, (int64_t)limiter->req_rate*REQ_UNIT,
+                       (int64_t)limiter->req_rate*REQ_UNIT)
+        && bucket_full(&entry->byte_bucket, limiter->byte_rate,
+                       limiter->byte_rate);
+}
+
+//----------------------------------------------------------------------------//
+static int bucket_full(_Atomic uint64_t* bucket, int64_t rate, int64_t burst){
+    uint64_t word = atomic_load_explicit(bucket, memory_order_relaxed);
+    if (word == 0)
+        return TRUE;
+    int64_t tokens = (int32_t)(uint32_t)(word >> 32);
+    tokens += (int64_t)(uint32_t)(now_ms() - (uint32_t)word) * rate / MS_IN_SEC;
+    return tokens >= burst;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * takes a request token, and checks the byte budget is not in debt
+ */
+static int take_request(ratelimit* limiter, rl_entry* entry){
+    if (limiter->req_rate &&
+        !bucket_take(&entry->req_bucket, (int64_t)limiter->req_rate*REQ_UNIT,
+                     (int64_t)limiter->req_rate*REQ_UNIT, REQ_UNIT, FALSE))
+        return FALSE;
+    if (limiter->byte_rate &&
+        !bucket_take(&entry->byte_bucket, limiter->byte_rate,
+                     limiter->byte_rate, 0, FALSE))
+        return FALSE;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * token bucket packed in one word: high 32 bits are the (signed) tokens,
+ * low 32 bits the millisecond stamp of the last refill. a zero word is a
+ * bucket that was never touched and starts full. rate is tokens per
+ * second. returns FALSE when there are less than cost tokens, unless
+ * allow_debt is set, then FALSE when the bucket went into debt.
+ */
+static int bucket_take(_Atomic uint64_t* bucket, int64_t rate, int64_t burst,
+                       int64_t cost, int allow_debt){
+    uint32_t now = now_ms();
+    uint64_t old = atomic_load_explicit(bucket, memory_order_relaxed);
+    uint64_t new;
+    int64_t tokens, refill;
+    uint32_t stamp;
+
+    do {
+        if (old == 0){
+            tokens = burst;
+            stamp = now;
+        } else {
+            tokens = (int32_t)(uint32_t)(old >> 32);
+            stamp = (uint32_t)old;
+        }
+        refill = (int64_t)(uint32_t)(now - stamp) * rate / MS_IN_SEC;
+        if (refill > 0){
+            tokens = tokens + refill > burst ? burst : tokens + refill;
+            stamp = now;
+        }
+        if (!allow_debt && tokens < cost)
+            return FALSE;
+        tokens -= cost;
+        if (tokens < -burst)
+            tokens = -burst;
+        new = ((uint64_t)(uint32_t)(int32_t)tokens << 32) | stamp;
+        if (new == 0)
+            new = 1; //keep "untouched" distinguishable
+    } while (!atomic_compare_exchange_weak_explicit(bucket, &old, new,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return tokens >= 0;
+}
@@ -0,0 +1,93 @@
+//
+//  ratelimit.h
+//  ex_3
+//
+
+#ifndef ratelimit_h
+#define ratelimit_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// number of independent shards in the table, must be a power of two
+#define RL_SHARDS 16
+// slots in each shard, must be a power of two
+#define RL_SHARD_SLOTS 1024
+// maximal linear probe length before the lookup gives up
+#define RL_MAX_PROBE 32
+
+// rl_admit() verdicts
+#define RL_ADMIT 0
+#define RL_TOO_MANY_CONNS 1
+#define RL_RATE_LIMITED 2
+
+
+/**
+ * state of a single client address. key is 0 while the slot is free,
+ * buckets are 0 until the first touch (see bucket_take in ratelimit.c)
+ */
+typedef struct _rl_entry {
+    _Atomic uint64_t key;            //client address + 1
+    _Atomic int conns;               //currently open connections
+    _Atomic uint64_t req_bucket;     //packed tokens/timestamp
+    _Atomic uint64_t byte_bucket;    //packed tokens/timestamp
+} rl_entry;
+
+
+typedef struct _rl_shard {
+    rl_entry slots[RL_SHARD_SLOTS];
+} rl_shard;
+
+
+/**
+ * The limiter. every field but the shards is read only after creation,
+ * so the hot path takes no locks at all.
+ */
+typedef struct _ratelimit_st {
+    int max_conns;              //concurrent connections per address, 0 - off
+    uint32_t req_rate;          //requests per second, 0 - off
+    uint32_t byte_rate;         //bytes per second, 0 - off
+    _Atomic unsigned long rejected;  //number of refused connections
+    rl_shard shards[RL_SHARDS];
+} ratelimit;
+
+
+/**
+ * create_ratelimit allocates an empty limiter. a zero limit disables
+ * the matching check. returns NULL on allocation failure.
+ */
+ratelimit* create_ratelimit(int max_conns, uint32_t req_rate,
+                            uint32_t byte_rate);
+
+/**
+ * rl_admit checks a new connection from addr (network order) against
+ * all limits, and on RL_ADMIT counts it as open until rl_release().
+ * keys are IPv4 addresses, the server only listens on AF_INET.
+ */
+int rl_admit(ratelimit* limiter, uint32_t addr);
+
+/**
+ * rl_release closes the connection counted by a successful rl_admit().
+ */
+void rl_release(ratelimit* limiter, uint32_t addr);
+
+/**
+ * rl_request checks one more request on a connection admitted before,
+ * against the request rate and byte budget of addr. returns RL_ADMIT or
+ * RL_RATE_LIMITED.
+ */
+int rl_request(ratelimit* limiter, uint32_t addr);
+
+/**
+ * rl_consume_bytes charges bytes sent to addr against its byte budget.
+ * the budget may go into debt, further connections are refused until
+ * it refills. returns 0 once the budget is used up, 1 while it holds.
+ */
+int rl_consume_bytes(ratelimit* limiter, uint32_t addr, unsigned long bytes);
+
+/**
+ * destroy_ratelimit frees the limiter.
+ */
+void destroy_ratelimit(ratelimit* limiter);
+
+#endif /* ratelimit_h */
@@ -0,0 +1,420 @@
+//
+//  replay.c
+//  ex_3
+//
+//  Replays a capture recorded by "server -R" against a server and reports
+//  latency and throughput per path.
+//  cc -o replay replay.c -pthread
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include "capture.h"
+
+#define USAGE "Usage: replay <capture> <host> <port> [-s speed] "\
+              "[-c connections]\n"\
+              "       speed 1 keeps the captured timing (default), 2 runs "\
+              "twice as fast, 0 as fast as possible\n"
+#define SUCCESS 0
+#define FAILURE -1
+#define TRUE 1
+#define FALSE 0
+#define R_EOL "\r\n"
+#define DEFAULT_CONNECTIONS 32
+#define READ_BUF_SIZE 65536
+#define LATE_US 10000   //requests started this much behind schedule are late
+#define PATH_COLUMN 40
+
+typedef struct _replay_request {
+    int64_t offset_us;      //from the capture
+    uint64_t conn;
+    char* head;             //request line, headers and the empty line
+    size_t head_len;
+    char* path;             //without the query, for the report
+    int status;             //0 - no response
+    unsigned long bytes;
+    int64_t latency_us;
+    int late;
+}replay_request;
+
+typedef struct _replay_attributes {
+    replay_request* requests;
+    size_t num_requests;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    double speed;               //0 - no waiting
+    int64_t start_us;
+    _Atomic size_t next;        //next request to send
+}replay_attribs;
+
+//----------------------------------------------------------------------------//
+//--------------------------FUNCTION DECLARATION------------------------------//
+//----------------------------------------------------------------------------//
+int load_capture(replay_attribs* replay, const char* path);
+
+int add_request(replay_attribs* replay, const cap_record* record,
+                const char* line, const char* headers);
+
+int resolve(replay_attribs* replay, const char* host, const char* port);
+
+void* replay_worker(void* p);
+
+void send_request(replay_attribs* replay, replay_request* request);
+
+void report(replay_attribs* replay, int64_t elapsed_us);
+
+void report_path(replay_request** group, size_t count);
+
+int compare_offset(const void* a, const void* b);
+
+int compare_path(const void* a, const void* b);
+
+int64_t now_us(void);
+
+//----------------------------------------------------------------------------//
+//------------------------------M A I N---------------------------------------//
+//----------------------------------------------------------------------------//
+int main(int argc, const char * argv[]) {
+    replay_attribs replay;
+    pthread_t* workers;
+    int num_workers = DEFAULT_CONNECTIONS, i, started;
+    int64_t elapsed_us;
+    char* end;
+
+    memset(&replay, 0, sizeof(replay));
+    replay.speed = 1;
+    if (argc < 4 || argc % 2 != 0){
+        printf(USAGE);
+        return FAILURE;
+    }
+    for (i=4; i<argc; i+=2) {
+        if (strcmp(argv[i], "-s") == 0){
+            replay.speed = strtod(argv[i+1], &end);
+            if (*end != '\0' || replay.speed < 0){
+                printf(USAGE);
+                return FAILURE;
+            }
+        } else if (strcmp(argv[i], "-c") == 0){
+            num_workers = atoi(argv[i+1]);
+            if (num_workers < 1){
+                printf(USAGE);
+                return FAILURE;
+            }
+        } else {
+            printf(USAGE);
+            return FAILURE;
+        }
+    }
+
+    if (load_capture(&replay, argv[1]) == FAILURE ||
+        resolve(&replay, argv[2], argv[3]) == FAILURE)
+        return FAILURE;
+    /*same order every run, threads only decide who sends what*/
+    qsort(replay.requests, replay.num_requests, sizeof(replay_request),
+          compare_offset);
+
+    workers = (pthread_t*)malloc(sizeof(pthread_t)*num_workers);
+    if (!workers)
+        return FAILURE;
+    atomic_init(&replay.next, 0);
+    replay.start_us = now_us();
+    for (started=0; started<num_workers; started++)
+        if (pthread_create(&workers[started], NULL, replay_worker,
+                           &replay) != 0)
+            break;
+    for (i=0; i<started; i++)
+        pthread_join(workers[i], NULL);
+    elapsed_us = now_us() - replay.start_us;
+
+    report(&replay, elapsed_us);
+    for (i=0; i<(int)replay.num_requests; i++) {
+        free(replay.requests[i].head);
+        free(replay.requests[i].path);
+    }
+    free(replay.requests);
+    free(workers);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+int load_capture(replay_attribs* replay, const char* path){
+    cap_file_header header;
+    cap_record record;
+    char* data = NULL;
+    size_t capacity = 0;
+    int rc = SUCCESS;
+    FILE* file = fopen(path, "rb");
+
+    if (!file){
+        perror("Error on capture open");
+        return FAILURE;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CAP_MAGIC, sizeof(header.magic)) != 0){
+        fprintf(stderr, "%s is not a capture\n", path);
+        fclose(file);
+        return FAILURE;
+    }
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.size != sizeof(record)+record.line_len+record.headers_len){
+            fprintf(stderr, "capture is corrupt\n");
+            rc = FAILURE;
+            break;
+        }
+        if (capacity < record.size){
+            capacity = record.size;
+            free(data);
+            data = (char*)malloc(capacity+2);
+            if (!data){
+                rc = FAILURE;
+                break;
+            }
+        }
+        if (fread(data, 1, record.size-sizeof(record), file) !=
+            record.size-sizeof(record)){
+            fprintf(stderr, "capture is truncated, replaying what was read\n");
+            break;
+        }
+        /*a '\0' between the line and the headers*/
+        memmove(data+record.line_len+1, data+record.line_len,
+                record.headers_len);
+        data[record.line_len] = '\0';
+        data[record.line_len+1+record.headers_len] = '\0';
+        if (add_request(replay, &record, data, data+record.line_len+1) ==
+                                                                    FAILURE){
+            rc = FAILURE;
+            break;
+        }
+    }
+    free(data);
+    fclose(file);
+    if (rc == SUCCESS)
+        printf("%zu requests loaded from %s\n", replay->num_requests, path);
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+int add_request(replay_attribs* replay, const cap_record* record,
+                const char* line, const char* headers){
+    static size_t capacity = 0;
+    replay_request* request;
+    replay_request* grown;
+    const char *path, *path_end;
+
+    if (replay->num_requests == capacity){
+        capacity = capacity ? capacity*2 : 1024;
+        grown = (replay_request*)realloc(replay->requests,
+                                         capacity*sizeof(replay_request));
+        if (!grown)
+            return FAILURE;
+        replay->requests = grown;
+    }
+    request = &replay->requests[replay->num_requests];
+    memset(request, 0, sizeof(replay_request));
+    request->offset_us = record->offset_us;
+    request->conn = record->conn;
+
+    request->head_len = strlen(line)+strlen(R_EOL)+strlen(headers)+
+                        strlen(R_EOL);
+    request->head = (char*)malloc(request->head_len+1);
+    path = strchr(line, ' ');
+    path = path ? path+1 : line;
+    path_end = path+strcspn(path, " ?");
+    request->path = strndup(path, path_end-path);
+    if (!request->head || !request->path){
+        free(request->head);
+        free(request->path);
+        return FAILURE;
+    }
+    sprintf(request->head, "%s" R_EOL "%s" R_EOL, line, headers);
+    replay->num_requests++;
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+int resolve(replay_attribs* replay, const char* host, const char* port){
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0){
+        fprintf(stderr, "cannot resolve %s:%s\n", host, port);
+        return FAILURE;
+    }
+    memcpy(&replay->addr, res->ai_addr, res->ai_addrlen);
+    replay->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * takes the next request, waits for its time unless running at full
+ * speed and sends it
+ */
+void* replay_worker(void* p){
+    replay_attribs* replay = (replay_attribs*)p;
+    replay_request* request;
+    struct timespec nap;
+    int64_t due_us, wait_us;
+    size_t index;
+
+    while (TRUE) {
+        index = atomic_fetch_add(&replay->next, 1);
+        if (index >= replay->num_requests)
+            break;
+        request = &replay->requests[index];
+        if (replay->speed > 0){
+            due_us = replay->start_us +
+                     (int64_t)((request->offset_us - replay->requests[0].offset_us)
+                               / replay->speed);
+            wait_us = due_us - now_us();
+            if (wait_us > 0){
+                nap.tv_sec = wait_us / 1000000;
+                nap.tv_nsec = (wait_us % 1000000) * 1000;
+                while (nanosleep(&nap, &nap) == -1 && errno == EINTR);
+            } else if (-wait_us > LATE_US)
+                request->late = TRUE;   //every connection was busy
+        }
+        send_request(replay, request);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * one request per connection, as the server answers. the latency runs
+ * from connect() to the server closing the connection.
+ */
+void send_request(replay_attribs* replay, replay_request* request){
+    char buf[READ_BUF_SIZE];
+    int64_t start = now_us();
+    size_t sent = 0;
+    ssize_t rc;
+    int sock_fd;
+
+    sock_fd = socket(replay->addr.ss_family, SOCK_STREAM, 0);
+    if (sock_fd == -1)
+        return;
+    if (connect(sock_fd, (struct sockaddr*)&replay->addr,
+                replay->addr_len) == -1){
+        close(sock_fd);
+        return;
+    }
+    while (sent < request->head_len) {
+        rc = send(sock_fd, request->head+sent, request->head_len-sent, 0);
+        if (rc <= 0){
+            close(sock_fd);
+            return;
+        }
+        sent += rc;
+    }
+    while ((rc = recv(sock_fd, buf, sizeof(buf), 0)) > 0) {
+        if (request->bytes == 0 && rc > 12 && strncmp(buf, "HTTP/1.", 7) == 0)
+            request->status = atoi(buf+9);
+        request->bytes += rc;
+    }
+    request->latency_us = now_us() - start;
+    close(sock_fd);
+}
+
+//----------------------------------------------------------------------------//
+void report(replay_attribs* replay, int64_t elapsed_us){
+    replay_request** sorted;
+    unsigned long bytes = 0, errors = 0, late = 0;
+    size_t i, first;
+    double seconds = elapsed_us / 1e6;
+
+    for (i=0; i<replay->num_requests; i++) {
+        bytes += replay->requests[i].bytes;
+        errors += replay->requests[i].status == 0 ||
+                  replay->requests[i].status >= 500;
+        late += replay->requests[i].late;
+    }
+    printf("%zu requests in %.3f s, %.1f req/s, %.2f MB/s, %lu errors, "
+           "%lu late\n", replay->num_requests, seconds,
+           seconds > 0 ? replay->num_requests / seconds : 0,
+           seconds > 0 ? bytes / seconds / 1e6 : 0, errors, late);
+    if (!replay->num_requests)
+        return;
+
+    sorted = (replay_request**)malloc(sizeof(replay_request*)*
+                                      replay->num_requests);
+    if (!sorted)
+        return;
+    for (i=0; i<replay->num_requests; i++)
+        sorted[i] = &replay->requests[i];
+    qsort(sorted, replay->num_requests, sizeof(replay_request*),
+          compare_path);
+
+    printf("%-*s %8s %7s %9s %9s %9s %9s %12s\n", PATH_COLUMN, "path",
+           "count", "errors", "mean ms", "p50 ms", "p99 ms", "max ms",
+           "bytes");
+    for (first=0, i=1; i<=replay->num_requests; i++) {
+        if (i < replay->num_requests &&
+            strcmp(sorted[i]->path, sorted[first]->path) == 0)
+            continue;
+        report_path(sorted+first, i-first);
+        first = i;
+    }
+    free(sorted);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * a line of the report, group sorted by latency
+ */
+void report_path(replay_request** group, size_t count){
+    unsigned long bytes = 0, errors = 0;
+    int64_t total_us = 0;
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        total_us += group[i]->latency_us;
+        bytes += group[i]->bytes;
+        errors += group[i]->status == 0 || group[i]->status >= 500;
+    }
+    printf("%-*.*s %8zu %7lu %9.3f %9.3f %9.3f %9.3f %12lu\n",
+           PATH_COLUMN, PATH_COLUMN, group[0]->path, count, errors,
+           total_us / 1e3 / count, group[count/2]->latency_us / 1e3,
+           group[(count*99)/100]->latency_us / 1e3,
+           group[count-1]->latency_us / 1e3, bytes);
+}
+
+//----------------------------------------------------------------------------//
+int compare_offset(const void* a, const void* b){
+    const replay_request* x = (const replay_request*)a;
+    const replay_request* y = (const replay_request*)b;
+    if (x->offset_us != y->offset_us)
+        return x->offset_us < y->offset_us ? -1 : 1;
+    if (x->conn != y->conn)
+        return x->conn < y->conn ? -1 : 1;
+    return 0;
+}
+
+//----------------------------------------------------------------------------//
+int compare_path(const void* a, const void* b){
+    const replay_request* x = *(const replay_request**)a;
+    const replay_request* y = *(const replay_request**)b;
+    int rc = strcmp(x->path, y->path);
+    if (rc)
+        return rc;
+    return (x->latency_us > y->latency_us) - (x->latency_us < y->latency_us);
+}
+
+//----------------------------------------------------------------------------//
+int64_t now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
@@ -19,13 +19,52 @@
 #include <dirent.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 #include "threadpool.h"
+#include "ratelimit.h"
+#include "accesslog.h"
+#include "tls.h"
+#include "http2.h"
+#include "bundle.h"
+#include "mime.h"
+#include "numa.h"
+#include "trace.h"
+#include "hotset.h"
+#include "dirlist.h"
+#include "proxy.h"
+#include "coldio.h"
+#include "capture.h"
+#include "coro.h"
+#include "shmcache.h"
+#include "prefork.h"
+#include "bufpool.h"
 
 #define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
-#define USAGE "Usage: server <port> <pool-size> <max-number-of-request>\n"
+#define USAGE "Usage: server <port> <pool-size> <max-number-of-request> "\
+              "[-c max-conns-per-ip] [-r requests-per-sec] [-b bytes-per-sec] "\
+              "[-l access-log-path] [-C tls-cert -K tls-key] "\
+              "[-B asset-bundle] [-n max-open-connections] "\
+              "[-A none|pin|numa] [-T trace-path] [-t trace-one-in] "\
+              "[-H hot-set-path] [-P prefix=host:port|unix:path]... "\
+              "[-d cold-file-min-bytes] [-R capture-path] "\
+              "[-E threads|coroutines] [-w worker-processes] "\
+              "[-L spin-microseconds] [-Q fifo|fair] "\
+              "[-D drain-seconds]\n"\
+              "       max-number-of-request 0 serves until killed\n"
 #define R_EOL "\r\n"
 #define R_HTTP "HTTP/1.1 "
-#define R_SERVER "Server: webserver/1.1"
+#define SERVER_NAME "webserver/1.1"
+#define R_SERVER "Server: " SERVER_NAME
 #define R_DATE "Date: "
 #define R_LOC "Location: "
 #define R_CTYPE "Content-Type: "
@@ -33,9 +72,44 @@
 #define R_CLEN "Content-Length: "
 #define R_LS_MODIFIED "Last-Modified: "
 #define R_CONNECTION "Connection: close"
+#define R_SWITCHING "HTTP/1.1 101 Switching Protocols\r\n"\
+                    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+#define H2_PRIOR_KNOWLEDGE_LINE "PRI * HTTP/2.0"
+#define H2_IDLE_TIMEOUT 30 //seconds an idle HTTP/2 connection is kept
+#define R_REJECTED "HTTP/1.1 503 Service Unavailable\r\n" R_SERVER "\r\n"\
+                   "Retry-After: 1\r\nContent-Length: 0\r\n" R_CONNECTION "\r\n\r\n"
+#define R_LIMITED "HTTP/1.1 429 Too Many Requests\r\n" R_SERVER "\r\n"\
+                  "Retry-After: 1\r\nContent-Length: 0\r\n" R_CONNECTION "\r\n\r\n"
 
 
 #define TIMEBUF 128
+#define ASSET_KEY_SIZE 1024
+#define ASSET_HEAD_SIZE 1024
+#define DEFAULT_OPEN_CONNS 256 //connection slots when -n is not given
+#define REAP_INTERVAL_MS 100 //queued connections checked this often when
+                             //all slots are taken
+#define DEFAULT_DRAIN_SECONDS 30 //open connections are waited for this long
+                                 //on the way out when -D is not given
+#define UPGRADE_TIMEOUT 10 //seconds a new binary has to report it serves
+#define HANDSHAKE_TIMEOUT 10 //seconds a client has to finish the TLS handshake
+#define LISTEN_FD_ENV "SERVER_LISTEN_FD" //listening socket of an upgrade
+#define READY_FD_ENV "SERVER_READY_FD"   //where the new binary reports in
+#define DEFAULT_PATH "/usr/bin:/bin"      //searched when PATH is not set
+
+#if defined(SYS_close_range) && !defined(CLOSE_RANGE_CLOEXEC)
+#define CLOSE_RANGE_CLOEXEC (1U << 2) //older headers know the call only
+#endif
+
+// worker placement, -A
+#define AFFINITY_NONE 0   //the scheduler decides
+#define AFFINITY_PIN 1    //every worker bound to one CPU
+#define AFFINITY_NUMA 2   //a pool per NUMA node, bound to the node's CPUs
+#define DEFAULT_TRACE_SAMPLE 100 //requests per traced request when -t is not given
+#define COLD_HOT_HITS 2 //recent hits that earn a large file the page cache
+
+#define TRACE_STAMP(client, stage) \
+    do { if ((client)->traced) (client)->trace.at[stage] = trace_now_us(); } \
+    while (0)
 #define SUCCESS 0
 #define FAILURE -1
 #define TRUE 1
@@ -51,18 +125,87 @@
 #define FORBIDDEN 403
 #define NOT_FOUND 404
 #define INTERNAL_ERROR 500
+#define LENGTH_REQUIRED 411
 #define NOT_SUPPORTED 501
+#define BAD_GATEWAY 502
+#define GATEWAY_TIMEOUT 504
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 //not available on macOS
+#endif
 
 //#define P_DEBUG
 
 typedef int bool_t;
 
+typedef struct _server_options {
+    int max_conns;          //0 - no limit
+    uint32_t req_rate;      //0 - no limit
+    uint32_t byte_rate;     //0 - no limit
+    const char* access_log; //NULL - no access log
+    const char* tls_cert;   //NULL - plain HTTP
+    const char* tls_key;
+    const char* bundle;     //NULL - serve from the file system only
+    int max_open;           //0 - DEFAULT_OPEN_CONNS
+    int affinity;           //AFFINITY_NONE
+    const char* trace;      //NULL - no in-process tracing
+    uint32_t trace_sample;  //0 - DEFAULT_TRACE_SAMPLE
+    const char* hotset;     //NULL - hot files are not remembered
+    const char* routes[PX_MAX_ROUTES];  //-P prefix=upstream, in order
+    int num_routes;
+    unsigned long cold_min; //0 - every file goes through the page cache
+    const char* capture;    //NULL - requests are not recorded
+    bool_t coroutines;      //FALSE - a pool thread per connection
+    int workers;            //0 - a single process
+    int spin_us;            //0 - idle workers sleep at once
+    bool_t fair_queue;      //FALSE - connections start in arrival order
+    int drain_s;            //0 - DEFAULT_DRAIN_SECONDS
+}server_options;
+
+typedef struct _client_attributes {
+    int sock_fd;
+    uint32_t addr;      //peer IPv4 address, network order
+    tls_conn* tls;      //NULL on plain HTTP connections
+    unsigned long bytes_sent;
+    bool_t over_budget;     //TRUE once -b ran out, further writes fail
+    unsigned long streams;  //h2 streams started, the first rides on the admit
+    unsigned long id;       //connection number
+    int idle_ms;            //read timeout of a coroutine, -1 - none
+    struct _attributes* server;
+    struct _client_attributes* next;    //free list link
+    bool_t busy;            //TRUE while the slot is taken
+    bool_t traced;          //TRUE if this connection was sampled
+    job work;               //its pool job, threads mode only
+    trace_request trace;
+}client_attribs;
+
 typedef struct _attributes {
-    threadpool* pool;
-    int curr_req_num;
-    int max_requests_num;
+    threadpool** pools;     //one per NUMA node with AFFINITY_NUMA, else one
+    int num_pools;
+    numa_topology* topology;
+    ratelimit* limiter; //NULL if no limit was requested
+    accesslog* log;     //NULL if no access log was requested
+    tls_server* tls;    //NULL if serving plain HTTP
+    bundle* assets;     //NULL if no asset bundle was given
+    tracer* tracer;     //NULL if not tracing
+    hotset* hot;        //NULL if hot files are not remembered
+    proxy* px;          //NULL if nothing is proxied
+    unsigned long cold_min; //files this large and not hot skip the cache
+    capture* capture;   //NULL if requests are not recorded
+    co_loop** loops;    //NULL unless connections run as coroutines
+    shcache* shared;    //NULL unless worker processes share a cache
+    int spin_us;        //0 unless tuned for latency, -L
+    int num_loops;
+    unsigned long curr_req_num;
+    int max_requests_num;   //0 - run forever
     int port;
-    int* clients;
+    client_attribs* clients;        //slab of num_clients connection slots
+    client_attribs* free_clients;   //slots not in use
+    int num_clients;
+    int num_free;
+    int drain_s;            //connections are waited for on the way out
+    pthread_mutex_t clients_lock;
+    pthread_cond_t client_freed;
     char timebuf[TIMEBUF];
 }server_attribs;
 
@@ -78,77 +221,331 @@ typedef struct _headers_attributes {
 typedef struct _request_attributes {
     char** path_args;
     unsigned char* request;
+    char* headers;          //header lines after the request line
+    char* query;            //after '?' in the request path, NULL if none
+    unsigned char* extra;   //bytes read past the end of the headers
+    int extra_len;
+    bool_t headers_complete;    //FALSE if the head did not fit or was cut
     int argc;
     int path_lenght;
     int status;
+    unsigned long bytes_sent;
 }request_attribs;
 
+typedef struct _response_attributes {
+    headers_attribs attr;
+    char last_modified[TIMEBUF];
+    unsigned char* content; //in memory body, NULL when sending a file
+    bool_t free_content;    //TRUE if content was allocated
+    int file_fd;            //file body, -1 if none
+    char* path;             //resolved path
+    bool_t shared;          //TRUE if the file was found in the shared cache
+}response_attribs;
+
+typedef struct _h2_stream_attributes {
+    request_attribs request;
+    response_attribs response;
+    char date[TIMEBUF];
+    char content_len[TIMEBUF];
+    char request_line[AL_REQ_LEN];  //for the access log
+    int64_t start_us;
+}h2_stream_attribs;
+
+/**
+ * what the prefork master needs to start a new binary
+ */
+typedef struct _upgrade_attributes {
+    int sock_fd;
+    const char** argv;
+}upgrade_attribs;
+
+/*set by signal_handler(), the accept loop acts on them*/
+volatile sig_atomic_t report_requested = 0;    //SIGUSR1, memory_report()
+volatile sig_atomic_t upgrade_requested = 0;   //SIGUSR2, upgrade_binary()
+volatile sig_atomic_t drain_requested = 0;     //SIGQUIT, stop accepting
+
+extern char** environ;
+
 //----------------------------------------------------------------------------//
 //--------------------------FUNCTION DECLARATION------------------------------//
 //----------------------------------------------------------------------------//
 int get_time(char* timebuf);
 
-char *get_mime_type(char *name);
+server_attribs* init_attribs(int argc, const char * argv[],
+                             server_options* options);
 
-server_attribs* init_attribs(int argc, const char * argv[]);
+int parse_options(int argc, const char * argv[], server_options* options);
+
+void worker_paths(server_options* options, int worker);
 
 int init_server(int port);
 
+int create_pools(server_attribs* attribs, int pool_size, int affinity,
+                 int spin_us, bool_t fair);
+
+threadpool* pick_pool(server_attribs* attribs, int sock_fd);
+
+int create_loops(server_attribs* attribs);
+
+int spawn_client(server_attribs* attribs, client_attribs* client);
+
 void dealloc_resources(server_attribs* attribs);
 
-void sigpipe_handler(int signum);
+
+void reject_client(int sock_fd, const char* response);
+
+void tune_socket(server_attribs* attribs, int sock_fd);
+
+void prefetch_file(void* ctx, const char* path);
+
+bool_t peer_gone(client_attribs* client, bool_t request_read);
+
+int reap_clients(server_attribs* attribs);
+
+void catch_signal(int signum);
+
+void signal_handler(int signum);
+
+void memory_report(server_attribs* attribs);
+
+int inherited_socket(void);
+
+void notify_ready(bool_t writer);
+
+char* find_binary(const char* name);
+
+char** upgrade_env(char* listen_var, char* ready_var);
+
+int upgrade_binary(int sock_fd, const char* argv[]);
+
+int upgrade_master(void* ctx);
+
+void drain_clients(server_attribs* attribs);
+
+client_attribs* acquire_client(server_attribs* attribs);
+
+void release_client(client_attribs* client);
 
 int service_client(void* args);
 
-int receive_request(int sock_fd, request_attribs* req_attribs);
+px_route* find_route(server_attribs* server, request_attribs* request);
+
+int serve_proxy(client_attribs* client, request_attribs* request,
+                px_route* route, int64_t start_us);
+
+ssize_t proxy_client_read(void* ctx, void* buf, size_t len);
+
+ssize_t proxy_client_write(void* ctx, const void* buf, size_t len);
+
+int client_wait(client_attribs* client, int events);
+
+ssize_t client_read(client_attribs* client, void* buf, size_t len);
+
+ssize_t client_write(client_attribs* client, const void* buf, size_t len);
+
+void charge_client(client_attribs* client, ssize_t sent);
+
+ssize_t client_sendfile(client_attribs* client, int file_fd, off_t* offset,
+                        size_t count);
+
+int receive_request(client_attribs* client, request_attribs* req_attribs);
+
+char* get_header(request_attribs* request, const char* name);
+
+void free_request(request_attribs* request);
+
+int serve_http2(client_attribs* client, int mode, request_attribs* request);
+
+ssize_t h2_client_read(void* ctx, void* buf, size_t len);
+
+ssize_t h2_client_write(void* ctx, const void* buf, size_t len);
+
+ssize_t h2_client_sendfile(void* ctx, int file_fd, off_t* offset, size_t count);
+
+int h2_client_readable(void* ctx);
+
+int h2_request(void* ctx, const char* method, const char* path,
+               const char* headers, h2_response* resp);
+
+void h2_release(void* ctx, h2_response* resp);
+
+void log_request(client_attribs* client, const char* request, int status,
+                 unsigned long bytes, int64_t start_us);
+
+void capture_request(client_attribs* client, const char* line,
+                     const char* headers);
 
 char* get_response_content(int status);
 
-char* get_directory_content(char* path);
+char* get_directory_content(char* path, const char* query, int format);
+
+int listing_format(request_attribs* request);
 
 char* build_resp_head(headers_attribs* resp);
 
 int parse_request(request_attribs* request);
 
-int send_responce(int sock_fd, request_attribs* request);
+int build_response(server_attribs* server, request_attribs* request,
+                   response_attribs* resp);
+
+int shared_response(server_attribs* server, request_attribs* request,
+                    response_attribs* resp);
+
+void free_response(response_attribs* resp);
+
+int send_responce(client_attribs* client, request_attribs* request);
+
+bool_t is_cold(server_attribs* server, response_attribs* resp);
+
+ssize_t cold_client_write(void* ctx, const void* buf, size_t len);
+
+ssize_t cold_client_sendfile(void* ctx, int file_fd, off_t* offset,
+                             size_t count);
+
+const bundle_entry* find_asset(server_attribs* server, request_attribs* request,
+                               int* variant);
+
+int accepts_gzip(request_attribs* request);
+
+int send_asset(client_attribs* client, request_attribs* request,
+               const bundle_entry* entry, int variant);
 
 void dbs_print(char* msg);
 //----------------------------------------------------------------------------//
 //------------------------------M A I N---------------------------------------//
 //----------------------------------------------------------------------------//
 int main(int argc, const char * argv[]) {
-    int sock_fd;
+    int sock_fd = FAILURE;
     int newsock_fd;
-    struct sockaddr cli_addr;
-    socklen_t clilen = 0;
+    int worker = 0, status;
+    struct sockaddr_in cli_addr;
+    socklen_t clilen;
+    client_attribs* client;
+    server_options options;
+    shcache* shared = NULL;
+    upgrade_attribs upgrade;
+    sigset_t signal_set;
+    memset(&options, 0, sizeof(options));
     /*checking correct usage command*/
-    if (argc != 4) {
+    if (argc < 4 || parse_options(argc, argv, &options) == FAILURE) {
         printf(USAGE);
         return FAILURE;
     }
 
-    server_attribs* attribs = init_attribs(argc, argv);
+    /*set when started by upgrade_binary()*/
+    sock_fd = inherited_socket();
+    /*a peer that hung up fails the write with EPIPE, it doesn't kill us*/
+    signal(SIGPIPE, SIG_IGN);
+
+    /*workers share the socket and the cache, everything else is their own*/
+    if (options.workers){
+        if (sock_fd == FAILURE)
+            sock_fd = init_server(atoi(argv[1]));
+        if (sock_fd == FAILURE)
+            exit(EXIT_FAILURE);
+        shared = create_shcache();
+        if (!shared){
+            perror("Error on shared cache");
+            exit(EXIT_FAILURE);
+        }
+        upgrade.sock_fd = sock_fd;
+        upgrade.argv = argv;
+        worker = pf_run(options.workers, &status, upgrade_master, &upgrade);
+        if (worker == FAILURE){
+            close(sock_fd);
+            destroy_shcache(shared);
+            return status;
+        }
+        worker_paths(&options, worker);
+    }
+
+    /*the threads started from here leave the signals to this one*/
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, SIGUSR1);
+    sigaddset(&signal_set, SIGUSR2);
+    sigaddset(&signal_set, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+    server_attribs* attribs = init_attribs(argc, argv, &options);
     if (!attribs)
         return FAILURE;
+    attribs->shared = shared;
+    catch_signal(SIGUSR1);
+    catch_signal(SIGQUIT);
+    /*a worker is upgraded by its master*/
+    if (!options.workers)
+        catch_signal(SIGUSR2);
+    pthread_sigmask(SIG_UNBLOCK, &signal_set, NULL);
 
-    sock_fd = init_server(attribs->port);
+    if (sock_fd == FAILURE)
+        sock_fd = init_server(attribs->port);
     if (sock_fd == FAILURE){
         dealloc_resources(attribs);
         exit(EXIT_FAILURE);
     }
+    notify_ready(worker == 0);
 
-    while (attribs->curr_req_num < attribs->max_requests_num) {
+    while (!drain_requested && (attribs->max_requests_num == 0 ||
+           attribs->curr_req_num < attribs->max_requests_num)) {
+        if (upgrade_requested){
+            upgrade_requested = 0;
+            if (upgrade_binary(sock_fd, argv) == SUCCESS)
+                break;
+        }
+        /*waiting for a free slot first, the backlog holds the rest*/
+        client = acquire_client(attribs);
+        if (!client)
+            continue;
+        clilen = sizeof(cli_addr);
         newsock_fd = accept(sock_fd, (struct sockaddr*)&cli_addr, &clilen);
         dbs_print("new connection established");
         if (newsock_fd < 0){
-            perror("Error on accept");
+            release_client(client);
+            if (errno != EINTR)
+                perror("Error on accept");
+            if (report_requested){
+                report_requested = 0;
+                memory_report(attribs);
+            }
             continue;
         }
+#ifndef SYS_close_range
+        /*upgrade_binary() can't mark them all at once here*/
+        fcntl(newsock_fd, F_SETFD, FD_CLOEXEC);
+#endif
 
-        attribs->clients[attribs->curr_req_num] = newsock_fd;
-        
-        dispatch(attribs->pool, service_client,
-                 &attribs->clients[attribs->curr_req_num]);
+        /*refusing abusive clients before they take a pool thread*/
+        if (attribs->limiter &&
+            rl_admit(attribs->limiter, cli_addr.sin_addr.s_addr) != RL_ADMIT){
+            reject_client(newsock_fd, R_LIMITED);
+            release_client(client);
+            continue;
+        }
+
+        tune_socket(attribs, newsock_fd);
+        client->sock_fd = newsock_fd;
+        client->addr = cli_addr.sin_addr.s_addr;
+        client->tls = NULL;
+        client->bytes_sent = 0;
+        client->over_budget = FALSE;
+        client->streams = 0;
+        client->id = attribs->curr_req_num;
+        client->idle_ms = -1;
+        client->server = attribs;
+        client->traced = attribs->tracer &&
+                         tracer_sample(attribs->tracer, &client->trace);
+        TRACE_STAMP(client, TS_DISPATCH);
+
+        if (attribs->loops)
+            spawn_client(attribs, client);
+        /*with -Q fair every client address gets the same share*/
+        else if (dispatch_flow(pick_pool(attribs, newsock_fd), &client->work,
+                               client->addr, 0, service_client,
+                               client) == FAILURE){
+            reject_client(newsock_fd, R_REJECTED);
+            if (attribs->limiter)
+                rl_release(attribs->limiter, client->addr);
+            release_client(client);
+        }
         
         dbs_print("service client done");
         attribs->curr_req_num++;
@@ -158,7 +555,9 @@ int main(int argc, const char * argv[]) {
 
     dbs_print("all done - shut down");
 
+    /*after an upgrade the new binary keeps accepting on it*/
     close(sock_fd);
+    drain_clients(attribs);
     dealloc_resources(attribs);
    
     return 0;
@@ -175,32 +574,15 @@ int get_time(char* timebuf){
 }
 
 //----------------------------------------------------------------------------//
-char *get_mime_type(char *name){
-    char *ext = strrchr(name, '.');
-    if (!ext) return NULL;
-    if (strcmp(ext, ".html") == 0
-                            || strcmp(ext, ".htm") == 0) return "text/html";
-    if (strcmp(ext, ".jpg") == 0
-                            || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(ext, ".gif") == 0) return "image/gif";
-    if (strcmp(ext, ".png") == 0) return "image/png";
-    if (strcmp(ext, ".css") == 0) return "text/css";
-    if (strcmp(ext, ".au") == 0) return "audio/basic";
-    if (strcmp(ext, ".wav") == 0) return "audio/wav";
-    if (strcmp(ext, ".avi") == 0) return "video/x-msvideo";
-    if (strcmp(ext, ".mpeg") == 0
-                            || strcmp(ext, ".mpg") == 0) return "video/mpeg";
-    if (strcmp(ext, ".mp3") == 0) return "audio/mpeg";
-    return NULL;
-}
-
-//----------------------------------------------------------------------------//
-server_attribs* init_attribs(int argc, const char * argv[]){
+server_attribs* init_attribs(int argc, const char * argv[],
+                             server_options* opts){
     int port = atoi(argv[1]);
     int pool_size = atoi(argv[2]);
     int requests_num = atoi(argv[3]);
+    int i;
+    server_options options = *opts;
     
-    if (port < 0 || pool_size < 1 || requests_num < 1 ){
+    if (port < 0 || pool_size < 1 || requests_num < 0){
         printf(USAGE);
         return NULL;
     }
@@ -215,21 +597,247 @@ server_attribs* init_attribs(int argc, const char * argv[]){
     attribs->max_requests_num = requests_num;
     attribs->port = port;
     memset(attribs->timebuf, '\0', TIMEBUF);
-    attribs->clients = (int*)calloc(attribs->max_requests_num, sizeof(int));
+    /*slots are recycled, memory follows open connections, not requests*/
+    attribs->num_clients = options.max_open ? options.max_open :
+                                              DEFAULT_OPEN_CONNS;
+    if (requests_num && requests_num < attribs->num_clients)
+        attribs->num_clients = requests_num;
+    attribs->clients = (client_attribs*)calloc(attribs->num_clients,
+                                               sizeof(client_attribs));
     if (!attribs->clients){
         free(attribs);
         return NULL;
     }
-    attribs->pool = create_threadpool(pool_size);
-    if (!attribs->pool){
-        free(attribs->clients);
-        free(attribs);
+    attribs->free_clients = NULL;
+    attribs->num_free = attribs->num_clients;
+    attribs->drain_s = options.drain_s ? options.drain_s :
+                                         DEFAULT_DRAIN_SECONDS;
+    for (i=attribs->num_clients-1; i>=0; i--) {
+        attribs->clients[i].server = attribs;
+        attribs->clients[i].next = attribs->free_clients;
+        attribs->free_clients = &attribs->clients[i];
+    }
+    pthread_mutex_init(&attribs->clients_lock, NULL);
+    pthread_cond_init(&attribs->client_freed, NULL);
+    attribs->limiter = NULL;
+    attribs->log = NULL;
+    attribs->tls = NULL;
+    attribs->assets = NULL;
+    attribs->tracer = NULL;
+    attribs->hot = NULL;
+    attribs->px = NULL;
+    attribs->cold_min = options.cold_min;
+    attribs->capture = NULL;
+    attribs->loops = NULL;
+    attribs->num_loops = 0;
+    attribs->shared = NULL;
+    attribs->spin_us = options.spin_us;
+    attribs->pools = NULL;
+    attribs->num_pools = 0;
+    attribs->topology = NULL;
+    if (options.max_conns || options.req_rate || options.byte_rate){
+        attribs->limiter = create_ratelimit(options.max_conns,
+                                            options.req_rate,
+                                            options.byte_rate);
+        if (!attribs->limiter){
+            dealloc_resources(attribs);
+            return NULL;
+        }
+    }
+    if (options.access_log){
+        attribs->log = create_accesslog(options.access_log);
+        if (!attribs->log){
+            dealloc_resources(attribs);
+            return NULL;
+        }
+        al_rotate_on_signal(attribs->log, SIGHUP);
+    }
+    if (options.tls_cert || options.tls_key){
+        if (!options.tls_cert || !options.tls_key){
+            printf(USAGE);
+            dealloc_resources(attribs);
+            return NULL;
+        }
+        attribs->tls = create_tls_server(options.tls_cert, options.tls_key);
+        if (!attribs->tls){
+            dealloc_resources(attribs);
+            return NULL;
+        }
+    }
+    if (options.bundle){
+        attribs->assets = open_bundle(options.bundle);
+        if (!attribs->assets){
+            dealloc_resources(attribs);
+            return NULL;
+        }
+    }
+    /*prefetching runs in the background while the server already accepts*/
+    if (options.hotset){
+        attribs->hot = create_hotset(options.hotset, prefetch_file, attribs);
+        if (!attribs->hot){
+            dealloc_resources(attribs);
+            return NULL;
+        }
+    }
+    if (options.num_routes){
+        attribs->px = create_proxy();
+        if (!attribs->px){
+            dealloc_resources(attribs);
+            return NULL;
+        }
+        for (i=0; i<options.num_routes; i++) {
+            if (proxy_add_route(attribs->px, options.routes[i]) == FAILURE){
+                printf(USAGE);
+                dealloc_resources(attribs);
+                return NULL;
+            }
+        }
+    }
+    if (options.capture){
+        attribs->capture = create_capture(options.capture);
+        if (!attribs->capture){
+            dealloc_resources(attribs);
+            return NULL;
+        }
+    }
+    if (options.trace){
+        attribs->tracer = create_tracer(options.trace, options.trace_sample ?
+                                                       options.trace_sample :
+                                                       DEFAULT_TRACE_SAMPLE);
+        if (!attribs->tracer){
+            dealloc_resources(attribs);
+            return NULL;
+        }
+    }
+    if (create_pools(attribs, pool_size, options.affinity,
+                     options.spin_us, options.fair_queue) == FAILURE ||
+        (options.coroutines && create_loops(attribs) == FAILURE)){
+        dealloc_resources(attribs);
         return NULL;
     }
     
     return attribs;
 }
 
+//----------------------------------------------------------------------------//
+/**
+ * parses the optional flags following the positional arguments.
+ * every flag takes a value, numeric limits must be non negative and
+ * 0 keeps the limit off.
+ */
+int parse_options(int argc, const char * argv[], server_options* options){
+    int i;
+    long value;
+    char* end;
+
+    for (i=4; i<argc; i+=2) {
+        if (i+1 >= argc)
+            return FAILURE;
+
+        if (strcmp(argv[i], "-l") == 0){
+            options->access_log = argv[i+1];
+            continue;
+        } else if (strcmp(argv[i], "-C") == 0){
+            options->tls_cert = argv[i+1];
+            continue;
+        } else if (strcmp(argv[i], "-K") == 0){
+            options->tls_key = argv[i+1];
+            continue;
+        } else if (strcmp(argv[i], "-B") == 0){
+            options->bundle = argv[i+1];
+            continue;
+        } else if (strcmp(argv[i], "-H") == 0){
+            options->hotset = argv[i+1];
+            continue;
+        } else if (strcmp(argv[i], "-P") == 0){
+            if (options->num_routes == PX_MAX_ROUTES)
+                return FAILURE;
+            options->routes[options->num_routes++] = argv[i+1];
+            continue;
+        } else if (strcmp(argv[i], "-R") == 0){
+            options->capture = argv[i+1];
+            continue;
+        } else if (strcmp(argv[i], "-T") == 0){
+            options->trace = argv[i+1];
+            continue;
+        } else if (strcmp(argv[i], "-A") == 0){
+            if (strcmp(argv[i+1], "none") == 0)
+                options->affinity = AFFINITY_NONE;
+            else if (strcmp(argv[i+1], "pin") == 0)
+                options->affinity = AFFINITY_PIN;
+            else if (strcmp(argv[i+1], "numa") == 0)
+                options->affinity = AFFINITY_NUMA;
+            else
+                return FAILURE;
+            continue;
+        } else if (strcmp(argv[i], "-E") == 0){
+            if (strcmp(argv[i+1], "threads") == 0)
+                options->coroutines = FALSE;
+            else if (strcmp(argv[i+1], "coroutines") == 0)
+                options->coroutines = TRUE;
+            else
+                return FAILURE;
+            continue;
+        } else if (strcmp(argv[i], "-Q") == 0){
+            if (strcmp(argv[i+1], "fifo") == 0)
+                options->fair_queue = FALSE;
+            else if (strcmp(argv[i+1], "fair") == 0)
+                options->fair_queue = TRUE;
+            else
+                return FAILURE;
+            continue;
+        }
+
+        value = strtol(argv[i+1], &end, 10);
+        if (*end != '\0' || end == argv[i+1] || value < 0)
+            return FAILURE;
+
+        if (strcmp(argv[i], "-c") == 0)
+            options->max_conns = (int)value;
+        else if (strcmp(argv[i], "-r") == 0)
+            options->req_rate = (uint32_t)value;
+        else if (strcmp(argv[i], "-b") == 0)
+            options->byte_rate = (uint32_t)value;
+        else if (strcmp(argv[i], "-n") == 0 && value > 0)
+            options->max_open = (int)value;
+        else if (strcmp(argv[i], "-t") == 0 && value > 0)
+            options->trace_sample = (uint32_t)value;
+        else if (strcmp(argv[i], "-d") == 0)
+            options->cold_min = (unsigned long)value;
+        else if (strcmp(argv[i], "-w") == 0)
+            options->workers = (int)value;
+        else if (strcmp(argv[i], "-L") == 0)
+            options->spin_us = (int)value;
+        else if (strcmp(argv[i], "-D") == 0 && value > 0)
+            options->drain_s = (int)value;
+        else
+            return FAILURE;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * files a worker writes alone get the worker's number appended, so
+ * workers do not write over each other. the new paths live as long as
+ * the worker.
+ */
+void worker_paths(server_options* options, int worker){
+    const char** paths[] = {&options->trace, &options->capture,
+                            &options->hotset};
+    char* path;
+    int i;
+    for (i=0; i<sizeof(paths)/sizeof(paths[0]); i++) {
+        if (!*paths[i])
+            continue;
+        path = (char*)malloc(strlen(*paths[i])+16);
+        if (!path)
+            continue;
+        sprintf(path, "%s.%d", *paths[i], worker);
+        *paths[i] = path;
+    }
+}
+
 //----------------------------------------------------------------------------//
 int init_server(int port){
     int sock_fd;
@@ -251,91 +859,549 @@ int init_server(int port){
         return FAILURE;
     }
     
-    if (listen(sock_fd, 5) == -1){
+    if (listen(sock_fd, SOMAXCONN) == -1){
         perror("Error on listen");
         return FAILURE;
     }
     return sock_fd;
 }
 
+//----------------------------------------------------------------------------//
+/**
+ * creates the worker pools. with AFFINITY_NUMA the pool-size threads are
+ * shared among the nodes by their number of CPUs, at least one each, and
+ * each node gets its own pool bound to its CPUs, so the buffers a worker
+ * allocates stay on the node.
+ */
+int create_pools(server_attribs* attribs, int pool_size, int affinity,
+                 int spin_us, bool_t fair){
+    threadpool_options options;
+    numa_topology* topology = NULL;
+    int i, node, total_cpus = 0, num_pools = 1;
+
+    if (affinity != AFFINITY_NONE){
+        topology = load_numa_topology();
+        if (!topology)
+            return FAILURE;
+        attribs->topology = topology;
+        for (node=0; node<topology->num_nodes; node++)
+            total_cpus += topology->node_num_cpus[node];
+        if (affinity == AFFINITY_NUMA)
+            num_pools = topology->num_nodes;
+    }
+    attribs->pools = (threadpool**)calloc(num_pools, sizeof(threadpool*));
+    if (!attribs->pools)
+        return FAILURE;
+
+    for (i=0; i<num_pools; i++) {
+        memset(&options, 0, sizeof(options));
+        options.num_threads = pool_size;
+        options.spin_us = spin_us;
+        options.fair = fair;
+        if (affinity == AFFINITY_PIN){
+            /*every CPU of every node, in node order*/
+            options.cpus = (int*)malloc(total_cpus*sizeof(int));
+            if (!options.cpus)
+                return FAILURE;
+            for (node=0; node<topology->num_nodes; node++) {
+                memcpy((int*)options.cpus+options.num_cpus,
+                       topology->node_cpus[node],
+                       topology->node_num_cpus[node]*sizeof(int));
+                options.num_cpus += topology->node_num_cpus[node];
+            }
+            options.pin_each = TRUE;
+        } else if (affinity == AFFINITY_NUMA){
+            options.cpus = topology->node_cpus[i];
+            options.num_cpus = topology->node_num_cpus[i];
+            options.num_threads = (pool_size*options.num_cpus +
+                                   total_cpus-1)/total_cpus;
+        }
+        attribs->pools[i] = create_threadpool_ex(&options);
+        if (affinity == AFFINITY_PIN)
+            free((int*)options.cpus);
+        if (!attribs->pools[i])
+            return FAILURE;
+        attribs->num_pools++;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the pool of the NUMA node whose CPU handled the connection's packets,
+ * so the worker runs next to the NIC queue the connection hashed to.
+ * connections are spread round robin where that is not known.
+ */
+threadpool* pick_pool(server_attribs* attribs, int sock_fd){
+    int cpu = -1;
+#ifdef SO_INCOMING_CPU
+    socklen_t len = sizeof(cpu);
+#endif
+
+    if (attribs->num_pools == 1)
+        return attribs->pools[0];
+#ifdef SO_INCOMING_CPU
+    if (getsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1)
+        cpu = -1;
+#endif
+    if (cpu < 0)
+        return attribs->pools[attribs->curr_req_num % attribs->num_pools];
+    return attribs->pools[numa_node_of_cpu(attribs->topology, cpu)];
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * gives every pool thread over to a coroutine loop. connections become
+ * coroutines of the loops, a thread runs the next one whenever a socket
+ * would block, so pool-size threads carry as many connections as -n
+ * allows.
+ */
+int create_loops(server_attribs* attribs){
+    int i, j, total = 0;
+    for (i=0; i<attribs->num_pools; i++)
+        total += attribs->pools[i]->num_threads;
+    attribs->loops = (co_loop**)calloc(total, sizeof(co_loop*));
+    if (!attribs->loops)
+        return FAILURE;
+    for (i=0; i<attribs->num_pools; i++) {
+        for (j=0; j<attribs->pools[i]->num_threads; j++) {
+            co_loop* loop = create_co_loop();
+            if (!loop)
+                return FAILURE;
+            attribs->loops[attribs->num_loops++] = loop;
+            /*co_run() keeps the thread until co_stop()*/
+            dispatch(attribs->pools[i], co_run, loop);
+        }
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * hands a connection to the next loop round robin, its coroutine starts
+ * once the client sends something. the connection is refused if it
+ * cannot be.
+ */
+int spawn_client(server_attribs* attribs, client_attribs* client){
+    co_loop* loop = attribs->loops[attribs->curr_req_num % attribs->num_loops];
+    if (fcntl(client->sock_fd, F_SETFL, O_NONBLOCK) == -1 ||
+        co_spawn_io(loop, client->sock_fd, service_client,
+                    client) == FAILURE){
+        reject_client(client->sock_fd, R_REJECTED);
+        if (attribs->limiter)
+            rl_release(attribs->limiter, client->addr);
+        release_client(client);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
 //----------------------------------------------------------------------------//
 void dealloc_resources(server_attribs* attribs){
-    destroy_threadpool(attribs->pool);
+    int i;
+    /*the loops return once their connections are done, freeing the pools*/
+    for (i=0; i<attribs->num_loops; i++)
+        co_stop(attribs->loops[i]);
+    for (i=0; i<attribs->num_pools; i++)
+        destroy_threadpool(attribs->pools[i]);
+    for (i=0; i<attribs->num_loops; i++)
+        destroy_co_loop(attribs->loops[i]);
+    free(attribs->loops);
+    destroy_shcache(attribs->shared);
+    /*after the pools, so the last save has every hit*/
+    destroy_hotset(attribs->hot);
+    free(attribs->pools);
+    dl_clear_cache();
+    destroy_numa_topology(attribs->topology);
+    destroy_tracer(attribs->tracer);
+    destroy_capture(attribs->capture);
+    if (attribs->limiter)
+        destroy_ratelimit(attribs->limiter);
+    if (attribs->log)
+        destroy_accesslog(attribs->log);
+    if (attribs->tls)
+        destroy_tls_server(attribs->tls);
+    if (attribs->assets)
+        close_bundle(attribs->assets);
+    destroy_proxy(attribs->px);
+    cold_release_buffers();
+    bp_release();
+    pthread_mutex_destroy(&attribs->clients_lock);
+    pthread_cond_destroy(&attribs->client_freed);
     free(attribs->clients);
     free(attribs);
 }
 
 //----------------------------------------------------------------------------//
 int service_client(void* args){
-    int cli_sock_fd = *(int*)args;
+    client_attribs* client = (client_attribs*)args;
+    int cli_sock_fd = client->sock_fd;
+    ratelimit* limiter = client->server->limiter;
     int status;
+    int64_t start_us = 0;
+    char* upgrade = NULL;
+    char* request_line = NULL;
+    const bundle_entry* asset = NULL;
+    px_route* route = NULL;
+    int variant;
     request_attribs req_attribs;
-    req_attribs.path_args = NULL;
-    req_attribs.request = NULL;
-    req_attribs.path_lenght = 0;
+    memset(&req_attribs, 0, sizeof(req_attribs));
+
+    TRACE_STAMP(client, TS_PICKUP);
+    if (client->server->log)
+        start_us = al_now_us();
+    /*a client that gave up while queued is not worth the handshake*/
+    if (peer_gone(client, FALSE)){
+        close(cli_sock_fd);
+        if (limiter)
+            rl_release(limiter, client->addr);
+        release_client(client);
+        return FAILURE;
+    }
+    if (client->server->tls){
+        client->tls = tls_accept(client->server->tls, cli_sock_fd,
+                                 HANDSHAKE_TIMEOUT*1000);
+        if (!client->tls){
+            close(cli_sock_fd);
+            if (limiter)
+                rl_release(limiter, client->addr);
+            release_client(client);
+            return FAILURE;
+        }
+    }
+
+    if (client->tls && tls_selected_h2(client->tls))
+        serve_http2(client, H2_DIRECT, NULL);
+    else {
+        status = receive_request(client, &req_attribs);
+        /*nor is one that reset the connection meanwhile, stat() and all*/
+        if (status == SUCCESS && peer_gone(client, TRUE))
+            status = CONECTION_CLOSED;
+        TRACE_PROBE1(webserver, parse_done, req_attribs.request);
+        TRACE_STAMP(client, TS_PARSED);
+        if (client->traced && req_attribs.request)
+            strncat(client->trace.name, (char*)req_attribs.request,
+                    TRACE_NAME_LEN-1);
+        if (status == SUCCESS)
+            upgrade = get_header(&req_attribs, "Upgrade");
 
-    status = receive_request(cli_sock_fd, &req_attribs);
-    if (status != CONECTION_CLOSED)
-        send_responce(cli_sock_fd, &req_attribs);
+        if (status == SUCCESS &&
+            strcmp((char*)req_attribs.request, H2_PRIOR_KNOWLEDGE_LINE) == 0)
+            serve_http2(client, H2_PRIOR_KNOWLEDGE, &req_attribs);
+        else if (status == SUCCESS && !client->tls && upgrade &&
+                 strncasecmp(upgrade, "h2c", 3) == 0 &&
+                 strncmp((char*)req_attribs.request, "GET ", 4) == 0)
+            serve_http2(client, H2_UPGRADE, &req_attribs);
+        else if (status == SUCCESS &&
+                 (route = find_route(client->server, &req_attribs))){
+            capture_request(client, (char*)req_attribs.request,
+                            req_attribs.headers);
+            serve_proxy(client, &req_attribs, route, start_us);
+        }
+        else if (status != CONECTION_CLOSED){
+            if (status == SUCCESS)
+                capture_request(client, (char*)req_attribs.request,
+                                req_attribs.headers);
+            /*parse_request() cuts the line in place, keeping a copy*/
+            if (client->server->log && req_attribs.request)
+                request_line = strdup((char*)req_attribs.request);
+            if (status == SUCCESS)
+                asset = find_asset(client->server, &req_attribs, &variant);
+            if (!asset ||
+                send_asset(client, &req_attribs, asset, variant) == FAILURE)
+                send_responce(client, &req_attribs);
+            client->bytes_sent += req_attribs.bytes_sent;
+            log_request(client, request_line, req_attribs.status,
+                        req_attribs.bytes_sent, start_us);
+        }
+        free(upgrade);
+        free(request_line);
+        free_request(&req_attribs);
+    }
     
+    if (client->tls){
+        tls_close(client->tls);
+        client->tls = NULL;
+    }
     close(cli_sock_fd);
+    if (limiter)
+        rl_release(limiter, client->addr);
+    if (client->traced)
+        tracer_write(client->server->tracer, &client->trace);
+    release_client(client);
     return SUCCESS;
 }
 
 //----------------------------------------------------------------------------//
-int receive_request(int sock_fd, request_attribs* req_attribs){
+/**
+ * the route whose prefix starts the request target, NULL if the request
+ * is served locally
+ */
+px_route* find_route(server_attribs* server, request_attribs* request){
+    char* target;
+    if (!server->px)
+        return NULL;
+    target = strchr((char*)request->request, ' ');
+    if (!target)
+        return NULL;
+    return proxy_match(server->px, target+1);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * relays the request to the route's upstream. when nothing could be
+ * relayed the error page is sent the usual way.
+ */
+int serve_proxy(client_attribs* client, request_attribs* request,
+                px_route* route, int64_t start_us){
+    char* line = (char*)request->request;
+    char* request_line = NULL;
+    char *target, *version;
+    char addr[INET_ADDRSTRLEN];
+    int status = 0, rc = BAD_REQUEST;
+    unsigned long bytes = 0;
+    px_request px_req;
+    px_io io;
+
+    if (client->server->log)
+        request_line = strdup(line);
+    target = strchr(line, ' ');
+    version = strrchr(line, ' ');
+    /*forwarding a cut head would send the upstream half a request*/
+    if (request->headers_complete && target != version &&
+        strncmp(version+1, "HTTP/1.", 7) == 0){
+        *target++ = '\0';
+        *version = '\0';
+        inet_ntop(AF_INET, &client->addr, addr, sizeof(addr));
+        px_req.method = line;
+        px_req.target = target;
+        px_req.headers = request->headers;
+        px_req.body_start = request->extra;
+        px_req.body_start_len = request->extra_len;
+        px_req.client_addr = addr;
+        io.ctx = client;
+        io.read = proxy_client_read;
+        io.write = proxy_client_write;
+        TRACE_STAMP(client, TS_RESOLVED);
+        rc = proxy_forward(route, &io, &px_req, &status, &bytes);
+    }
+    if (rc != PX_DONE){
+        request->status = rc;
+        send_responce(client, request);
+        status = request->status;
+        bytes = request->bytes_sent;
+    }
+    TRACE_STAMP(client, TS_BODY);
+    client->bytes_sent += bytes;
+    log_request(client, request_line, status, bytes, start_us);
+    free(request_line);
+    return rc == PX_DONE ? SUCCESS : FAILURE;
+}
+
+//----------------------------------------------------------------------------//
+ssize_t proxy_client_read(void* ctx, void* buf, size_t len){
+    return client_read((client_attribs*)ctx, buf, len);
+}
+
+//----------------------------------------------------------------------------//
+ssize_t proxy_client_write(void* ctx, const void* buf, size_t len){
+    return client_write((client_attribs*)ctx, buf, len);
+}
+
+//----------------------------------------------------------------------------//
+void log_request(client_attribs* client, const char* request, int status,
+                 unsigned long bytes, int64_t start_us){
+    al_record record;
+    if (!client->server->log)
+        return;
+    record.time_us = start_us;
+    record.addr = client->addr;
+    record.status = status;
+    record.bytes = bytes;
+    record.duration_us = (uint32_t)(al_now_us() - start_us);
+    snprintf(record.request, AL_REQ_LEN, "%s", request ? request : "");
+    al_write(client->server->log, &record);
+}
+
+//----------------------------------------------------------------------------//
+void capture_request(client_attribs* client, const char* line,
+                     const char* headers){
+    if (client->server->capture)
+        cap_request(client->server->capture, client->addr, client->id, line,
+                    headers);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * after a socket call failed: in coroutine mode sockets are non blocking
+ * and a call that would block waits here for the socket, letting the
+ * thread run other connections meanwhile. returns SUCCESS if the call
+ * should be made again.
+ */
+int client_wait(client_attribs* client, int events){
+    if (!client->server->loops || (errno != EAGAIN && errno != EWOULDBLOCK))
+        return FAILURE;
+    return co_wait_fd(client->sock_fd, events,
+                      events == CO_READ ? client->idle_ms : -1);
+}
+
+//----------------------------------------------------------------------------//
+ssize_t client_read(client_attribs* client, void* buf, size_t len){
+    ssize_t rc;
+    do {
+        if (client->tls)
+            rc = tls_read(client->tls, buf, len);
+        else
+            rc = read(client->sock_fd, buf, len);
+    } while (rc == -1 && client_wait(client, CO_READ) == SUCCESS);
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+ssize_t client_write(client_attribs* client, const void* buf, size_t len){
+    ssize_t wc;
+    if (client->over_budget){
+        errno = EDQUOT;
+        return -1;
+    }
+    do {
+        if (client->tls)
+            wc = tls_write(client->tls, buf, len);
+        else
+            wc = write(client->sock_fd, buf, len);
+    } while (wc == -1 && client_wait(client, CO_WRITE) == SUCCESS);
+    charge_client(client, wc);
+    return wc;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * charges bytes as they leave against the client's -b budget. once it is
+ * used up the response in progress is cut off, the next connection from
+ * the address is refused until the budget refilled.
+ */
+void charge_client(client_attribs* client, ssize_t sent){
+    ratelimit* limiter = client->server->limiter;
+    if (sent > 0 && limiter &&
+        !rl_consume_bytes(limiter, client->addr, (unsigned long)sent))
+        client->over_budget = TRUE;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * sends up to count bytes of file_fd starting at *offset and advances it.
+ * zero copy through sendfile() on plain sockets and on kTLS connections,
+ * otherwise the file is copied through a user space buffer.
+ */
+ssize_t client_sendfile(client_attribs* client, int file_fd, off_t* offset,
+                        size_t count){
+    unsigned char* filebuff;
+    ratelimit* limiter;
+    ssize_t rc, wc, sent = 0;
+
+    if (client->over_budget){
+        errno = EDQUOT;
+        return -1;
+    }
+    /*a single call sends no more than the whole budget*/
+    limiter = client->server->limiter;
+    if (limiter && limiter->byte_rate && count > limiter->byte_rate)
+        count = limiter->byte_rate;
+    if (client->tls){
+        do {
+            sent = tls_sendfile(client->tls, file_fd, offset, count);
+        } while (sent == -1 && client_wait(client, CO_WRITE) == SUCCESS);
+        charge_client(client, sent);
+        if (sent != -1 || errno != ENOTSUP)
+            return sent;
+        sent = 0;
+    }
+#ifdef __linux__
+    else {
+        do {
+            sent = sendfile(client->sock_fd, file_fd, offset, count);
+        } while (sent == -1 && client_wait(client, CO_WRITE) == SUCCESS);
+        charge_client(client, sent);
+        return sent;
+    }
+#endif
+
+    /*borrowed only for the copy, a coroutine stack stays shallow*/
+    filebuff = (unsigned char*)bp_get();
+    if (!filebuff)
+        return -1;
+    if (count > BP_BUF_SIZE)
+        count = BP_BUF_SIZE;
+    rc = pread(file_fd, filebuff, count, *offset);
+    while (rc > 0 && sent < rc) {
+        wc = client_write(client, filebuff+sent, rc-sent);
+        if (wc == -1){
+            bp_put(filebuff);
+            return -1;
+        }
+        sent += wc;
+    }
+    bp_put(filebuff);
+    if (rc <= 0)
+        return rc;
+    *offset += sent;
+    return sent;
+}
+
+//----------------------------------------------------------------------------//
+int receive_request(client_attribs* client, request_attribs* req_attribs){
     ssize_t rc;
     const int REQUEST_LINE = 4000;
-    int offset = 0, request_lenght = 0;
-    int r_found = FALSE;
-    int n_found = FALSE;
+    int offset = 0, request_lenght = 0, headers_end = 0, headers_start;
     int i;
-    unsigned char* request = (unsigned char*)malloc(REQUEST_LINE*sizeof(char));
+    /*borrowed once the client has sent something, back before returning*/
+    unsigned char* request = (unsigned char*)bp_get();
     if (!request)
         return FAILURE;
     
-    memset(request, '\0', REQUEST_LINE);
     while (TRUE) {
-        rc = read(sock_fd, request+offset, REQUEST_LINE-offset);
+        rc = client_read(client, request+offset, REQUEST_LINE-offset);
         if (rc < 0){
-            free(request);
+            bp_put(request);
             req_attribs->status = INTERNAL_ERROR;
             return FAILURE;
         } else if (rc == 0){
-            free(request);
+            if (request_lenght)
+                break; //client is done sending, take what we have
+            bp_put(request);
             return CONECTION_CLOSED;
         }
         offset += rc;
         
         
-        /*Checking if EOF terminator received
-         *loop running only for new data that received*/
-        for (i = (offset-(int)rc == 0 ? 0 : offset-(int)rc); i<rc; i++) {
-            if (request[i] == '\r')
-                r_found = TRUE;
-            else if (request[i] == '\n' && i>0 && request[i-1] == '\r')
-                n_found = TRUE;
-            
-            if (r_found && n_found){
+        /*Checking if the end of the request line and of the headers
+         *received, loop running only for new data that received*/
+        for (i = offset-(int)rc; i<offset; i++) {
+            if (request[i] != '\n' || i == 0 || request[i-1] != '\r')
+                continue;
+            if (!request_lenght)
                 request_lenght = i-1;
-                break; //EOF terminator received
+            else if (request[i-2] == '\n' && request[i-3] == '\r'){
+                headers_end = i+1;
+                break; //empty line after the headers received
             }
         }
         
-        /*EOF terminator received or maximal lenght of the line reached*/
-        if (request_lenght || offset == REQUEST_LINE)
+        /*headers received or maximal lenght of the request reached*/
+        if (headers_end || offset == REQUEST_LINE)
             break;
     }
+    req_attribs->headers_complete = headers_end != 0;
     
     if (!request_lenght) {
-        free(request);
+        bp_put(request);
         req_attribs->status = BAD_REQUEST;
         return FAILURE;
     }
     req_attribs->request = (unsigned char*)
                         malloc(((request_lenght)+1)*sizeof(char));
     if (!req_attribs->request){
-        free(request);
+        bp_put(request);
         req_attribs->status = INTERNAL_ERROR;
         return FAILURE;
     }
@@ -344,42 +1410,218 @@ int receive_request(int sock_fd, request_attribs* req_attribs){
         req_attribs->request[i] = request[i];
     
     req_attribs->request[request_lenght] = '\0';
+
+    /*header lines, keeping their "\r\n", without the closing empty line*/
+    headers_start = request_lenght+2;
+    if (!headers_end)
+        req_attribs->headers = strndup((char*)request+headers_start,
+                                       offset-headers_start);
+    else if (headers_end-2 > headers_start)
+        req_attribs->headers = strndup((char*)request+headers_start,
+                                       headers_end-2-headers_start);
+    else
+        req_attribs->headers = strdup("");
+
+    if (headers_end && headers_end < offset){
+        req_attribs->extra_len = offset-headers_end;
+        req_attribs->extra = (unsigned char*)malloc(req_attribs->extra_len);
+        if (req_attribs->extra)
+            memcpy(req_attribs->extra, request+headers_end,
+                   req_attribs->extra_len);
+        else
+            req_attribs->extra_len = 0;
+    }
     req_attribs->status = SUCCESS;
     
- 
-    free(request);
+ 
+    bp_put(request);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * value of the first header called name (case insensitive), without
+ * surrounding white space. returns an allocated string or NULL.
+ */
+char* get_header(request_attribs* request, const char* name){
+    size_t name_len = strlen(name), line_len;
+    char* line = request->headers;
+    char *eol, *value, *end;
+
+    while (line && *line) {
+        eol = strstr(line, R_EOL);
+        line_len = eol ? (size_t)(eol-line) : strlen(line);
+        if (line_len > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0){
+            value = line+name_len+1;
+            end = line+line_len;
+            while (value < end && (*value == ' ' || *value == '\t'))
+                value++;
+            while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+                end--;
+            return strndup(value, end-value);
+        }
+        line = eol ? eol+strlen(R_EOL) : NULL;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+void free_request(request_attribs* request){
+    int i;
+    if (request->path_args) {
+        for (i=0; i < request->argc; i++)
+            free(request->path_args[i]);
+        free(request->path_args);
+        request->path_args = NULL;
+    }
+    free(request->request);
+    free(request->headers);
+    free(request->extra);
+    free(request->query);
+    request->query = NULL;
+    request->request = NULL;
+    request->headers = NULL;
+    request->extra = NULL;
+}
+
+//----------------------------------------------------------------------------//
+int send_responce(client_attribs* client, request_attribs* request){
+    dbs_print("in send responce");
+
+    char* response_header = NULL;
+    ssize_t offset = 0, wc = 0, total_sent = 0;
+    off_t file_offset = 0;
+    bool_t connection_cl = FALSE;
+    response_attribs resp;
+    cio_sink sink;
+
+    build_response(client->server, request, &resp);
+    if (client->server->hot && (resp.file_fd != -1 || resp.shared))
+        hs_hit(client->server->hot, resp.path);
+    TRACE_STAMP(client, TS_RESOLVED);
+    response_header = build_resp_head(&resp.attr);
+    TRACE_PROBE2(webserver, headers_built, resp.attr.status,
+                 resp.attr.content_len);
+    TRACE_STAMP(client, TS_HEADERS);
+
+    ssize_t headers_size = strlen(response_header);
+    while (offset<headers_size) {
+        wc = client_write(client, response_header+offset,
+                          headers_size-offset);
+        if (wc == -1){
+            connection_cl = TRUE;
+            break;
+        }
+        offset += wc;
+    }
+    request->bytes_sent += offset;
+    offset = 0;
+    if (resp.content){
+        while (offset<resp.attr.content_len && !connection_cl) {
+            wc = client_write(client, resp.content+offset,
+                              resp.attr.content_len-offset);
+            if (wc == -1){
+                connection_cl = TRUE;
+                break;
+            }
+            offset += wc;
+        }
+        request->bytes_sent += offset;
+    }
+    else if (!connection_cl && is_cold(client->server, &resp)){
+        sink.ctx = client;
+        sink.write = cold_client_write;
+        sink.sendfile = cold_client_sendfile;
+        request->bytes_sent += cold_send(resp.path, resp.file_fd,
+                                         resp.attr.content_len, &sink);
+    }
+    else if (!connection_cl){
+        while (total_sent < resp.attr.content_len) {
+            wc = client_sendfile(client, resp.file_fd, &file_offset,
+                                 resp.attr.content_len-total_sent);
+            if (wc <= 0)
+                break; //client is gone or the file was truncated
+            total_sent += wc;
+        }
+        request->bytes_sent += total_sent;
+    }
+    
+    TRACE_PROBE2(webserver, body_done, resp.attr.status, request->bytes_sent);
+    TRACE_STAMP(client, TS_BODY);
+    free(response_header);
+    free_response(&resp);
+    dbs_print("at send responce finished to send data");
     return SUCCESS;
 }
 
 //----------------------------------------------------------------------------//
-int send_responce(int sock_fd, request_attribs* request){
-    dbs_print("in send responce");
+/**
+ * TRUE for a file large enough to push the small hot files out of the
+ * page cache that is itself not requested often
+ */
+bool_t is_cold(server_attribs* server, response_attribs* resp){
+    if (!server->cold_min || resp->file_fd == -1 ||
+        resp->attr.content_len < server->cold_min)
+        return FALSE;
+    return !server->hot || hs_hits(server->hot, resp->path) < COLD_HOT_HITS;
+}
 
-    char* response_header = NULL;
+//----------------------------------------------------------------------------//
+ssize_t cold_client_write(void* ctx, const void* buf, size_t len){
+    return client_write((client_attribs*)ctx, buf, len);
+}
+
+//----------------------------------------------------------------------------//
+ssize_t cold_client_sendfile(void* ctx, int file_fd, off_t* offset,
+                             size_t count){
+    return client_sendfile((client_attribs*)ctx, file_fd, offset, count);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * resolves the request into a status and a body: the content of an error
+ * page or a directory listing, or an open file. the result is protocol
+ * neutral, send_responce() and the HTTP/2 streams frame it themselves.
+ */
+int build_response(server_attribs* server, request_attribs* request,
+                   response_attribs* resp){
     char* temp_path = NULL;
     char* index_path = NULL;
     char* index = "index.html";
     unsigned char* content = NULL;
     int i=0;
     int errsv;
-    ssize_t offset = 0, wc = 0, total_sent = 0, rc = 0 ;
     struct stat statbuf;
     int flag = SUCCESS;
-    bool_t is_dir_content = FALSE, connection_cl = FALSE;
+    int parsed;
+    bool_t is_dir_content = FALSE;
     int data_flag = 0;
     int temp_path_len;
-    int file_fd = 0;
-    headers_attribs attr;
-    attr.content_len = 0;
-    attr.content_type = NULL;
-    attr.last_modified = NULL;
-    attr.path = NULL;
-    attr.status = request->status;
+    int file_fd = -1;
+    int format = DL_HTML;
+    headers_attribs* attr = &resp->attr;
+    attr->content_len = 0;
+    attr->content_type = NULL;
+    attr->last_modified = NULL;
+    attr->path = NULL;
+    attr->status = request->status;
+    resp->content = NULL;
+    resp->free_content = FALSE;
+    resp->file_fd = -1;
+    resp->path = NULL;
+    resp->shared = FALSE;
     
-    if (request->status == INTERNAL_ERROR || request->status == BAD_REQUEST)
+    /*an error decided before resolving, just the page is built*/
+    if (request->status >= BAD_REQUEST)
         flag = FAILURE;
     else
         flag = parse_request(request);
+    parsed = flag;
+
+    if (flag == NO_SLASH && server->shared &&
+        shared_response(server, request, resp) == SUCCESS)
+        return SUCCESS;
     
     if (flag == IS_DIR || flag == NO_SLASH){
         temp_path_len = request->path_lenght;
@@ -408,7 +1650,7 @@ int send_responce(int sock_fd, request_attribs* request){
                      && S_ISDIR(statbuf.st_mode)){
                 request->status = FOUND;
                 strcat(temp_path, "/");
-                attr.path = temp_path;
+                attr->path = temp_path;
                 flag = FAILURE;
                 break;
             }
@@ -470,7 +1712,7 @@ int send_responce(int sock_fd, request_attribs* request){
         else {
             request->status = OK;
             if(get_mime_type(temp_path))
-                attr.content_type = strdup(get_mime_type(temp_path));
+                attr->content_type = strdup(get_mime_type(temp_path));
             file_fd = open(temp_path, O_RDONLY,0);
             if (file_fd == -1){
                 request->status = INTERNAL_ERROR;
@@ -480,87 +1722,438 @@ int send_responce(int sock_fd, request_attribs* request){
     }
     
     if (flag != FAILURE){
-        char timebuf[TIMEBUF];
-        strftime(timebuf, TIMEBUF, RFC1123FMT, gmtime(&statbuf.st_mtime));
-        attr.last_modified = timebuf;
-        if (is_dir_content == TRUE)
-            content = (unsigned char*)get_directory_content(temp_path);
+        strftime(resp->last_modified, TIMEBUF, RFC1123FMT,
+                 gmtime(&statbuf.st_mtime));
+        attr->last_modified = resp->last_modified;
+        if (is_dir_content == TRUE){
+            format = listing_format(request);
+            content = (unsigned char*)get_directory_content(temp_path,
+                                                            request->query,
+                                                            format);
+            if (!content){
+                request->status = INTERNAL_ERROR;
+                flag = FAILURE;
+            } else {
+                resp->free_content = TRUE;
+                if (format == DL_JSON)
+                    attr->content_type = strdup("application/json");
+                else if (format == DL_NDJSON)
+                    attr->content_type = strdup("application/x-ndjson");
+            }
+        }
     }
-    else if (flag == FAILURE){
+    if (flag == FAILURE){
         content = (unsigned char*)get_response_content(request->status);
     }
     
     if (is_dir_content || flag == FAILURE){
-        attr.content_len = strlen((char*)content);
+        attr->content_len = strlen((char*)content);
     } else{
-        attr.content_len = (unsigned long)statbuf.st_size;
+        attr->content_len = (unsigned long)statbuf.st_size;
     }
-    attr.status = request->status;
-    response_header = build_resp_head(&attr);
+    attr->status = request->status;
+    resp->content = content;
+    resp->file_fd = file_fd;
+    resp->path = temp_path;
+    /*what the walk found is shared with the other workers*/
+    if (parsed == NO_SLASH && server->shared && file_fd != -1)
+        sc_put(server->shared, temp_path, &statbuf, file_fd);
+    TRACE_PROBE2(webserver, path_resolved, temp_path, attr->status);
+    return flag == FAILURE ? FAILURE : SUCCESS;
+}
 
-    signal(SIGPIPE, sigpipe_handler);
-    ssize_t headers_size = strlen(response_header);
-    while (offset<headers_size) {
-        wc = write(sock_fd, response_header+offset, headers_size-offset);
-        if (wc == -1){
-            connection_cl = TRUE;
-            break;
-        }
-        offset += wc;
+//----------------------------------------------------------------------------//
+/**
+ * fills resp from the shared cache when some worker resolved the file
+ * less than SC_MAX_AGE_MS ago. the walk down the path and its permission
+ * checks are skipped, and opening the file too when its content was
+ * kept. returns FAILURE on a miss, leaving resp as it was.
+ */
+int shared_response(server_attribs* server, request_attribs* request,
+                    response_attribs* resp){
+    headers_attribs* attr = &resp->attr;
+    unsigned char* body;
+    sc_meta meta;
+    char* path;
+    int i, file_fd = -1;
+
+    path = (char*)malloc(sizeof(char)*request->path_lenght);
+    if (!path)
+        return FAILURE;
+    path[0] = '\0';
+    for (i=0; i < request->argc; i++)
+        strcat(path, request->path_args[i]);
+    if (sc_get(server->shared, path, &meta, &body) == FAILURE){
+        free(path);
+        return FAILURE;
     }
-    offset = 0;
-    if (is_dir_content || flag == FAILURE){
-        while (offset<attr.content_len) {
-            wc = write(sock_fd, content+offset, attr.content_len-offset);
-            if (wc == -1){
-                connection_cl = TRUE;
-                break;
-            }
-            offset += wc;
+    if (!body){
+        file_fd = open(path, O_RDONLY, 0);
+        if (file_fd == -1){
+            free(path);
+            return FAILURE;
         }
     }
-    else {
-        
-        int filebuff_size = sizeof(char)*1024;
-        unsigned char* filebuff = (unsigned char*)malloc(filebuff_size);
-        while (total_sent < (unsigned long)statbuf.st_size && !connection_cl) {
-            rc = read(file_fd, filebuff, filebuff_size);
-            while (offset < rc) {
-                wc = write(sock_fd, filebuff+offset, rc-offset);
-                if (wc == -1){
-                    connection_cl = TRUE;
-                    break;
-                }
-                offset += wc;
-            }
-            total_sent += offset;
-            offset = 0;
+
+    request->status = OK;
+    attr->status = OK;
+    if (get_mime_type(path))
+        attr->content_type = strdup(get_mime_type(path));
+    strftime(resp->last_modified, TIMEBUF, RFC1123FMT, gmtime(&meta.mtime));
+    attr->last_modified = resp->last_modified;
+    attr->content_len = (unsigned long)meta.size;
+    resp->content = body;
+    resp->free_content = body != NULL;
+    resp->file_fd = file_fd;
+    resp->path = path;
+    resp->shared = TRUE;
+    TRACE_PROBE2(webserver, path_resolved, path, attr->status);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+void free_response(response_attribs* resp){
+    if (resp->free_content)
+        free(resp->content);
+    if (resp->file_fd != -1)
+        close(resp->file_fd);
+    if (resp->path)
+        free(resp->path);
+    if (resp->attr.content_type)
+        free(resp->attr.content_type);
+    resp->content = NULL;
+    resp->file_fd = -1;
+    resp->path = NULL;
+    resp->attr.content_type = NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the bundle entry of a GET request, if there is one. the path is taken
+ * as parse_request() would, "dir/" meaning "dir/index.html". anything
+ * else, directories without a slash included, is left to build_response().
+ */
+const bundle_entry* find_asset(server_attribs* server, request_attribs* request,
+                               int* variant){
+    char* line = (char*)request->request;
+    char key[ASSET_KEY_SIZE];
+    char *path, *end;
+    const bundle_entry* entry;
+    size_t len;
+
+    if (!server->assets || !line ||
+        (strncmp(line, "GET ", 4) != 0 && strncmp(line, "Get ", 4) != 0))
+        return NULL;
+    path = line+4;
+    end = strrchr(path, ' ');
+    if (!end || (strcmp(end+1, "HTTP/1.0") != 0 &&
+                 strcmp(end+1, "HTTP/1.1") != 0))
+        return NULL;
+    if (*path == '/')
+        path++;
+    len = strcspn(path, "?");
+    if (len > (size_t)(end-path))
+        len = end-path;
+    if (len+strlen("index.html") >= ASSET_KEY_SIZE)
+        return NULL;
+    memcpy(key, path, len);
+    if (len == 0 || key[len-1] == '/'){
+        memcpy(key+len, "index.html", strlen("index.html"));
+        len += strlen("index.html");
+    }
+
+    entry = bundle_lookup(server->assets, key, len);
+    if (!entry)
+        return NULL;
+    if (server->hot)
+        hs_hit(server->hot, bundle_string(server->assets, entry->path_off));
+    *variant = BUNDLE_IDENTITY;
+    if (entry->variants[BUNDLE_GZIP].headers_off && accepts_gzip(request))
+        *variant = BUNDLE_GZIP;
+    return entry;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * TRUE if Accept-Encoding lists gzip without "q=0"
+ */
+int accepts_gzip(request_attribs* request){
+    char* value = get_header(request, "Accept-Encoding");
+    char *token, *params, *saveptr, *q;
+    int accepted = FALSE;
+
+    for (token = value ? strtok_r(value, ",", &saveptr) : NULL; token;
+         token = strtok_r(NULL, ",", &saveptr)) {
+        while (*token == ' ' || *token == '\t')
+            token++;
+        params = strchr(token, ';');
+        if (strncasecmp(token, "gzip", 4) != 0 ||
+            (token[4] != '\0' && token[4] != ';' && token[4] != ' '))
+            continue;
+        q = params ? strstr(params, "q=") : NULL;
+        accepted = !q || strtod(q+2, NULL) > 0;
+        break;
+    }
+    free(value);
+    return accepted;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * sends a bundled file: a status line, Server and Date around the
+ * pre-rendered header lines, then the body through sendfile() from the
+ * bundle. returns FAILURE, with nothing sent, if the head does not fit.
+ */
+int send_asset(client_attribs* client, request_attribs* request,
+               const bundle_entry* entry, int variant){
+    bundle* assets = client->server->assets;
+    const bundle_variant* body = &entry->variants[variant];
+    char head[ASSET_HEAD_SIZE];
+    char timebuf[TIMEBUF];
+    off_t offset = (off_t)body->data_off;
+    ssize_t wc, sent = 0, headers_size;
+
+    TRACE_STAMP(client, TS_RESOLVED);
+    get_time(timebuf);
+    headers_size = snprintf(head, ASSET_HEAD_SIZE, R_HTTP "200 OK" R_EOL
+                            R_SERVER R_EOL R_DATE "%s" R_EOL "%s"
+                            R_CONNECTION R_EOL R_EOL,
+                            timebuf, bundle_string(assets, body->headers_off));
+    if (headers_size >= ASSET_HEAD_SIZE)
+        return FAILURE;
+    TRACE_PROBE2(webserver, headers_built, OK, body->data_len);
+    TRACE_STAMP(client, TS_HEADERS);
+
+    request->status = OK;
+    while (sent < headers_size) {
+        wc = client_write(client, head+sent, headers_size-sent);
+        if (wc == -1)
+            break;
+        sent += wc;
+    }
+    request->bytes_sent += sent;
+    if (sent < headers_size)
+        return SUCCESS; //client is gone
+    sent = 0;
+    while ((uint64_t)sent < body->data_len) {
+        wc = client_sendfile(client, assets->fd, &offset,
+                             body->data_len-sent);
+        if (wc <= 0)
+            break;
+        sent += wc;
+    }
+    request->bytes_sent += sent;
+    TRACE_PROBE2(webserver, body_done, OK, request->bytes_sent);
+    TRACE_STAMP(client, TS_BODY);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------HTTP/2--------------------------------------//
+//----------------------------------------------------------------------------//
+/**
+ * runs an HTTP/2 connection. request is the HTTP/1 request that led here
+ * (prior knowledge preface or h2c upgrade), NULL after ALPN.
+ */
+int serve_http2(client_attribs* client, int mode, request_attribs* request){
+    h2_callbacks callbacks;
+    h2_start start;
+    struct timeval idle = {H2_IDLE_TIMEOUT, 0};
+    char *settings = NULL, *line = NULL, *method = NULL, *path = NULL;
+    char* saveptr;
+    int one = 1, rc = FAILURE;
+
+    callbacks.ctx = client;
+    callbacks.read = h2_client_read;
+    callbacks.write = h2_client_write;
+    callbacks.sendfile = h2_client_sendfile;
+    callbacks.readable = h2_client_readable;
+    callbacks.request = h2_request;
+    callbacks.release = h2_release;
+    memset(&start, 0, sizeof(start));
+    start.mode = mode;
+    if (request){
+        start.preread = request->extra;
+        start.preread_len = request->extra_len;
+    }
+
+    if (mode == H2_UPGRADE){
+        settings = get_header(request, "HTTP2-Settings");
+        line = strdup((char*)request->request);
+        if (line){
+            method = strtok_r(line, " ", &saveptr);
+            path = strtok_r(NULL, " ", &saveptr);
         }
-        
-        
-        free(filebuff);
-        close(file_fd);
+        if (!settings || !method || !path ||
+            client_write(client, R_SWITCHING, strlen(R_SWITCHING)) <= 0){
+            free(settings);
+            free(line);
+            return FAILURE;
+        }
+        client->bytes_sent += strlen(R_SWITCHING);
+        start.settings = settings;
+        start.method = method;
+        start.path = path;
+        start.headers = request->headers;
     }
-    
-    signal(SIGPIPE, SIG_DFL);
-    if (request->path_args) {
-        for (i=0; i < request->argc; i++)
-            free(request->path_args[i]);
-        free(request->path_args);
+
+    /*connections stay open between requests, idle ones are dropped*/
+    setsockopt(client->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    client->idle_ms = H2_IDLE_TIMEOUT*1000;
+    setsockopt(client->sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    rc = h2_serve(&callbacks, &start);
+
+    free(settings);
+    free(line);
+    return rc;
+}
+
+//----------------------------------------------------------------------------//
+ssize_t h2_client_read(void* ctx, void* buf, size_t len){
+    return client_read((client_attribs*)ctx, buf, len);
+}
+
+//----------------------------------------------------------------------------//
+ssize_t h2_client_write(void* ctx, const void* buf, size_t len){
+    return client_write((client_attribs*)ctx, buf, len);
+}
+
+//----------------------------------------------------------------------------//
+ssize_t h2_client_sendfile(void* ctx, int file_fd, off_t* offset, size_t count){
+    return client_sendfile((client_attribs*)ctx, file_fd, offset, count);
+}
+
+//----------------------------------------------------------------------------//
+int h2_client_readable(void* ctx){
+    client_attribs* client = (client_attribs*)ctx;
+    struct pollfd pfd;
+    if (client->tls && tls_pending(client->tls))
+        return TRUE;
+    pfd.fd = client->sock_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * a new stream: the pseudo headers are turned back into an HTTP/1 request
+ * line, so the stream goes through the same build_response() path. every
+ * stream after the first is a request of its own against -r and -b, one
+ * over the limits is refused
+ */
+int h2_request(void* ctx, const char* method, const char* path,
+               const char* headers, h2_response* resp){
+    client_attribs* client = (client_attribs*)ctx;
+    h2_stream_attribs* stream;
+    headers_attribs* attr;
+    const bundle_entry* asset;
+    int variant;
+    size_t len = strlen(method)+strlen(path)+strlen(" HTTP/1.1")+2;
+
+    if (client->streams++ && client->server->limiter &&
+        (client->over_budget ||
+         rl_request(client->server->limiter, client->addr) != RL_ADMIT))
+        return H2_REFUSED;
+    stream = (h2_stream_attribs*)calloc(1, sizeof(h2_stream_attribs));
+    if (!stream)
+        return FAILURE;
+    stream->request.request = (unsigned char*)malloc(len);
+    stream->request.headers = strdup(headers ? headers : "");
+    if (!stream->request.request || !stream->request.headers){
+        free_request(&stream->request);
+        free(stream);
+        return FAILURE;
     }
-    if (is_dir_content == TRUE)
-        free(content);
-    if (temp_path)
-        free(temp_path);
-    if (attr.content_type){
-        free(attr.content_type);
+    snprintf((char*)stream->request.request, len, "%s %s HTTP/1.1",
+             method, path);
+    stream->request.status = SUCCESS;
+    capture_request(client, (char*)stream->request.request,
+                    stream->request.headers);
+    /*responses relayed from an upstream have no length up front*/
+    if (client->server->px && proxy_match(client->server->px, path))
+        stream->request.status = NOT_SUPPORTED;
+    if (client->server->log){
+        stream->start_us = al_now_us();
+        snprintf(stream->request_line, AL_REQ_LEN, "%s",
+                 (char*)stream->request.request);
     }
-    free(response_header);
-    free(request->request);
-    dbs_print("at send responce finished to send data");
+
+    stream->response.file_fd = -1;
+    asset = find_asset(client->server, &stream->request, &variant);
+    if (asset){
+        /*straight from the mapping, nothing is opened or resolved*/
+        attr = &stream->response.attr;
+        attr->status = OK;
+        attr->content_len = asset->variants[variant].data_len;
+        attr->last_modified = (char*)bundle_string(client->server->assets,
+                                                   asset->last_modified_off);
+        if (asset->mime_off)
+            attr->content_type = strdup(bundle_string(client->server->assets,
+                                                      asset->mime_off));
+        resp->body = client->server->assets->base +
+                     asset->variants[variant].data_off;
+    } else {
+        build_response(client->server, &stream->request, &stream->response);
+        attr = &stream->response.attr;
+        resp->body = stream->response.content;
+        if (client->server->hot && (stream->response.file_fd != -1 ||
+                                    stream->response.shared))
+            hs_hit(client->server->hot, stream->response.path);
+    }
+
+    get_time(stream->date);
+    snprintf(stream->content_len, TIMEBUF, "%lu", attr->content_len);
+    resp->status = attr->status;
+    resp->num_headers = 0;
+    resp->names[resp->num_headers] = "server";
+    resp->values[resp->num_headers++] = SERVER_NAME;
+    resp->names[resp->num_headers] = "date";
+    resp->values[resp->num_headers++] = stream->date;
+    if (attr->status != OK || attr->content_type){
+        resp->names[resp->num_headers] = "content-type";
+        resp->values[resp->num_headers++] = attr->status != OK ?
+                                            "text/html" : attr->content_type;
+    }
+    resp->names[resp->num_headers] = "content-length";
+    resp->values[resp->num_headers++] = stream->content_len;
+    if (attr->status == OK){
+        resp->names[resp->num_headers] = "last-modified";
+        resp->values[resp->num_headers++] = attr->last_modified;
+    }
+    if (attr->status == FOUND){
+        resp->names[resp->num_headers] = "location";
+        resp->values[resp->num_headers++] = attr->path;
+    }
+    if (asset && asset->variants[BUNDLE_GZIP].headers_off){
+        if (variant == BUNDLE_GZIP){
+            resp->names[resp->num_headers] = "content-encoding";
+            resp->values[resp->num_headers++] = "gzip";
+        }
+        resp->names[resp->num_headers] = "vary";
+        resp->values[resp->num_headers++] = "accept-encoding";
+    }
+
+    resp->file_fd = stream->response.file_fd;
+    resp->body_len = attr->content_len;
+    resp->opaque = stream;
     return SUCCESS;
 }
 
+//----------------------------------------------------------------------------//
+void h2_release(void* ctx, h2_response* resp){
+    client_attribs* client = (client_attribs*)ctx;
+    h2_stream_attribs* stream = (h2_stream_attribs*)resp->opaque;
+
+    client->bytes_sent += resp->bytes_sent;
+    log_request(client, stream->request_line, stream->response.attr.status,
+                resp->bytes_sent, stream->start_us);
+    free_response(&stream->response);
+    free_request(&stream->request);
+    free(stream);
+}
+
 //----------------------------------------------------------------------------//
 char* get_response_content(int status){
     if (status == FOUND)
@@ -578,9 +2171,18 @@ char* get_response_content(int status){
     else if (status == INTERNAL_ERROR)
         return "<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H4>500 Internal Server Error</H4>\nSome server side error.\n</BODY></HTML>";
     
+    else if (status == LENGTH_REQUIRED)
+        return "<HTML><HEAD><TITLE>411 Length Required</TITLE></HEAD>\n<BODY><H4>411 Length Required</H4>\nRequest body needs a Content-Length.\n</BODY></HTML>";
+    
     else if (status == NOT_SUPPORTED)
         return "<HTML><HEAD><TITLE>501 Not supported</TITLE></HEAD>\n<BODY><H4>501 Not supported</H4>\nMethod is not supported.\n</BODY></HTML>";
     
+    else if (status == BAD_GATEWAY)
+        return "<HTML><HEAD><TITLE>502 Bad Gateway</TITLE></HEAD>\n<BODY><H4>502 Bad Gateway</H4>\nUpstream server is not available.\n</BODY></HTML>";
+    
+    else if (status == GATEWAY_TIMEOUT)
+        return "<HTML><HEAD><TITLE>504 Gateway Timeout</TITLE></HEAD>\n<BODY><H4>504 Gateway Timeout</H4>\nUpstream server did not answer in time.\n</BODY></HTML>";
+    
     return NULL;
 }
 
@@ -654,9 +2256,21 @@ char* build_resp_head(headers_attribs* resp){
             phrase = strdup(" Internal Server Error");
             break;
         
+        case LENGTH_REQUIRED:
+            phrase = strdup(" Length Required");
+            break;
+            
         case NOT_SUPPORTED:
             phrase = strdup(" Not supported");
             break;
+            
+        case BAD_GATEWAY:
+            phrase = strdup(" Bad Gateway");
+            break;
+            
+        case GATEWAY_TIMEOUT:
+            phrase = strdup(" Gateway Timeout");
+            break;
     }
     headers_len += strlen(phrase);
     
@@ -714,7 +2328,7 @@ int parse_request(request_attribs* request_args){
     char* end = request+strlen(request)-strlen(http_1_0);
     int counter = 0, i, stat = IS_DIR;
     int path_len;
-    char* str_ptr, *saveptr, *tmp_ptr;
+    char* str_ptr, *saveptr, *tmp_ptr, *query;
     char* delim = "/";
     
     if ((strncmp(get, request, strlen(get)) != SUCCESS &&
@@ -729,6 +2343,15 @@ int parse_request(request_attribs* request_args){
     *request = '\0';    //cutting GET from the beginning of the request
     request++;
     *(--end) = '\0';    //cutting HTTP from the end of the request
+    query = strchr(request, '?');
+    if (query){
+        *query = '\0';  //cutting the query string from the path
+        request_args->query = strdup(query+1);
+    }
+    if (*request == '\0'){
+        request_args->status = BAD_REQUEST;
+        return FAILURE;
+    }
     if (*request == '/' && strlen(request) > 1)
         request++;
     path_len = (int)strlen(request);
@@ -768,118 +2391,505 @@ int parse_request(request_attribs* request_args){
 }
 
 //----------------------------------------------------------------------------//
-char* get_directory_content(char* path){
-    char* dircontent = NULL;
-    struct dirent **namelist;
-    int lines_number, i, j=0, k;
-    const int strings_size = 6;
-    bool_t internal_error = FALSE;
-    const int ROW_SIZE = 562;
-    char *item_path;
-    ssize_t size = 0;
+/**
+ * a page of the listing of path, see dirlist.h for the query parameters
+ */
+char* get_directory_content(char* path, const char* query, int format){
+    dl_query page;
+    unsigned long len;
+    dl_parse_query(query, format, &page);
+    return dl_render(path, &page, &len);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * listing format asked for by Accept, HTML unless JSON is named
+ */
+int listing_format(request_attribs* request){
+    char* accept = get_header(request, "Accept");
+    int format = DL_HTML;
+    if (accept && (strstr(accept, "application/x-ndjson") ||
+                   strstr(accept, "application/ndjson")))
+        format = DL_NDJSON;
+    else if (accept && strstr(accept, "application/json"))
+        format = DL_JSON;
+    free(accept);
+    return format;
+}
+
+//----------------------------------------------------------------------------//
+void dbs_print(char* msg){
+#ifdef P_DEBUG
+    printf("%s\n",msg);
+#endif
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * without SA_RESTART, so the signal interrupts accept() and the accepting
+ * thread acts on it
+ */
+void catch_signal(int signum){
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(signum, &action, NULL);
+}
+
+//----------------------------------------------------------------------------//
+void signal_handler(int signum){
+    if (signum == SIGUSR1)
+        report_requested = 1;
+    else if (signum == SIGUSR2)
+        upgrade_requested = 1;
+    else if (signum == SIGQUIT)
+        drain_requested = 1;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the listening socket handed over by upgrade_binary(), -1 if there is
+ * none
+ */
+int inherited_socket(void){
+    const char* text = getenv(LISTEN_FD_ENV);
     struct stat statbuf;
-    char timebuf[TIMEBUF];
-    char * strings[] = {"<HTML>\n<HEAD><TITLE>Index of ",
-                        "</TITLE></HEAD>\n\n",
-                        "<BODY>\n<H4>",
-                        "</H4>\n\n",
-                        "<table CELLSPACING=8>\n<th>Name</th><th>Last Modified</th><th>Size</th></tr>\n\n",
-                        "</table>\n\n<HR>\n\n<ADDRESS>webserver/1.1</ADDRESS>\n\n</BODY></HTML>"
-    };
-    char* row[] = {"<tr>\n<td><A HREF=\"",
-                    "\">",
-                    "</A></td><td>",
-                    "</td>\n<td>",
-                    "</td>\n</tr>\n\n"
-    };
-    
-  
-    memset(timebuf, '\0', TIMEBUF);
-    lines_number = scandir(path, &namelist, NULL, alphasort);
-    if (lines_number < 0 ){
-        return NULL;
+    int fd;
+    if (!text)
+        return FAILURE;
+    fd = atoi(text);
+    unsetenv(LISTEN_FD_ENV);
+    if (fstat(fd, &statbuf) == -1 || !S_ISSOCK(statbuf.st_mode))
+        return FAILURE;
+    return fd;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * tells the server that started this one by upgrade_binary() that it
+ * serves. every worker closes its copy of the channel, one writes to it.
+ */
+void notify_ready(bool_t writer){
+    const char* text = getenv(READY_FD_ENV);
+    int fd;
+    if (!text)
+        return;
+    fd = atoi(text);
+    unsetenv(READY_FD_ENV);
+    /*a worker restarted later finds the old server gone, no SIGPIPE*/
+    if (writer)
+        send(fd, "1", 1, MSG_NOSIGNAL);
+    close(fd);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the path execvp() would run name from, looked up in PATH when it has
+ * no slash. returns a malloc'ed path, NULL if there is none.
+ */
+char* find_binary(const char* name){
+    const char* dirs = getenv("PATH");
+    const char* end;
+    char* path;
+    size_t len;
+
+    if (strchr(name, '/'))
+        return strdup(name);
+    if (!dirs)
+        dirs = DEFAULT_PATH;
+    for (;;) {
+        end = strchr(dirs, ':');
+        len = end ? (size_t)(end-dirs) : strlen(dirs);
+        path = (char*)malloc(len+strlen(name)+3);
+        if (!path)
+            return NULL;
+        /*an empty entry is the current directory*/
+        sprintf(path, "%.*s/%s", (int)len, len ? dirs : ".", name);
+        if (access(path, X_OK) == 0)
+            return path;
+        free(path);
+        if (!end)
+            return NULL;
+        dirs = end+1;
     }
-    size = sizeof(char)*strlen(path)*2;
-    for (k=0; k<strings_size; k++)
-        size += sizeof(char)*strlen(strings[k]);
-    size += sizeof(char)*ROW_SIZE*lines_number;
-    
-    
-    dircontent = (char*)malloc(size);
-    if(!dircontent)
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the environment of the new binary: this one's, with the two handover
+ * variables set to listen_var and ready_var. the strings are shared, only
+ * the malloc'ed array is freed. NULL on allocation failure.
+ */
+char** upgrade_env(char* listen_var, char* ready_var){
+    size_t count = 0, i, j = 0;
+    char** envp;
+
+    while (environ[count])
+        count++;
+    envp = (char**)malloc((count+3)*sizeof(char*));
+    if (!envp)
         return NULL;
-    
-    strcpy(dircontent, strings[0]);
-    strcat(dircontent, path);
-    strcat(dircontent, strings[1]);
-    strcat(dircontent, strings[2]);
-    strcat(dircontent, path);
-    for (k=3; k<strings_size-1; k++)
-        strcat(dircontent, strings[k]);
-    
-    
-    for (i=0; i<lines_number; i++) {
-        item_path = (char*)malloc(sizeof(char)*
-                        ((strlen(path)+1)+(strlen(namelist[i]->d_name)+1)));
-        if (!item_path){
-            internal_error = TRUE;
-            j = i;
-            perror("malloc failed");
-            break;
-        }
-        strcpy(item_path, path);
-        strcat(item_path, namelist[i]->d_name);
-        if (stat(item_path, &statbuf) == -1){
-            perror("stat failure");
-            puts(item_path);
-            internal_error = TRUE;
-            j = i;
-            free(item_path);
-            break;
+    for (i=0; i<count; i++)
+        if (strncmp(environ[i], LISTEN_FD_ENV "=",
+                    strlen(LISTEN_FD_ENV)+1) != 0 &&
+            strncmp(environ[i], READY_FD_ENV "=",
+                    strlen(READY_FD_ENV)+1) != 0)
+            envp[j++] = environ[i];
+    envp[j++] = listen_var;
+    envp[j++] = ready_var;
+    envp[j] = NULL;
+    return envp;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * starts the binary at argv[0] again with the same arguments, handing it
+ * the listening socket. nothing but the socket and the ready channel is
+ * passed on, so connections of this server end when it closes them.
+ * returns SUCCESS once the new server reported it serves. on FAILURE,
+ * the new server failed or was too slow and was killed, this one keeps
+ * serving.
+ * the child of fork() only does what is safe in a threaded process: the
+ * path and environment are ready before, every other descriptor is marked
+ * close on exec with one close_range() call on Linux. elsewhere accepted
+ * connections are marked as they come, see the accept loop.
+ */
+int upgrade_binary(int sock_fd, const char* argv[]){
+    int ready[2];
+    char listen_var[sizeof(LISTEN_FD_ENV)+16];
+    char ready_var[sizeof(READY_FD_ENV)+16];
+    char byte;
+    char* path;
+    char** envp;
+    struct pollfd pfd;
+    sigset_t mask;
+    ssize_t rc = 0;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ready) == -1){
+        perror("Error on upgrade");
+        return FAILURE;
+    }
+    fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+    snprintf(listen_var, sizeof(listen_var), "%s=%d", LISTEN_FD_ENV, sock_fd);
+    snprintf(ready_var, sizeof(ready_var), "%s=%d", READY_FD_ENV, ready[1]);
+    path = find_binary(argv[0]);
+    envp = upgrade_env(listen_var, ready_var);
+    if (!path || !envp){
+        fprintf(stderr, "upgrade failed, %s not found\n", argv[0]);
+        free(path);
+        free(envp);
+        close(ready[0]);
+        close(ready[1]);
+        return FAILURE;
+    }
+
+    pid = fork();
+    if (pid == 0){
+        /*the prefork master runs with its signals blocked*/
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+#ifdef SYS_close_range
+        syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC);
+#endif
+        fcntl(sock_fd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        execve(path, (char* const*)argv, envp);
+        _exit(EXIT_FAILURE);
+    }
+    free(path);
+    free(envp);
+    close(ready[1]);
+    if (pid == -1){
+        perror("Error on upgrade fork");
+        close(ready[0]);
+        return FAILURE;
+    }
+
+    /*the new server accepts meanwhile, nothing is refused*/
+    pfd.fd = ready[0];
+    pfd.events = POLLIN;
+    while ((rc = poll(&pfd, 1, UPGRADE_TIMEOUT*1000)) == -1 && errno == EINTR);
+    if (rc == 1)
+        rc = read(ready[0], &byte, 1);
+    close(ready[0]);
+    if (rc == 1)
+        return SUCCESS;
+    fprintf(stderr, "upgrade failed, still serving\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return FAILURE;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * pf_upgrade_fn of the prefork master
+ */
+int upgrade_master(void* ctx){
+    upgrade_attribs* upgrade = (upgrade_attribs*)ctx;
+    return upgrade_binary(upgrade->sock_fd, upgrade->argv);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * waits up to drain_s seconds for the open connections to end. those
+ * still open then have their sockets shut down, their reads and writes
+ * fail and they wind up at once, a stalled download does not hold the
+ * exit. a connection closes its socket just before giving up its slot,
+ * so a descriptor reused in between may be shut down too. the server is
+ * going down then anyway.
+ */
+void drain_clients(server_attribs* attribs){
+    struct timespec deadline;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += attribs->drain_s;
+    pthread_mutex_lock(&attribs->clients_lock);
+    while (attribs->num_free < attribs->num_clients &&
+           pthread_cond_timedwait(&attribs->client_freed,
+                                  &attribs->clients_lock,
+                                  &deadline) != ETIMEDOUT);
+    if (attribs->num_free < attribs->num_clients)
+        fprintf(stderr, "%d connections still open after %d seconds, "
+                "cutting them\n", attribs->num_clients - attribs->num_free,
+                attribs->drain_s);
+    for (i=0; i<attribs->num_clients; i++)
+        if (attribs->clients[i].busy)
+            shutdown(attribs->clients[i].sock_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&attribs->clients_lock);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * what the open connections cost, written to stderr on SIGUSR1. an idle
+ * connection holds its slot and, under -E coroutines, a coroutine record
+ * without a stack. buffers and stacks are only held while a request is
+ * served.
+ */
+void memory_report(server_attribs* attribs){
+    co_loop_stats stats;
+    int i, open, running = 0, parked = 0, stacks = 0, pooled_stacks = 0;
+    unsigned long lent, pooled;
+#ifdef __linux__
+    long pages = 0, resident = 0;
+    FILE* statm;
+#endif
+
+    pthread_mutex_lock(&attribs->clients_lock);
+    open = attribs->num_clients - attribs->num_free;
+    pthread_mutex_unlock(&attribs->clients_lock);
+    for (i=0; i<attribs->num_loops; i++) {
+        co_stats(attribs->loops[i], &stats);
+        running += stats.running;
+        parked += stats.parked;
+        stacks += stats.stacks;
+        pooled_stacks += stats.pooled_stacks;
+    }
+    bp_stats(&lent, &pooled);
+
+    fprintf(stderr, "connections: %d open of %d slots, %zu bytes a slot\n",
+            open, attribs->num_clients, sizeof(client_attribs));
+    if (attribs->loops){
+        fprintf(stderr, "coroutines: %d running, %d waiting for a request, "
+                "%zu bytes each\n", running, parked, sizeof(coroutine));
+        fprintf(stderr, "stacks: %d mapped, %d idle, %d KiB each at most\n",
+                stacks, pooled_stacks, CORO_STACK_SIZE/1024);
+    }
+    fprintf(stderr, "buffers: %lu lent, %lu idle, %d bytes each\n",
+            lent, pooled, BP_BUF_SIZE);
+#ifdef __linux__
+    statm = fopen("/proc/self/statm", "r");
+    if (statm){
+        if (fscanf(statm, "%ld %ld", &pages, &resident) == 2)
+            fprintf(stderr, "resident: %ld KiB\n",
+                    resident * (sysconf(_SC_PAGESIZE)/1024));
+        fclose(statm);
+    }
+#endif
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * cheap refusal of a client: one non blocking send of a canned response
+ * (R_LIMITED for a limited client, R_REJECTED when the server cannot
+ * take it), no parsing and no pool thread involved
+ */
+void reject_client(int sock_fd, const char* response){
+    send(sock_fd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sock_fd);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * tuned for latency, -L: small writes leave at once instead of waiting
+ * for an ACK, and reads busy poll the device queue for up to the spin
+ * time before sleeping. raising the busy poll time above
+ * net.core.busy_read needs CAP_NET_ADMIN, without it the option is
+ * silently left out.
+ */
+void tune_socket(server_attribs* attribs, int sock_fd){
+    int one = 1;
+    if (!attribs->spin_us)
+        return;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_BUSY_POLL
+    setsockopt(sock_fd, SOL_SOCKET, SO_BUSY_POLL, &attribs->spin_us,
+               sizeof(attribs->spin_us));
+#endif
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * takes a connection slot off the free list, waiting for a connection
+ * to end if all of them are in use. a signal does not end the wait, its
+ * flag is looked at every REAP_INTERVAL_MS. returns NULL when an upgrade
+ * or a drain was asked for meanwhile, the caller acts on it.
+ */
+client_attribs* acquire_client(server_attribs* attribs){
+    client_attribs* client;
+    struct timespec deadline;
+    pthread_mutex_lock(&attribs->clients_lock);
+    while (!attribs->free_clients) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += REAP_INTERVAL_MS*1000000L;
+        if (deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
-        strcat(dircontent, row[0]);
-        strcat(dircontent,namelist[i]->d_name);
-        strcat(dircontent, row[1]);
-        strcat(dircontent,namelist[i]->d_name);
-        strcat(dircontent, row[2]);
-        
-        strftime(timebuf, TIMEBUF, RFC1123FMT, gmtime(&statbuf.st_mtime));
-        strcat(dircontent, timebuf);
-        strcat(dircontent, row[3]);
-        if(S_ISREG(statbuf.st_mode)){
-            char* file_size = (char*)malloc(sizeof(char)*TIMEBUF);
-            sprintf(file_size, "%lu", (unsigned long)statbuf.st_size);
-            strcat(dircontent, file_size);
-            free(file_size);
+        if (pthread_cond_timedwait(&attribs->client_freed,
+                                   &attribs->clients_lock,
+                                   &deadline) != ETIMEDOUT)
+            continue;
+        pthread_mutex_unlock(&attribs->clients_lock);
+        if (upgrade_requested || drain_requested)
+            return NULL;
+        if (report_requested){
+            report_requested = 0;
+            memory_report(attribs);
         }
-        strcat(dircontent, row[4]);
-        free(namelist[i]);
-        free(item_path);
+        /*coroutines are never queued, there is nothing to take back*/
+        if (!attribs->loops)
+            reap_clients(attribs);
+        pthread_mutex_lock(&attribs->clients_lock);
     }
-    
-    strcat(dircontent, strings[5]);
-    
-    if (internal_error) {
-        for (; j < lines_number; j++){
-            free(namelist[j]);
-        }
-        free(dircontent);
-        free(namelist);
-        return NULL;
+    client = attribs->free_clients;
+    attribs->free_clients = client->next;
+    attribs->num_free--;
+    client->busy = TRUE;
+    pthread_mutex_unlock(&attribs->clients_lock);
+    client->next = NULL;
+    return client;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * frees the slots of queued connections whose client is gone, their jobs
+ * are cancelled before a thread spends anything on them. called by the
+ * accepting thread, the only one queueing jobs. returns the slots freed.
+ */
+int reap_clients(server_attribs* attribs){
+    client_attribs* client;
+    int i, reaped = 0;
+    for (i=0; i<attribs->num_clients; i++) {
+        client = &attribs->clients[i];
+        if (__atomic_load_n(&client->work.state, __ATOMIC_ACQUIRE) !=
+            JOB_QUEUED || !peer_gone(client, FALSE) ||
+            cancel_job(&client->work) == FAILURE)
+            continue;
+        close(client->sock_fd);
+        if (attribs->limiter)
+            rl_release(attribs->limiter, client->addr);
+        release_client(client);
+        reaped++;
     }
-    
-    free(namelist);
-    return dircontent;
+    return reaped;
 }
 
 //----------------------------------------------------------------------------//
-void dbs_print(char* msg){
-#ifdef P_DEBUG
-    printf("%s\n",msg);
+/**
+ * TRUE if the connection was reset, or the client closed its side with
+ * no request bytes left to read. a client may half close right after its
+ * request and still wait for the response, so once the request was read
+ * (request_read) only a reset counts.
+ */
+bool_t peer_gone(client_attribs* client, bool_t request_read){
+    struct pollfd pfd;
+    char byte;
+
+    pfd.fd = client->sock_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0)
+        return FALSE;
+    if (pfd.revents & (POLLERR | POLLNVAL))
+        return TRUE;
+#ifdef __linux__
+    /*both directions are shut, a half close alone is only POLLIN. other
+     systems raise POLLHUP at the end of the input too*/
+    if (pfd.revents & POLLHUP)
+        return TRUE;
 #endif
+    if (request_read)
+        return FALSE;
+    return recv(client->sock_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
 }
 
-void sigpipe_handler(int signum){
-    fprintf(stderr, "sigpipe received");
+//----------------------------------------------------------------------------//
+void release_client(client_attribs* client){
+    server_attribs* attribs = client->server;
+    pthread_mutex_lock(&attribs->clients_lock);
+    client->next = attribs->free_clients;
+    attribs->free_clients = client;
+    attribs->num_free++;
+    client->busy = FALSE;
+    pthread_cond_signal(&attribs->client_freed);
+    pthread_mutex_unlock(&attribs->clients_lock);
 }
 
+//----------------------------------------------------------------------------//
+/**
+ * warms the page cache for a path of the saved hot set. bundled files
+ * have their pages of the mapping read in, others get a read ahead of
+ * the whole file. both return at once, the kernel reads in the background.
+ */
+void prefetch_file(void* ctx, const char* path){
+    server_attribs* attribs = (server_attribs*)ctx;
+    const bundle_entry* entry;
+    const unsigned char* start;
+    struct stat statbuf;
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t off;
+    int i, fd;
+#ifdef F_RDADVISE
+    struct radvisory advice;
+#endif
+
+    if (attribs->assets &&
+        (entry = bundle_lookup(attribs->assets, path, strlen(path)))){
+        for (i=0; i<BUNDLE_VARIANTS; i++) {
+            if (!entry->variants[i].data_len)
+                continue;
+            off = entry->variants[i].data_off & ~(uint64_t)(page-1);
+            start = attribs->assets->base+off;
+            madvise((void*)start, entry->variants[i].data_off-off +
+                    entry->variants[i].data_len, MADV_WILLNEED);
+        }
+        return;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode)){
+#ifdef F_RDADVISE
+        advice.ra_offset = 0;
+        advice.ra_count = (int)statbuf.st_size;
+        fcntl(fd, F_RDADVISE, &advice);
+#else
+        posix_fadvise(fd, 0, statbuf.st_size, POSIX_FADV_WILLNEED);
+#endif
+    }
+    close(fd);
+}
@@ -0,0 +1,225 @@
+//
+//  shmcache.c
+//  ex_3
+//
+
+#include "shmcache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TRUE 1
+#define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+#define SC_READ_TRIES 4 //copies of a busy slot tried before giving up
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static uint32_t path_hash(const char* path);
+static sc_slot* first_way(shcache* cache, uint32_t hash);
+static int read_slot(sc_slot* slot, uint32_t hash, const char* path,
+                     sc_meta* meta, unsigned char** body, int64_t* checked);
+static int lock_slot(sc_slot* slot, uint32_t* seq);
+static int same_file(const sc_meta* meta, const struct stat* statbuf);
+static int64_t now_ms(void);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+shcache* create_shcache(void){
+    /*zero filled, every slot unused. pages are only backed once touched*/
+    shcache* cache = (shcache*)mmap(NULL, sizeof(shcache),
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED)
+        return NULL;
+    return cache;
+}
+
+//----------------------------------------------------------------------------//
+int sc_get(shcache* cache, const char* path, sc_meta* meta,
+           unsigned char** body){
+    uint32_t hash = path_hash(path);
+    sc_slot* slot = first_way(cache, hash);
+    int64_t checked;
+    int i;
+
+    if (strlen(path) >= SC_PATH_LEN)
+        return FAILURE;
+    for (i=0; i<SC_WAYS; i++, slot++) {
+        if (read_slot(slot, hash, path, meta, body, &checked) == FAILURE)
+            continue;
+        if (now_ms() - checked < SC_MAX_AGE_MS){
+            atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+            return SUCCESS;
+        }
+        free(*body);
+        *body = NULL;
+        break;
+    }
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+    return FAILURE;
+}
+
+//----------------------------------------------------------------------------//
+void sc_put(shcache* cache, const char* path, const struct stat* statbuf,
+            int fd){
+    uint32_t hash = path_hash(path);
+    sc_slot* slot = first_way(cache, hash);
+    sc_slot* victim = NULL;
+    uint32_t seq;
+    int64_t now = now_ms();
+    ssize_t rc;
+    int i;
+
+    if (strlen(path) >= SC_PATH_LEN)
+        return;
+    for (i=0; i<SC_WAYS; i++) {
+        if (slot[i].hash == hash &&
+            strncmp(slot[i].path, path, SC_PATH_LEN) == 0){
+            victim = &slot[i];
+            break;
+        }
+        if (!victim || slot[i].stored_ms < victim->stored_ms)
+            victim = &slot[i];
+    }
+    if (lock_slot(victim, &seq) == FAILURE)
+        return;
+
+    if (victim->hash == hash && strcmp(victim->path, path) == 0 &&
+        same_file(&victim->meta, statbuf)){
+        /*nothing a reader copies changed, the old seq stays valid*/
+        atomic_store_explicit(&victim->checked_ms, now, memory_order_relaxed);
+        atomic_store_explicit(&victim->seq, seq, memory_order_release);
+        return;
+    }
+    victim->hash = hash;
+    strcpy(victim->path, path);
+    victim->meta.dev = statbuf->st_dev;
+    victim->meta.ino = statbuf->st_ino;
+    victim->meta.size = statbuf->st_size;
+    victim->meta.mtime = statbuf->st_mtime;
+    victim->meta.mtime_nsec = MTIME_NSEC(*statbuf);
+    victim->body_len = -1;
+    if (statbuf->st_size <= SC_MAX_BODY){
+        rc = pread(fd, victim->body, (size_t)statbuf->st_size, 0);
+        if (rc == statbuf->st_size)
+            victim->body_len = (int32_t)rc;
+    }
+    victim->stored_ms = now;
+    atomic_store_explicit(&victim->checked_ms, now, memory_order_relaxed);
+    atomic_store_explicit(&victim->seq, seq+2, memory_order_release);
+}
+
+//----------------------------------------------------------------------------//
+void destroy_shcache(shcache* cache){
+    if (cache)
+        munmap(cache, sizeof(shcache));
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * FNV-1a, never 0 so a used slot is told from a free one
+ */
+static uint32_t path_hash(const char* path){
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+//----------------------------------------------------------------------------//
+static sc_slot* first_way(shcache* cache, uint32_t hash){
+    return &cache->slots[hash & (SC_SLOTS-1) & ~(SC_WAYS-1)];
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * a consistent copy of the slot if it holds path. the copy may see a
+ * writer's half done work, it is thrown away when seq tells so.
+ */
+static int read_slot(sc_slot* slot, uint32_t hash, const char* path,
+                     sc_meta* meta, unsigned char** body, int64_t* checked){
+    uint32_t seq;
+    int32_t len;
+    int tries;
+
+    *body = NULL;
+    for (tries=0; tries<SC_READ_TRIES; tries++) {
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+        if (slot->hash != hash || strncmp(slot->path, path, SC_PATH_LEN) != 0){
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+                return FAILURE;
+            continue;
+        }
+        *meta = slot->meta;
+        *checked = atomic_load_explicit(&slot->checked_ms,
+                                        memory_order_relaxed);
+        len = slot->body_len;
+        if (len >= 0 && len <= SC_MAX_BODY){
+            *body = (unsigned char*)malloc(len ? len : 1);
+            if (!*body)
+                return FAILURE;
+            memcpy(*body, slot->body, len);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+            return SUCCESS;
+        free(*body);
+        *body = NULL;
+    }
+    return FAILURE;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * makes seq odd if no one else holds the slot. *seq is set to the even
+ * value the slot had. a process killed while holding a slot leaves it
+ * taken, it is then never used again.
+ */
+static int lock_slot(sc_slot* slot, uint32_t* seq){
+    uint32_t old = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if (old & 1)
+        return FAILURE;
+    if (!atomic_compare_exchange_strong_explicit(&slot->seq, &old, old+1,
+                                                 memory_order_acquire,
+                                                 memory_order_relaxed))
+        return FAILURE;
+    /*the writes to the slot stay after the odd seq*/
+    atomic_thread_fence(memory_order_release);
+    *seq = old;
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+static int same_file(const sc_meta* meta, const struct stat* statbuf){
+    return meta->dev == statbuf->st_dev && meta->ino == statbuf->st_ino &&
+           meta->size == statbuf->st_size &&
+           meta->mtime == statbuf->st_mtime &&
+           meta->mtime_nsec == MTIME_NSEC(*statbuf);
+}
+
+//----------------------------------------------------------------------------//
+static int64_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
@@ -0,0 +1,94 @@
+//
+//  shmcache.h
+//  ex_3
+//
+
+#ifndef shmcache_h
+#define shmcache_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// slots in the table, must be a power of two
+#define SC_SLOTS 2048
+// slots a path may be kept in, a power of two not above SC_SLOTS
+#define SC_WAYS 4
+// longest path kept, the terminating '\0' included
+#define SC_PATH_LEN 256
+// largest body kept, larger files only have their metadata kept
+#define SC_MAX_BODY 8192
+// milliseconds a resolved file is trusted without looking at the disk
+#define SC_MAX_AGE_MS 1000
+
+
+/**
+ * what is known about a resolved file
+ */
+typedef struct _sc_meta {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+} sc_meta;
+
+
+/**
+ * a cached file. seq is a seqlock: odd while a writer changes the slot,
+ * readers copy the slot and retry if seq moved meanwhile. checked is
+ * refreshed in place, without taking the slot.
+ */
+typedef struct _sc_slot {
+    _Atomic uint32_t seq;
+    uint32_t hash;                  //0 - the slot was never used
+    _Atomic int64_t checked_ms;     //last time the file was found unchanged
+    int64_t stored_ms;              //for replacing the oldest slot
+    sc_meta meta;
+    int32_t body_len;               //-1 - metadata only
+    char path[SC_PATH_LEN];
+    unsigned char body[SC_MAX_BODY];
+} sc_slot;
+
+
+/**
+ * The table, in a shared mapping that forked processes inherit
+ */
+typedef struct _shcache_st {
+    _Atomic unsigned long hits;
+    _Atomic unsigned long misses;
+    sc_slot slots[SC_SLOTS];
+} shcache;
+
+
+/**
+ * create_shcache maps a new table shared with the processes forked
+ * after it. returns NULL on failure.
+ */
+shcache* create_shcache(void);
+
+/**
+ * sc_get looks path up without taking any lock. a hit is a file checked
+ * less than SC_MAX_AGE_MS ago: its metadata is copied to meta and *body
+ * is set to a malloc'd copy of its content, or NULL if only the metadata
+ * was kept. returns -1 on a miss.
+ */
+int sc_get(shcache* cache, const char* path, sc_meta* meta,
+           unsigned char** body);
+
+/**
+ * sc_put records path as resolved to the file open as fd, just checked.
+ * an unchanged file is only marked fresh, a new or changed one is
+ * stored, its content read from fd if it fits. a slot another process
+ * is writing is left alone.
+ */
+void sc_put(shcache* cache, const char* path, const struct stat* statbuf,
+            int fd);
+
+/**
+ * destroy_shcache unmaps the table
+ */
+void destroy_shcache(shcache* cache);
+
+#endif /* shmcache_h */
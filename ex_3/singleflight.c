@@ -0,0 +1,65 @@
+//
+//  singleflight.c
+//  ex_3
+//
+
+#include "singleflight.h"
+#include <stdlib.h>
+#include <string.h>
+
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+void* sf_do(sf_group* group, const char* key, sf_work_fn work,
+            sf_share_fn share, void* arg){
+    sf_call *call, **link;
+    void* result;
+
+    pthread_mutex_lock(&group->lock);
+    for (call = group->calls; call; call = call->next)
+        if (strcmp(call->key, key) == 0)
+            break;
+
+    if (call){
+        /*following, the leader waits for every share to be taken*/
+        call->waiters++;
+        while (!call->done)
+            pthread_cond_wait(&call->cond, &group->lock);
+        result = call->result ? share(call->result, arg) : NULL;
+        if (--call->waiters == 0)
+            pthread_cond_broadcast(&call->cond);
+        pthread_mutex_unlock(&group->lock);
+        return result;
+    }
+
+    call = (sf_call*)calloc(1, sizeof(sf_call));
+    if (call)
+        call->key = strdup(key);
+    if (!call || !call->key){
+        /*no coalescing, still correct*/
+        pthread_mutex_unlock(&group->lock);
+        free(call);
+        return work(key, arg);
+    }
+    pthread_cond_init(&call->cond, NULL);
+    call->next = group->calls;
+    group->calls = call;
+    pthread_mutex_unlock(&group->lock);
+
+    result = work(key, arg);
+
+    pthread_mutex_lock(&group->lock);
+    for (link = &group->calls; *link != call; link = &(*link)->next);
+    *link = call->next;     //later callers start a new call
+    call->result = result;
+    call->done = 1;
+    pthread_cond_broadcast(&call->cond);
+    while (call->waiters)
+        pthread_cond_wait(&call->cond, &group->lock);
+    pthread_mutex_unlock(&group->lock);
+
+    pthread_cond_destroy(&call->cond);
+    free(call->key);
+    free(call);
+    return result;
+}
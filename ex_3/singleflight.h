@@ -0,0 +1,55 @@
+//
+//  singleflight.h
+//  ex_3
+//
+
+#ifndef singleflight_h
+#define singleflight_h
+
+#include <pthread.h>
+
+// static initializer of a group
+#define SF_GROUP_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, NULL}
+
+
+/**
+ * builds the result for key, arg as given to sf_do() by the leader
+ */
+typedef void* (*sf_work_fn)(const char* key, void* arg);
+
+/**
+ * a follower's own reference to the leader's result, called while the
+ * leader still holds it
+ */
+typedef void* (*sf_share_fn)(void* result, void* arg);
+
+
+typedef struct _sf_call {
+    char* key;
+    void* result;
+    int done;
+    int waiters;                //followers not yet holding their share
+    pthread_cond_t cond;
+    struct _sf_call* next;
+} sf_call;
+
+
+/**
+ * Work in flight, at most one call per key. the calls are few, as many
+ * as there are workers at the most, a list does.
+ */
+typedef struct _sf_group {
+    pthread_mutex_t lock;
+    sf_call* calls;
+} sf_group;
+
+
+/**
+ * sf_do returns work(key, arg) if no other thread is building key, else
+ * waits for that thread and returns share(its result, arg). a NULL
+ * result is given to the followers as NULL, share is not called.
+ */
+void* sf_do(sf_group* group, const char* key, sf_work_fn work,
+            sf_share_fn share, void* arg);
+
+#endif /* singleflight_h */
@@ -0,0 +1,144 @@
+//
+//  strand_check.c
+//  ex_3
+//
+//  Drives the strands of threadpool.c: jobs of a key must run in dispatch
+//  order and never two at once, and a strand destroyed while it still has
+//  jobs must let them finish first.
+//  cc -o strand_check strand_check.c threadpool.c trace.c -pthread
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "threadpool.h"
+
+#define USAGE "Usage: strand_check [threads] [jobs]\n"
+#define SUCCESS 0
+#define FAILURE -1
+#define DEFAULT_THREADS 4
+#define DEFAULT_JOBS 200000
+#define KEYS 64
+
+typedef struct _key_state {
+    long next;                  //sequence number the next job must have
+    _Atomic int running;        //jobs of the key running right now
+} key_state;
+
+typedef struct _check_job {
+    key_state* key;
+    long seq;
+} check_job;
+
+static _Atomic long out_of_order;
+static _Atomic long overlapping;
+static _Atomic long done;
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static int check(void* arg);
+static long run_keyed(threadpool* pool, long jobs);
+static long run_strand(threadpool* pool, long jobs);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+int main(int argc, const char* argv[]){
+    int threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    long jobs = argc > 2 ? atol(argv[2]) : DEFAULT_JOBS;
+    long keyed_done, strand_done;
+
+    if (threads <= 0 || jobs <= 0){
+        printf(USAGE);
+        return FAILURE;
+    }
+    threadpool* pool = create_threadpool(threads);
+    if (!pool){
+        perror("Error on creating pool");
+        return FAILURE;
+    }
+    keyed_done = run_keyed(pool, jobs);
+    strand_done = run_strand(pool, jobs);
+    destroy_threadpool(pool);
+
+    printf("dispatch_keyed: %ld/%ld jobs over %d keys\n", keyed_done, jobs,
+           KEYS);
+    printf("strand: %ld/%ld jobs done before destroy_strand returned\n",
+           strand_done, jobs);
+    printf("out of order: %ld, overlapping: %ld\n",
+           atomic_load(&out_of_order), atomic_load(&overlapping));
+    return keyed_done == jobs && strand_done == jobs &&
+           !atomic_load(&out_of_order) && !atomic_load(&overlapping) ?
+                                                        SUCCESS : FAILURE;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * a job of a key: any other job of the key running at the same time, or
+ * one that should have run first and did not, is counted
+ */
+static int check(void* arg){
+    check_job* job = (check_job*)arg;
+    key_state* key = job->key;
+
+    if (atomic_fetch_add(&key->running, 1) != 0)
+        atomic_fetch_add(&overlapping, 1);
+    if (key->next != job->seq)
+        atomic_fetch_add(&out_of_order, 1);
+    key->next = job->seq+1;
+    atomic_fetch_sub(&key->running, 1);
+    atomic_fetch_add(&done, 1);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * spreads the jobs over KEYS keys. the pool keeps running for the next
+ * run, so the jobs are waited for by their count
+ */
+static long run_keyed(threadpool* pool, long jobs){
+    key_state keys[KEYS] = {{0}};
+    check_job* list = (check_job*)malloc(jobs*sizeof(check_job));
+    long i;
+    if (!list)
+        return 0;
+
+    atomic_store(&done, 0);
+    for (i=0; i<jobs; i++) {
+        list[i].key = &keys[i % KEYS];
+        list[i].seq = i / KEYS;
+        dispatch_keyed(pool, (unsigned long)(i % KEYS), check, &list[i]);
+    }
+    while (atomic_load(&done) < jobs)
+        sched_yield();
+    free(list);
+    return atomic_load(&done);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * one private strand, destroyed right after the last dispatch while most
+ * of its jobs are still queued
+ */
+static long run_strand(threadpool* pool, long jobs){
+    key_state key = {0};
+    check_job* list = (check_job*)malloc(jobs*sizeof(check_job));
+    strand* s = create_strand(pool);
+    long i;
+    if (!list || !s){
+        free(list);
+        destroy_strand(s);
+        return 0;
+    }
+
+    atomic_store(&done, 0);
+    for (i=0; i<jobs; i++) {
+        list[i].key = &key;
+        list[i].seq = i;
+        strand_dispatch(s, check, &list[i]);
+    }
+    destroy_strand(s);
+    free(list);
+    return atomic_load(&done);
+}
@@ -6,19 +6,52 @@
 //  Copyright © 2017 Eliyah Weinberg. All rights reserved.
 //
 
+#ifdef __linux__
+#define _GNU_SOURCE //pthread_attr_setaffinity_np()
+#include <sched.h>
+#endif
 #include "threadpool.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #define EMPTY 0
 #define TRUE 1
 #define FALSE 0
+#define SUCCESS 0
+#define FAILURE -1
+#define SPIN_CLOCK_EVERY 64 //polls of the queue between two clock reads
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do {} while (0)
+#endif
 
 //#define P_DEBUG
 //----------------------------------------------------------------------------//
 //------------------------PRIVATE FUNCTION DECLARATION------------------------//
 //----------------------------------------------------------------------------/
 void db_print(char* msg);
+static int set_affinity(pthread_attr_t* attr, const threadpool_options* options,
+                        int index);
+static int enqueue(threadpool* pool, dispatch_fn routine, void* arg,
+                   job* handle, const unsigned long* key, long cost_us);
+static void queue_flow(threadpool* pool, work_t* work, unsigned long key,
+                       long cost_us);
+static work_t* take_work(threadpool* pool);
+static work_t* take_fair(threadpool* pool);
+static long next_cost(pool_flow* flow);
+static work_t* unlink_job(threadpool* pool, job* handle);
+static long elapsed_us(const struct timespec* start);
+static void init_strand(strand* s, threadpool* pool);
+static void clear_strand(strand* s);
+static int run_strand(void* arg);
+static void spin_wait(threadpool* pool, int* spin_us);
 //----------------------------------------------------------------------------//
 //----------------------FUNCTIONS IMPLEMENTATION------------------------------//
 //----------------------------------------------------------------------------//
@@ -27,6 +60,19 @@ void db_print(char* msg);
  * pool.  If the function succeeds, it returns a (non-NULL)
  * "threadpool", else it returns NULL */
 threadpool* create_threadpool(int num_threads_in_pool){
+    threadpool_options options = {num_threads_in_pool, NULL, 0, FALSE, 0,
+                                  FALSE};
+    return create_threadpool_ex(&options);
+}
+
+
+/**
+ * create_threadpool_ex creates a pool whose threads are bound to the
+ * given CPUs, see threadpool.h
+ */
+threadpool* create_threadpool_ex(const threadpool_options* options){
+    int num_threads_in_pool = options->num_threads;
+    pthread_attr_t attr;
     if (num_threads_in_pool > MAXT_IN_POOL || num_threads_in_pool < 1)
         return NULL;
     threadpool* pool = (threadpool*)malloc(sizeof(threadpool));
@@ -39,6 +85,20 @@ threadpool* create_threadpool(int num_threads_in_pool){
     pool->qsize = EMPTY;
     pool->qhead = NULL;
     pool->qtail = NULL;
+    pool->spin_us = options->spin_us;
+    pool->max_spinners = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (pool->max_spinners > POOL_MAX_SPINNERS)
+        pool->max_spinners = POOL_MAX_SPINNERS;
+    pool->spinning = 0;
+    pool->ring_head = pool->ring_tail = NULL;
+    pool->flows = NULL;
+    if (options->fair){
+        pool->flows = (pool_flow*)calloc(POOL_FLOWS, sizeof(pool_flow));
+        if (!pool->flows){
+            free(pool);
+            return NULL;
+        }
+    }
     pthread_mutex_init(&pool->qlock, NULL);
     pthread_cond_init(&pool->q_empty, NULL);
     pthread_cond_init(&pool->q_not_empty, NULL);
@@ -48,8 +108,19 @@ threadpool* create_threadpool(int num_threads_in_pool){
         return NULL;
 
     int i;
-    for (i=0; i<num_threads_in_pool; i++)
-        pthread_create(pool->threads+i, NULL, do_work, pool);
+    for (i=0; i<POOL_STRANDS; i++)
+        init_strand(&pool->strands[i], pool);
+    for (i=0; i<num_threads_in_pool; i++){
+        if (options->cpus && options->num_cpus > 0 &&
+            pthread_attr_init(&attr) == 0){
+            if (set_affinity(&attr, options, i) != 0 ||
+                pthread_create(pool->threads+i, &attr, do_work, pool) != 0)
+                pthread_create(pool->threads+i, NULL, do_work, pool);
+            pthread_attr_destroy(&attr);
+        }
+        else
+            pthread_create(pool->threads+i, NULL, do_work, pool);
+    }
 
     return pool;
 }
@@ -67,26 +138,201 @@ void dispatch(threadpool* pool, dispatch_fn dispatch_to_here, void *arg){
     if (pool->dont_accept == TRUE)
         return;
 
+    enqueue(pool, dispatch_to_here, arg, NULL, NULL, 0);
+}
+
+
+/**
+ * dispatch_job queues a job that cancel_job() can take back until a
+ * thread picks it
+ */
+int dispatch_job(threadpool* pool, job* handle,
+                 dispatch_fn dispatch_to_here, void *arg){
+    if (!pool || pool->dont_accept == TRUE)
+        return FAILURE;
+    if (enqueue(pool, dispatch_to_here, arg, handle, NULL, 0) == FAILURE){
+        handle->state = JOB_IDLE;
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * dispatch_flow queues the job on the flow of its key, keys sharing a
+ * flow by hash share its time
+ */
+int dispatch_flow(threadpool* pool, job* handle, unsigned long key,
+                  long cost_us, dispatch_fn dispatch_to_here, void *arg){
+    if (!pool || pool->dont_accept == TRUE)
+        return FAILURE;
+    if (enqueue(pool, dispatch_to_here, arg, handle, &key,
+                cost_us) == FAILURE){
+        if (handle)
+            handle->state = JOB_IDLE;
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * cancel_job and the picking thread both change the state under qlock,
+ * a job still queued is unlinked right away. left in the queue it would
+ * run with the handle once the caller reuses it for another job.
+ */
+int cancel_job(job* handle){
+    threadpool* pool = handle->pool;
+    work_t* work;
+    if (!pool)
+        return FAILURE;
+    pthread_mutex_lock(&pool->qlock);
+    if (handle->state != JOB_QUEUED){
+        pthread_mutex_unlock(&pool->qlock);
+        return FAILURE;
+    }
+    work = unlink_job(pool, handle);
+    __atomic_store_n(&handle->state, JOB_CANCELLED, __ATOMIC_RELEASE);
+    /*destroy_threadpool() may be waiting for the queue to empty*/
+    if (pool->qsize == EMPTY && pool->dont_accept == TRUE)
+        pthread_cond_signal(&pool->q_empty);
+    pthread_mutex_unlock(&pool->qlock);
+    free(work);
+    return SUCCESS;
+}
+
+
+/**
+ * dispatch_keyed runs jobs of the same key in order and one at a time.
+ * keys are spread over the pool's strands, two keys sharing a strand are
+ * only serialized more than needed.
+ */
+void dispatch_keyed(threadpool* pool, unsigned long key,
+                    dispatch_fn dispatch_to_here, void *arg){
+    if (!pool)
+        return;
+    key ^= (key >> 7) ^ (key >> 17);
+    strand_dispatch(&pool->strands[key % POOL_STRANDS], dispatch_to_here, arg);
+}
+
+
+/**
+ * create_strand returns a strand running its jobs on pool
+ */
+strand* create_strand(threadpool* pool){
+    strand* s;
+    if (!pool)
+        return NULL;
+    s = (strand*)malloc(sizeof(strand));
+    if (s)
+        init_strand(s, pool);
+    return s;
+}
+
+
+/**
+ * strand_dispatch queues the job on the strand. an idle strand is
+ * queued to the pool, a busy one picks the job up when it gets there.
+ */
+void strand_dispatch(strand* s, dispatch_fn dispatch_to_here, void *arg){
+    int schedule;
+    if (!s || s->pool->dont_accept == TRUE)
+        return;
 
     work_t* new_work = (work_t*)malloc(sizeof(work_t));
     if (!new_work)
         return;
-
     new_work->routine = dispatch_to_here;
     new_work->arg = arg;
+    new_work->handle = NULL;
+    new_work->next = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->tail)
+        s->tail->next = new_work;
+    else
+        s->head = new_work;
+    s->tail = new_work;
+    schedule = !s->scheduled;
+    s->scheduled = TRUE;
+    pthread_mutex_unlock(&s->lock);
+
+    if (schedule && enqueue(s->pool, run_strand, s, NULL, NULL, 0) == FAILURE){
+        /*the pool is going down, the strand's jobs are dropped*/
+        clear_strand(s);
+        pthread_mutex_lock(&s->lock);
+        s->scheduled = FALSE;
+        pthread_cond_broadcast(&s->idle);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+
+/**
+ * destroy_strand frees the strand once it is idle. a scheduled strand is
+ * still referenced by its job in the pool queue or by the thread running
+ * it, freeing it before that job returns would leave them a dangling
+ * pointer.
+ */
+void destroy_strand(strand* s){
+    if (!s)
+        return;
+    pthread_mutex_lock(&s->lock);
+    while (s->scheduled)
+        pthread_cond_wait(&s->idle, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    clear_strand(s);
+    pthread_cond_destroy(&s->idle);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+
+/**
+ * enqueue adds a job to the pool queue, or with a key to the key's flow
+ * in a fair pool. FAILURE once the pool is being destroyed
+ */
+static int enqueue(threadpool* pool, dispatch_fn routine, void* arg,
+                   job* handle, const unsigned long* key, long cost_us){
+    work_t* new_work = (work_t*)malloc(sizeof(work_t));
+    if (!new_work)
+        return FAILURE;
+
+    new_work->routine = routine;
+    new_work->arg = arg;
+    new_work->handle = handle;
+    new_work->flow = NULL;
+    new_work->cost_us = 0;
     new_work->next = NULL;
     /*locking mutex for adding new work to the working queue*/
     pthread_mutex_lock(&pool->qlock);
+    if (pool->dont_accept == TRUE){
+        pthread_mutex_unlock(&pool->qlock);
+        free(new_work);
+        return FAILURE;
+    }
 
-    if(pool->qsize == EMPTY)
+    if (handle){
+        handle->pool = pool;
+        __atomic_store_n(&handle->state, JOB_QUEUED, __ATOMIC_RELEASE);
+    }
+    if (key && pool->flows)
+        queue_flow(pool, new_work, *key, cost_us);
+    else if(!pool->qtail)
         pool->qhead = pool->qtail = new_work;
     else{
         pool->qtail->next = new_work;
         pool->qtail = new_work;
     }
     pool->qsize++;
-    pthread_cond_signal(&pool->q_not_empty);
+    TRACE_PROBE1(threadpool, dispatch, arg);
+    /*a spinning thread takes the job without being woken*/
+    if (pool->spinning > 0)
+        pool->spinning--;
+    else
+        pthread_cond_signal(&pool->q_not_empty);
     pthread_mutex_unlock(&pool->qlock);
+    return SUCCESS;
 }
 
 /**
@@ -95,15 +341,33 @@ void dispatch(threadpool* pool, dispatch_fn dispatch_to_here, void *arg){
 void* do_work(void* p){
     threadpool* pool = (threadpool*)p;
     work_t* new_work;
+    int spin_us = pool->spin_us;
+    pool_flow* ran_flow = NULL;
+    struct timespec started;
+    long ran_us = 0;
 
     while (TRUE) {
         pthread_mutex_lock(&pool->qlock);
+        /*the last job's time goes to its flow's average*/
+        if (ran_flow){
+            if (ran_us > POOL_MAX_COST_US)
+                ran_us = POOL_MAX_COST_US;
+            if (ran_flow->avg_cost_us)
+                ran_flow->avg_cost_us += (ran_us - ran_flow->avg_cost_us) /
+                                         POOL_COST_WEIGHT;
+            else
+                ran_flow->avg_cost_us = ran_us;
+            ran_flow = NULL;
+        }
         if (pool->shutdown == TRUE){
             pthread_mutex_unlock(&pool->qlock);
             break;
         }
 
         /*Checking if there is works in queue*/
+        if (pool->qsize == EMPTY && pool->dont_accept == FALSE &&
+            spin_us > 0 && pool->spinning < pool->max_spinners)
+            spin_wait(pool, &spin_us);
 
         while (pool->qsize == EMPTY && pool->dont_accept == FALSE){
             pthread_cond_wait(&pool->q_not_empty, &pool->qlock);
@@ -121,16 +385,23 @@ void* do_work(void* p){
         }
 
         /*taking new work from the queue*/
-        new_work = pool->qhead;
-        if (pool->qsize == 1)
-            pool->qhead = pool->qtail = NULL;
-        else
-            pool->qhead = new_work->next;
-
-        pool->qsize--;
+        new_work = take_work(pool);
+        /*cancelled jobs are unlinked, anything still queued runs*/
+        if (new_work->handle)
+            __atomic_store_n(&new_work->handle->state, JOB_RUNNING,
+                             __ATOMIC_RELEASE);
 
         pthread_mutex_unlock(&pool->qlock);
+        TRACE_PROBE1(threadpool, pickup, new_work->arg);
+        if (new_work->flow)
+            clock_gettime(CLOCK_MONOTONIC, &started);
         new_work->routine(new_work->arg);
+        if (new_work->flow){
+            ran_flow = new_work->flow;
+            ran_us = elapsed_us(&started);
+            if (ran_us < 1)
+                ran_us = 1; //0 stands for not measured
+        }
         free(new_work);
     }
 
@@ -164,14 +435,312 @@ void destroy_threadpool(threadpool* pool){
        pthread_join(pool->threads[i], NULL);
     }
 
+    for(i=0; i<POOL_STRANDS; i++){
+        clear_strand(&pool->strands[i]);
+        pthread_cond_destroy(&pool->strands[i].idle);
+        pthread_mutex_destroy(&pool->strands[i].lock);
+    }
     pthread_mutex_destroy(&pool->qlock);
     pthread_cond_destroy(&pool->q_empty);
     pthread_cond_destroy(&pool->q_not_empty);
 
+    free(pool->flows);
     free(pool->threads);
     free(pool);
 }
 
+//----------------------------------------------------------------------------//
+static int set_affinity(pthread_attr_t* attr, const threadpool_options* options,
+                        int index){
+#ifdef __linux__
+    cpu_set_t set;
+    int i;
+    CPU_ZERO(&set);
+    if (options->pin_each)
+        CPU_SET(options->cpus[index % options->num_cpus], &set);
+    else
+        for (i=0; i<options->num_cpus; i++)
+            CPU_SET(options->cpus[i], &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+#else
+    return -1; //only affinity hints exist on macOS
+#endif
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * called with qlock held. a flow getting its first job joins the back of
+ * the ring without credit, a flow does not save up while it is idle.
+ */
+static void queue_flow(threadpool* pool, work_t* work, unsigned long key,
+                       long cost_us){
+    pool_flow* flow;
+    key ^= (key >> 7) ^ (key >> 17);
+    flow = &pool->flows[key % POOL_FLOWS];
+    work->flow = flow;
+    work->cost_us = cost_us <= 0 ? 0 :
+                    cost_us > POOL_MAX_COST_US ? POOL_MAX_COST_US : cost_us;
+    if (flow->tail)
+        flow->tail->next = work;
+    else
+        flow->head = work;
+    flow->tail = work;
+    if (flow->active)
+        return;
+    flow->active = TRUE;
+    flow->deficit_us = 0;
+    flow->next = NULL;
+    if (pool->ring_tail)
+        pool->ring_tail->next = flow;
+    else
+        pool->ring_head = flow;
+    pool->ring_tail = flow;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * called with qlock and a job queued. jobs queued without a flow first,
+ * they are the pool's own (strands, loops) and short
+ */
+static work_t* take_work(threadpool* pool){
+    work_t* work = pool->qhead;
+    if (work){
+        pool->qhead = work->next;
+        if (!pool->qhead)
+            pool->qtail = NULL;
+    } else
+        work = take_fair(pool);
+    pool->qsize--;
+    return work;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * deficit round robin. the flow at the head of the ring starts its next
+ * job if its deficit covers the job's cost, else it is credited a quantum
+ * and goes to the back. rounds in which no flow could start anything
+ * are credited in one step, so a pick walks the ring at most twice
+ * however costly the jobs are.
+ */
+static work_t* take_fair(threadpool* pool){
+    pool_flow* flow;
+    work_t* work;
+    long cost_us, rounds, fewest = 0;
+
+    for (flow = pool->ring_head; flow; flow = flow->next) {
+        rounds = (next_cost(flow) - flow->deficit_us + POOL_QUANTUM_US-1) /
+                 POOL_QUANTUM_US;
+        if (rounds <= 0){
+            fewest = 0;
+            break;
+        }
+        if (!fewest || rounds < fewest)
+            fewest = rounds;
+    }
+    if (fewest)
+        for (flow = pool->ring_head; flow; flow = flow->next)
+            flow->deficit_us += fewest*POOL_QUANTUM_US;
+
+    while ((flow = pool->ring_head)) {
+        work = flow->head;
+        cost_us = next_cost(flow);
+        if (flow->deficit_us < cost_us){
+            flow->deficit_us += POOL_QUANTUM_US;
+            pool->ring_head = flow->next;
+            flow->next = NULL;
+            pool->ring_tail->next = flow;
+            pool->ring_tail = flow;
+            continue;
+        }
+        flow->deficit_us -= cost_us;
+        flow->head = work->next;
+        work->next = NULL;
+        if (!flow->head){
+            /*an emptied flow leaves the ring and its credit*/
+            flow->tail = NULL;
+            flow->active = FALSE;
+            flow->deficit_us = 0;
+            pool->ring_head = flow->next;
+            if (!pool->ring_head)
+                pool->ring_tail = NULL;
+            flow->next = NULL;
+        }
+        return work;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the cost of the flow's next job, estimated as late as possible. a flow
+ * not measured yet gets a job a round.
+ */
+static long next_cost(pool_flow* flow){
+    work_t* work = flow->head;
+    return work->cost_us ? work->cost_us :
+           flow->avg_cost_us ? flow->avg_cost_us : POOL_QUANTUM_US;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * called with qlock held. finds the work of handle in the queue or on the
+ * ring and takes it out, an emptied flow leaves the ring. NULL if it is
+ * in neither.
+ */
+static work_t* unlink_job(threadpool* pool, job* handle){
+    pool_flow* flow;
+    pool_flow* prev_flow = NULL;
+    work_t* work;
+    work_t* prev = NULL;
+
+    for (work = pool->qhead; work; prev = work, work = work->next) {
+        if (work->handle != handle)
+            continue;
+        if (prev)
+            prev->next = work->next;
+        else
+            pool->qhead = work->next;
+        if (pool->qtail == work)
+            pool->qtail = prev;
+        pool->qsize--;
+        return work;
+    }
+
+    for (flow = pool->ring_head; flow; prev_flow = flow, flow = flow->next) {
+        for (prev = NULL, work = flow->head; work;
+             prev = work, work = work->next) {
+            if (work->handle != handle)
+                continue;
+            if (prev)
+                prev->next = work->next;
+            else
+                flow->head = work->next;
+            if (flow->tail == work)
+                flow->tail = prev;
+            if (!flow->head){
+                if (prev_flow)
+                    prev_flow->next = flow->next;
+                else
+                    pool->ring_head = flow->next;
+                if (pool->ring_tail == flow)
+                    pool->ring_tail = prev_flow;
+                flow->next = NULL;
+                flow->active = FALSE;
+                flow->deficit_us = 0;
+            }
+            pool->qsize--;
+            return work;
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+static long elapsed_us(const struct timespec* start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec-start->tv_sec)*1000000L +
+           (now.tv_nsec-start->tv_nsec)/1000;
+}
+
+//----------------------------------------------------------------------------//
+static void init_strand(strand* s, threadpool* pool){
+    s->pool = pool;
+    s->head = s->tail = NULL;
+    s->scheduled = FALSE;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->idle, NULL);
+}
+
+//----------------------------------------------------------------------------//
+static void clear_strand(strand* s){
+    work_t* work;
+    pthread_mutex_lock(&s->lock);
+    while ((work = s->head)) {
+        s->head = work->next;
+        free(work);
+    }
+    s->tail = NULL;
+    pthread_mutex_unlock(&s->lock);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * the pool job of a strand: runs its jobs in order until it is empty.
+ * after STRAND_BATCH jobs the strand goes to the back of the pool queue,
+ * a busy key does not keep a thread from the rest. while the pool is
+ * being destroyed it drains in place instead.
+ */
+static int run_strand(void* arg){
+    strand* s = (strand*)arg;
+    work_t* work;
+    int ran = 0;
+
+    while (TRUE) {
+        pthread_mutex_lock(&s->lock);
+        work = s->head;
+        if (!work){
+            s->scheduled = FALSE;
+            pthread_cond_broadcast(&s->idle);
+            pthread_mutex_unlock(&s->lock);
+            return SUCCESS;
+        }
+        if (ran == STRAND_BATCH){
+            pthread_mutex_unlock(&s->lock);
+            if (enqueue(s->pool, run_strand, s, NULL, NULL, 0) == SUCCESS)
+                return SUCCESS;
+            ran = 0;
+            continue;
+        }
+        s->head = work->next;
+        if (!s->head)
+            s->tail = NULL;
+        pthread_mutex_unlock(&s->lock);
+
+        work->routine(work->arg);
+        free(work);
+        ran++;
+    }
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * called and returning with qlock held. polls the queue without the lock
+ * for up to *spin_us. the spin doubles when a job came meanwhile and is
+ * halved when it did not, so threads of an idle pool soon spin little.
+ * jobs dispatched while a thread spins skip the wakeup, one job per
+ * spinning thread, which is why the count is only ever taken down.
+ */
+static void spin_wait(threadpool* pool, int* spin_us){
+    struct timespec start, now;
+    long elapsed_us = 0;
+    int polls = 0;
+
+    pool->spinning++;
+    pthread_mutex_unlock(&pool->qlock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (__atomic_load_n(&pool->qsize, __ATOMIC_RELAXED) == EMPTY &&
+           __atomic_load_n(&pool->dont_accept, __ATOMIC_RELAXED) == FALSE) {
+        cpu_relax();
+        if (++polls % SPIN_CLOCK_EVERY != 0)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_us = (now.tv_sec-start.tv_sec)*1000000L +
+                     (now.tv_nsec-start.tv_nsec)/1000;
+        if (elapsed_us >= *spin_us)
+            break;
+    }
+    pthread_mutex_lock(&pool->qlock);
+    if (pool->spinning > 0)
+        pool->spinning--;
+
+    if (pool->qsize != EMPTY)
+        *spin_us = *spin_us*2 > pool->spin_us ? pool->spin_us : *spin_us*2;
+    else
+        *spin_us = *spin_us/2 < POOL_SPIN_MIN_US ? POOL_SPIN_MIN_US :
+                                                   *spin_us/2;
+}
+
 //----------------------------------------------------------------------------//
 void db_print(char* msg){
 #ifdef P_DEBUG
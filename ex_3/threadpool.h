@@ -13,6 +13,43 @@
 
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
+// strands of a pool used by dispatch_keyed(), keys share them by hash
+#define POOL_STRANDS 64
+// jobs a strand runs before letting other work have the thread
+#define STRAND_BATCH 16
+// shortest spin of an idle thread in microseconds, with spinning on
+#define POOL_SPIN_MIN_US 2
+// idle threads spinning at once, the others sleep right away. never
+// more than the online CPUs less one, a spinner must not take the CPU
+// the dispatching thread needs
+#define POOL_MAX_SPINNERS 4
+// flow queues of a fair pool, keys share them by hash
+#define POOL_FLOWS 256
+// microseconds of work a waiting flow is credited per round
+#define POOL_QUANTUM_US 500
+// runs a flow's average job cost is spread over, the newest counts 1/8
+#define POOL_COST_WEIGHT 8
+// longest job cost in microseconds a flow is charged, measured or given
+#define POOL_MAX_COST_US 1000000
+
+// states of a job, see dispatch_job()
+#define JOB_IDLE 0          //never dispatched
+#define JOB_QUEUED 1        //waiting in the queue
+#define JOB_RUNNING 2       //taken by a thread, it may be done already
+#define JOB_CANCELLED 3     //cancelled before it ran, it never will
+
+
+struct _threadpool_st;
+
+/**
+ * handle of a cancellable job. it is the caller's, and must stay valid
+ * until the job runs or was cancelled. the pool does not touch it once
+ * the routine was called, so it can live in the memory the routine frees.
+ */
+typedef struct _job_st {
+    int state;
+    struct _threadpool_st* pool;    //where it was queued last
+} job;
 
 
 /**
@@ -21,10 +58,44 @@
 typedef struct work_st{
     int (*routine) (void*);  //the threads process function
     void * arg;  //argument to the function
+    job* handle;    //NULL unless dispatched by dispatch_job()
+    struct _pool_flow* flow;    //NULL unless dispatched by dispatch_flow()
+    long cost_us;   //what the job is expected to take, 0 - the flow's
+                    //average. fair pools only
     struct work_st* next;
 } work_t;
 
 
+/**
+ * the jobs of one flow key in a fair pool. a flow with jobs is on the
+ * pool's ring and starts a job once its deficit covers the job's cost,
+ * every round it waits adds POOL_QUANTUM_US.
+ */
+typedef struct _pool_flow {
+    work_t* head;
+    work_t* tail;
+    long deficit_us;
+    long avg_cost_us;   //measured run time of its jobs, moving average
+    struct _pool_flow* next;    //ring link
+    int active;         //1 while on the ring
+} pool_flow;
+
+
+/**
+ * A serial queue on top of a pool: its jobs run one after another, in
+ * dispatch order, on whatever pool thread is free. no thread waits for
+ * a busy strand, the strand is a job in the pool queue while it has work.
+ */
+typedef struct _strand_st {
+    struct _threadpool_st* pool;
+    work_t* head;
+    work_t* tail;
+    int scheduled;          //1 while the strand is queued or running
+    pthread_mutex_t lock;
+    pthread_cond_t idle;    //signaled when scheduled drops to 0
+} strand;
+
+
 /**
  * The actual pool
  */
@@ -39,6 +110,13 @@ typedef struct _threadpool_st {
     pthread_cond_t q_empty;
     int shutdown;            //1 if the pool is in distruction process
     int dont_accept;       //1 if destroy function has begun
+    int spin_us;            //longest spin of an idle thread, 0 - none
+    int max_spinners;
+    int spinning;           //spinning threads no job was handed to yet
+    strand strands[POOL_STRANDS];   //for dispatch_keyed()
+    pool_flow* flows;       //POOL_FLOWS of them, NULL unless fair
+    pool_flow* ring_head;   //flows with jobs, in round robin order
+    pool_flow* ring_tail;
 } threadpool;
 
 
@@ -50,6 +128,19 @@ typedef struct _threadpool_st {
 
 typedef int (*dispatch_fn)(void *);
 
+
+/**
+ * placement of the pool threads
+ */
+typedef struct _threadpool_options {
+    int num_threads;
+    const int* cpus;    //CPUs the threads may run on, NULL - anywhere
+    int num_cpus;
+    int pin_each;       //1 - thread i runs on cpus[i % num_cpus] only
+    int spin_us;        //0 - idle threads sleep at once
+    int fair;           //1 - dispatch_flow() jobs are queued fairly
+} threadpool_options;
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -57,6 +148,20 @@ typedef int (*dispatch_fn)(void *);
  */
 threadpool* create_threadpool(int num_threads_in_pool);
 
+/**
+ * create_threadpool_ex creates a pool whose threads are bound to the
+ * given CPUs. memory the threads touch first is then allocated on their
+ * NUMA node. binding is best effort, a thread the system refuses to bind
+ * runs unbound, and it is not supported on macOS.
+ * with spin_us set, a thread out of work polls the queue for up to
+ * spin_us microseconds before sleeping, so a job dispatched meanwhile
+ * starts without a wakeup. each thread adapts its spin between
+ * POOL_SPIN_MIN_US and spin_us to how often spinning paid off.
+ * with fair set, jobs of dispatch_flow() are queued per flow key and
+ * served by deficit round robin, see dispatch_flow().
+ */
+threadpool* create_threadpool_ex(const threadpool_options* options);
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
@@ -65,6 +170,60 @@ threadpool* create_threadpool(int num_threads_in_pool);
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * dispatch_job is dispatch() for a job that may be cancelled while it
+ * waits in the queue, handle tracks it. returns -1 if the job was not
+ * queued.
+ */
+int dispatch_job(threadpool* from_me, job* handle,
+                 dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * cancel_job takes a queued job out of its pool. returns 0 if it was
+ * cancelled, the pool then holds nothing of it and the handle can be
+ * dispatched again, and -1 if a thread took it already.
+ */
+int cancel_job(job* handle);
+
+/**
+ * dispatch_flow queues a job of the flow key. in a fair pool every flow
+ * with queued jobs gets the same share of the threads' time, however
+ * many jobs it queues, so a flow of cheap jobs is not stuck behind a
+ * flood of another. cost_us is the time the job is expected to take, 0
+ * lets the pool use the flow's measured average. jobs of dispatch() and
+ * of strands go before any flow. in a pool that is not fair it is
+ * dispatch_job(). handle may be NULL. returns -1 if the job was not
+ * queued.
+ */
+int dispatch_flow(threadpool* from_me, job* handle, unsigned long key,
+                  long cost_us, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_keyed runs jobs of the same key in dispatch order and never
+ * two at once, jobs of other keys run in parallel as with dispatch().
+ * state touched only by the jobs of one key needs no lock.
+ */
+void dispatch_keyed(threadpool* from_me, unsigned long key,
+                    dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * create_strand returns a strand running its jobs on pool, NULL on
+ * failure
+ */
+strand* create_strand(threadpool* pool);
+
+/**
+ * strand_dispatch adds a job to the strand, it runs after every job
+ * dispatched to the strand before it
+ */
+void strand_dispatch(strand* s, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * destroy_strand waits for the jobs already dispatched to the strand,
+ * then frees it. it must not be called from one of those jobs.
+ */
+void destroy_strand(strand* s);
+
 /**
  * The work function of the thread
  */
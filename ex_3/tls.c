@@ -0,0 +1,263 @@
+//
+//  tls.c
+//  ex_3
+//
+
+#include "tls.h"
+#include "coro.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define TRUE 1
+#define FALSE 0
+#define MS_IN_SEC 1000
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+
+static const unsigned char session_id_ctx[] = "webserver/1.1";
+/*ALPN protocols in order of preference, length prefixed*/
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static int tls_alpn_select(SSL* ssl, const unsigned char** out,
+                           unsigned char* outlen, const unsigned char* in,
+                           unsigned int inlen, void* arg);
+static void tls_set_errno(int err);
+static long now_ms(void);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+tls_server* create_tls_server(const char* cert_path, const char* key_path){
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx){
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1){
+        fprintf(stderr, "Error on loading TLS certificate or key\n");
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    /*resumption: server side session cache for session ids, tickets
+     *(on by default) for stateless resumption*/
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+    SSL_CTX_set_session_id_context(ctx, session_id_ctx,
+                                   sizeof(session_id_ctx)-1);
+    SSL_CTX_set_alpn_select_cb(ctx, tls_alpn_select, NULL);
+
+    tls_server* server = (tls_server*)malloc(sizeof(tls_server));
+    if (!server){
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    server->ctx = ctx;
+    server->ktls = FALSE;
+#ifdef SSL_OP_ENABLE_KTLS
+    /*the record layer moves to the kernel after the handshake if the
+     *tls module is loaded and the cipher is supported*/
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    server->ktls = TRUE;
+#endif
+    return server;
+}
+
+//----------------------------------------------------------------------------//
+tls_conn* tls_accept(tls_server* server, int sock_fd, int timeout_ms){
+    int rc, err, left;
+    long deadline = now_ms() + timeout_ms;
+    struct timeval limit = {timeout_ms/MS_IN_SEC, timeout_ms%MS_IN_SEC*1000};
+    struct timeval saved[2];
+    socklen_t len = sizeof(struct timeval);
+    int blocking = !(fcntl(sock_fd, F_GETFL) & O_NONBLOCK);
+    SSL* ssl = SSL_new((SSL_CTX*)server->ctx);
+    if (!ssl)
+        return NULL;
+    if (SSL_set_fd(ssl, sock_fd) != 1){
+        SSL_free(ssl);
+        return NULL;
+    }
+    /*a blocking socket gets the deadline as its socket timeouts, a stalled
+     read or write then fails like a non blocking one and ends below*/
+    if (blocking){
+        getsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &saved[0], &len);
+        getsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &saved[1], &len);
+        setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+        setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    }
+    /*a non blocking socket waits for the peer between handshake steps*/
+    while ((rc = SSL_accept(ssl)) != 1) {
+        err = SSL_get_error(ssl, rc);
+        left = (int)(deadline - now_ms());
+        if ((err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) ||
+            left <= 0 ||
+            co_wait_fd(sock_fd, err == SSL_ERROR_WANT_READ ? CO_READ :
+                                                             CO_WRITE,
+                       left) == -1){
+            SSL_free(ssl);
+            ssl = NULL;
+            ERR_clear_error();
+            break;
+        }
+    }
+    if (blocking){
+        setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &saved[0], len);
+        setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &saved[1], len);
+    }
+    return ssl;
+}
+
+//----------------------------------------------------------------------------//
+ssize_t tls_read(tls_conn* conn, void* buf, size_t len){
+    size_t done = 0;
+    int err;
+    if (SSL_read_ex(conn, buf, len, &done) == 1)
+        return (ssize_t)done;
+    err = SSL_get_error(conn, 0);
+    if (err == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    tls_set_errno(err);
+    ERR_clear_error();
+    return -1;
+}
+
+//----------------------------------------------------------------------------//
+ssize_t tls_write(tls_conn* conn, const void* buf, size_t len){
+    size_t done = 0;
+    if (SSL_write_ex(conn, buf, len, &done) == 1)
+        return (ssize_t)done;
+    tls_set_errno(SSL_get_error(conn, 0));
+    ERR_clear_error();
+    return -1;
+}
+
+//----------------------------------------------------------------------------//
+ssize_t tls_sendfile(tls_conn* conn, int file_fd, off_t* offset, size_t size){
+#ifdef SSL_OP_ENABLE_KTLS
+    ssize_t sent;
+    if (BIO_get_ktls_send(SSL_get_wbio(conn))){
+        sent = SSL_sendfile(conn, file_fd, *offset, size, 0);
+        if (sent > 0)
+            *offset += sent;
+        else
+            ERR_clear_error();
+        return sent;
+    }
+#endif
+    errno = ENOTSUP;
+    return -1;
+}
+
+//----------------------------------------------------------------------------//
+int tls_pending(tls_conn* conn){
+    return SSL_pending(conn) > 0;
+}
+
+//----------------------------------------------------------------------------//
+int tls_selected_h2(tls_conn* conn){
+    const unsigned char* proto = NULL;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(conn, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+//----------------------------------------------------------------------------//
+void tls_close(tls_conn* conn){
+    SSL_shutdown(conn);
+    SSL_free(conn);
+    ERR_clear_error();
+}
+
+//----------------------------------------------------------------------------//
+void destroy_tls_server(tls_server* server){
+    if (!server)
+        return;
+    SSL_CTX_free((SSL_CTX*)server->ctx);
+    free(server);
+}
+
+//----------------------------------------------------------------------------//
+static int tls_alpn_select(SSL* ssl, const unsigned char** out,
+                           unsigned char* outlen, const unsigned char* in,
+                           unsigned int inlen, void* arg){
+    if (SSL_select_next_proto((unsigned char**)out, outlen, alpn_protos,
+                              sizeof(alpn_protos)-1, in, inlen)
+                                                    != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * a call that would block on a non blocking socket fails with EAGAIN,
+ * like read() and write() do
+ */
+static void tls_set_errno(int err){
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        errno = EAGAIN;
+    else if (err != SSL_ERROR_SYSCALL)
+        errno = EPROTO;
+}
+
+//----------------------------------------------------------------------------//
+static long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*MS_IN_SEC + ts.tv_nsec/1000000;
+}
+
+#else /*HAVE_OPENSSL*/
+
+tls_server* create_tls_server(const char* cert_path, const char* key_path){
+    fprintf(stderr, "server was built without TLS support\n");
+    return NULL;
+}
+
+tls_conn* tls_accept(tls_server* server, int sock_fd, int timeout_ms){
+    return NULL;
+}
+
+ssize_t tls_read(tls_conn* conn, void* buf, size_t len){
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tls_write(tls_conn* conn, const void* buf, size_t len){
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tls_sendfile(tls_conn* conn, int file_fd, off_t* offset, size_t size){
+    errno = ENOTSUP;
+    return -1;
+}
+
+int tls_pending(tls_conn* conn){
+    return FALSE;
+}
+
+int tls_selected_h2(tls_conn* conn){
+    return FALSE;
+}
+
+void tls_close(tls_conn* conn){
+}
+
+void destroy_tls_server(tls_server* server){
+}
+
+#endif /*HAVE_OPENSSL*/
@@ -0,0 +1,87 @@
+//
+//  tls.h
+//  ex_3
+//
+
+#ifndef tls_h
+#define tls_h
+
+#include <sys/types.h>
+
+/*TLS needs OpenSSL, build with -DHAVE_OPENSSL and link -lssl -lcrypto.
+ *without it create_tls_server() always fails.*/
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+typedef SSL tls_conn;
+#else
+typedef struct _tls_conn_st tls_conn;
+#endif
+
+// session cache entries kept by the server for id based resumption
+#define TLS_SESSION_CACHE 20480
+
+
+/**
+ * server side TLS context, shared by all connections
+ */
+typedef struct _tls_server_st {
+    void* ctx;      //SSL_CTX
+    int ktls;       //1 if kernel TLS offload was requested from OpenSSL
+} tls_server;
+
+
+/**
+ * create_tls_server loads a PEM certificate chain and private key and
+ * prepares the context: session cache and tickets for resumption, ALPN
+ * ("h2", then "http/1.1"), and kernel TLS where OpenSSL and the kernel
+ * support it.
+ * returns NULL on failure, after printing the reason.
+ */
+tls_server* create_tls_server(const char* cert_path, const char* key_path);
+
+/**
+ * tls_accept runs the server handshake on a connected socket. on a non
+ * blocking socket the calling coroutine waits for the peer in between.
+ * returns NULL if the handshake failed or took more than timeout_ms.
+ */
+tls_conn* tls_accept(tls_server* server, int sock_fd, int timeout_ms);
+
+/**
+ * tls_read and tls_write behave like read() and write(): they return
+ * the number of bytes moved, 0 on a clean close and -1 on error, with
+ * errno EAGAIN if a non blocking socket is not ready.
+ */
+ssize_t tls_read(tls_conn* conn, void* buf, size_t len);
+
+ssize_t tls_write(tls_conn* conn, const void* buf, size_t len);
+
+/**
+ * tls_sendfile sends up to size bytes of file_fd from *offset, straight
+ * from the page cache when the kernel holds the send key (kTLS).
+ * advances *offset. returns -1 with errno ENOTSUP when kTLS is not
+ * active, so the caller can copy through user space instead.
+ */
+ssize_t tls_sendfile(tls_conn* conn, int file_fd, off_t* offset, size_t size);
+
+/**
+ * tls_pending returns TRUE if decrypted data is waiting to be read.
+ */
+int tls_pending(tls_conn* conn);
+
+/**
+ * tls_selected_h2 returns TRUE if the client picked HTTP/2 through ALPN.
+ */
+int tls_selected_h2(tls_conn* conn);
+
+/**
+ * tls_close sends close_notify and frees the connection, the socket
+ * itself is left open.
+ */
+void tls_close(tls_conn* conn);
+
+/**
+ * destroy_tls_server frees the context.
+ */
+void destroy_tls_server(tls_server* server);
+
+#endif /* tls_h */
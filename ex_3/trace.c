@@ -0,0 +1,147 @@
+//
+//  trace.c
+//  ex_3
+//
+
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRUE 1
+#define FALSE 0
+
+//----------------------------------------------------------------------------//
+//------------------------PRIVATE FUNCTION DECLARATION------------------------//
+//----------------------------------------------------------------------------//
+static int thread_index(void);
+static void write_event(tracer* tr, const char* phase, const char* name,
+                        const trace_request* request, int tid, int64_t ts,
+                        int64_t dur);
+//----------------------------------------------------------------------------//
+//----------------------FUNCTIONS IMPLEMENTATION------------------------------//
+//----------------------------------------------------------------------------//
+tracer* create_tracer(const char* path, uint32_t sample_every){
+    tracer* tr = (tracer*)calloc(1, sizeof(tracer));
+    if (!tr)
+        return NULL;
+    tr->file = fopen(path, "w");
+    if (!tr->file){
+        perror("Error on trace open");
+        free(tr);
+        return NULL;
+    }
+    pthread_mutex_init(&tr->lock, NULL);
+    tr->sample_every = sample_every ? sample_every : 1;
+    atomic_init(&tr->requests, 0);
+    tr->first = TRUE;
+    /*the array may be left open if the server is killed, which the trace
+     *event format allows*/
+    fputs("[\n", tr->file);
+    return tr;
+}
+
+//----------------------------------------------------------------------------//
+int tracer_sample(tracer* tr, trace_request* request){
+    uint64_t n = atomic_fetch_add_explicit(&tr->requests, 1,
+                                           memory_order_relaxed);
+    if (n % tr->sample_every != 0)
+        return FALSE;
+    memset(request, 0, sizeof(trace_request));
+    request->id = n+1;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------//
+void tracer_write(tracer* tr, const trace_request* request){
+    static const char* stages[TRACE_STAGES] = {"queue", "receive", "resolve",
+                                               "headers", "body", NULL};
+    int tid = thread_index();
+    int64_t end = 0;
+    int i;
+
+    for (i=0; i<TRACE_STAGES; i++)
+        if (request->at[i])
+            end = request->at[i];
+
+    pthread_mutex_lock(&tr->lock);
+    /*queueing overlaps whatever the worker was busy with, so it and the
+     *enclosing request span go on async tracks, keyed by the request id*/
+    if (request->at[TS_DISPATCH] && end){
+        write_event(tr, "b", "request", request, tid,
+                    request->at[TS_DISPATCH], 0);
+        if (request->at[TS_PICKUP]){
+            write_event(tr, "b", "queue", request, tid,
+                        request->at[TS_DISPATCH], 0);
+            write_event(tr, "e", "queue", request, tid,
+                        request->at[TS_PICKUP], 0);
+        }
+        write_event(tr, "e", "request", request, tid, end, 0);
+    }
+    for (i=TS_PICKUP; i<TRACE_STAGES-1; i++)
+        if (request->at[i] && request->at[i+1])
+            write_event(tr, "X", stages[i], request, tid, request->at[i],
+                        request->at[i+1]-request->at[i]);
+    fflush(tr->file);
+    pthread_mutex_unlock(&tr->lock);
+}
+
+//----------------------------------------------------------------------------//
+int64_t trace_now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+//----------------------------------------------------------------------------//
+void destroy_tracer(tracer* tr){
+    if (!tr)
+        return;
+    fputs("\n]\n", tr->file);
+    fclose(tr->file);
+    pthread_mutex_destroy(&tr->lock);
+    free(tr);
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * small, stable thread ids for the trace viewer
+ */
+static int thread_index(void){
+    static _Atomic int next_index = 1;
+    static __thread int index = 0;
+    if (!index)
+        index = atomic_fetch_add(&next_index, 1);
+    return index;
+}
+
+//----------------------------------------------------------------------------//
+/**
+ * one event, called with the lock held. the request line goes into args
+ * with JSON escaping.
+ */
+static void write_event(tracer* tr, const char* phase, const char* name,
+                        const trace_request* request, int tid, int64_t ts,
+                        int64_t dur){
+    const char* c;
+
+    fprintf(tr->file, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%s\","
+            "\"pid\":1,\"tid\":%d,\"ts\":%lld",
+            tr->first ? "" : ",\n", name, phase, tid, (long long)ts);
+    tr->first = FALSE;
+    if (phase[0] == 'X')
+        fprintf(tr->file, ",\"dur\":%lld", (long long)dur);
+    else
+        fprintf(tr->file, ",\"id\":%llu", (unsigned long long)request->id);
+    fprintf(tr->file, ",\"args\":{\"id\":%llu,\"request\":\"",
+            (unsigned long long)request->id);
+    for (c=request->name; *c && c<request->name+TRACE_NAME_LEN; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(tr->file, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            fprintf(tr->file, "\\u%04x", (unsigned char)*c);
+        else
+            fputc(*c, tr->file);
+    }
+    fputs("\"}}", tr->file);
+}
@@ -0,0 +1,98 @@
+//
+//  trace.h
+//  ex_3
+//
+
+#ifndef trace_h
+#define trace_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * static probes: USDT (systemtap sdt.h) where it is installed, nothing
+ * otherwise. a USDT probe is a single nop until a tracer attaches, e.g.
+ *   bpftrace -e 'usdt:./server:webserver:body_done { @[arg0] = count(); }'
+ */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define TRACE_PROBE1(provider, name, a) DTRACE_PROBE1(provider, name, a)
+#define TRACE_PROBE2(provider, name, a, b) DTRACE_PROBE2(provider, name, a, b)
+#else
+#define TRACE_PROBE1(provider, name, a) do {} while (0)
+#define TRACE_PROBE2(provider, name, a, b) do {} while (0)
+#endif
+
+// stage boundaries of a request, in order
+#define TS_DISPATCH 0   //queued to the pool
+#define TS_PICKUP 1     //taken by a worker
+#define TS_PARSED 2     //request received and split
+#define TS_RESOLVED 3   //path resolved, body chosen
+#define TS_HEADERS 4    //response head built
+#define TS_BODY 5       //last byte handed to the socket
+#define TRACE_STAGES 6
+// request line bytes kept as the span name
+#define TRACE_NAME_LEN 100
+
+
+/**
+ * stage times of one sampled request, 0 for stages it did not reach
+ */
+typedef struct _trace_request {
+    uint64_t id;
+    int64_t at[TRACE_STAGES];   //microseconds, trace_now_us()
+    char name[TRACE_NAME_LEN];
+} trace_request;
+
+
+/**
+ * sampled in-process tracer, writing Chrome trace-event JSON (open in
+ * Perfetto or chrome://tracing)
+ */
+typedef struct _tracer_st {
+    FILE* file;
+    pthread_mutex_t lock;
+    uint32_t sample_every;      //trace one request in sample_every
+    _Atomic uint64_t requests;  //requests seen by tracer_sample()
+    int first;                  //1 until the first event is written
+} tracer;
+
+
+/**
+ * create_tracer truncates path and starts the event array.
+ * returns NULL on failure.
+ */
+tracer* create_tracer(const char* path, uint32_t sample_every);
+
+/**
+ * tracer_sample decides whether the next request is traced. on TRUE it
+ * resets request, giving it a fresh id.
+ */
+int tracer_sample(tracer* tr, trace_request* request);
+
+/**
+ * tracer_write emits the spans of a finished request: queueing and the
+ * whole request as async spans of their own, the stages on the calling
+ * worker's thread.
+ */
+void tracer_write(tracer* tr, const trace_request* request);
+
+/**
+ * trace_now_us is the monotonic clock the stages are stamped with
+ */
+int64_t trace_now_us(void);
+
+/**
+ * destroy_tracer closes the event array and the file
+ */
+void destroy_tracer(tracer* tr);
+
+#endif /* trace_h */